@@ -1,7 +1,22 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstdarg>
 #include <cstring>
 #include <cmath>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <climits>
+#include <new>
 using namespace std;
 
 // sequence of statements separated by ;
@@ -43,6 +58,85 @@ void AllocateAndCopy(char** a, const char* b)
     strcpy(*a, b);
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Arena ///////////////////////////////////////////////////////////////////////////
+
+// Bump allocator for the objects of one compilation: tree nodes, names and line
+// lists. Nothing is freed one by one, Reset frees everything at once and keeps the
+// blocks, so compiling the next program reuses the same memory.
+const size_t ARENA_BLOCK_SIZE=1<<16;
+
+struct ArenaBlock
+{
+    ArenaBlock* next;
+    size_t size, used;
+    char* Data() {return (char*)(this+1);}
+};
+
+struct Arena
+{
+    ArenaBlock* first;
+    ArenaBlock* cur;
+
+    long long num_allocs; // since the last Reset
+    long long num_bytes;
+    int num_blocks; // malloc'd, kept across resets
+
+    Arena() {first=cur=0; num_allocs=num_bytes=0; num_blocks=0;}
+    ~Arena() {Free();}
+
+    void* Alloc(size_t size)
+    {
+        size=(size+7)&~(size_t)7;
+        if(!cur || cur->used+size>cur->size) NextBlock(size);
+        void* p=cur->Data()+cur->used;
+        cur->used+=size;
+        num_allocs++; num_bytes+=size;
+        return p;
+    }
+
+    char* Copy(const char* str)
+    {
+        int n=strlen(str);
+        char* a=(char*)Alloc(n+1);
+        memcpy(a, str, n+1);
+        return a;
+    }
+
+    // Moves to the next kept block if it is big enough, or inserts a new one after cur
+    void NextBlock(size_t size)
+    {
+        ArenaBlock* next=cur ? cur->next : first;
+        if(!next || next->size<size)
+        {
+            size_t block_size=(size>ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+            ArenaBlock* b=(ArenaBlock*)malloc(sizeof(ArenaBlock)+block_size);
+            b->size=block_size;
+            b->next=next;
+            if(cur) cur->next=b; else first=b;
+            next=b;
+            num_blocks++;
+        }
+        next->used=0;
+        cur=next;
+    }
+
+    // O(1), the blocks after the first are cleared when they are reached again
+    void Reset()
+    {
+        cur=first;
+        if(cur) cur->used=0;
+        num_allocs=num_bytes=0;
+    }
+
+    void Free()
+    {
+        while(first) {ArenaBlock* b=first; first=first->next; free(b);}
+        cur=0; num_blocks=0;
+        num_allocs=num_bytes=0;
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////////
 // Input and Output ////////////////////////////////////////////////////////////////
 
@@ -88,7 +182,7 @@ struct InFile
 
     bool GetNewLine()
     {
-        cur_ind=0; line_buf[0]=0;
+        cur_ind=0; cur_line_size=0; line_buf[0]=0;
         if(!fgets(line_buf, MAX_LINE_LENGTH, file)) return false;
         cur_line_size=strlen(line_buf);
         if(cur_line_size==0) return false; // End of file
@@ -117,22 +211,157 @@ struct OutFile
 
     void Out(const char* s)
     {
+        if(!file) return; // no file name given
         fprintf(file, "%s\n", s); fflush(file);
     }
 };
 
+// Growable in memory output, used to collect the output of one run
+struct OutBuffer
+{
+    char* buf;
+    int size, capacity;
+
+    OutBuffer() {buf=0; size=capacity=0;}
+    ~OutBuffer() {if(buf) free(buf);}
+
+    void Reserve(int n)
+    {
+        if(size+n<=capacity) return;
+        while(size+n>capacity) capacity=capacity ? 2*capacity : 256;
+        buf=(char*)realloc(buf, capacity);
+    }
+
+    void Append(const char* s, int n) {Reserve(n); memcpy(buf+size, s, n); size+=n;}
+
+    void Print(const char* fmt, ...)
+    {
+        char tmp[256];
+        va_list args;
+        va_start(args, fmt);
+        int n=vsnprintf(tmp, sizeof(tmp), fmt, args);
+        va_end(args);
+        if(n>=(int)sizeof(tmp)) n=sizeof(tmp)-1;
+        if(n>0) Append(tmp, n);
+    }
+
+    void Clear() {size=0;}
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+// Timing //////////////////////////////////////////////////////////////////////////
+
+// Wall clock time in seconds, used for benchmarks
+double GetTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 // Compiler Parameters /////////////////////////////////////////////////////////////
 
+// Limits for running untrusted programs, 0 means no limit. Loop iterations are counted
+// at repeat back-edges only, and the time limit is a flag set by a Watchdog thread which
+// is polled every LIMIT_POLL_INTERVAL back-edges, so a run without limits pays one compare
+// per loop iteration.
+struct RunLimits
+{
+    long long max_back_edges;
+    long long max_output_bytes;
+    int max_time_ms;
+    atomic<bool>* time_up;
+
+    RunLimits() {max_back_edges=0; max_output_bytes=0; max_time_ms=0; time_up=0;}
+};
+
+// Set from the command line in main()
+struct CompilerOptions
+{
+    const char* in_str;
+    bool print_xref; // print the line numbers of each variable in the symbol table
+    const char* read_str; // file with the values of read statements ("-" for stdin), 0 to prompt
+    const char* records_str; // file of input records to run the program over, 0 to run it once
+    bool bench_records; // compare the batch engine with one RunProgram per record
+    const char* diag_json_str; // file to write the errors to as JSON lines ("-" for stdout), 0 for none
+    RunLimits limits;
+    int num_threads; // run the records on this many worker threads instead of the batch engine, 0 for the batch engine
+    int lex_threads; // scan the whole source on this many threads before parsing, 0 to scan while parsing
+    bool lex_pipe; // scan on another thread while parsing, see TokenPipe
+    bool bench_lex; // compare the parallel scanner with GetNextToken
+    bool stream; // run each top level statement as soon as it is parsed, see StartStreaming
+    bool flat; // run the flat tree instead of the syntax tree
+    bool bench_ast; // compare the size and walking speed of the syntax tree and the flat tree
+    int bench_compile; // compile the input file this many times with and without an arena
+    int bench_api; // run the input file this many times through the library interface
+    bool sessions; // run the records as interleaved sessions on one thread, see SessionScheduler
+    bool bench_sessions; // compare the sessions with one RunProgram per record
+    int analyze_threads; // type check the top level statements on this many threads, 0 for serial analysis
+    bool bench_analyze; // compare the parallel analyzer with Analyze
+    bool bench_threads; // measure the scaling of the records workers from 1 thread to all cores
+    int bench_symtab; // number of identifiers for the symbol table benchmark, 0 to compile normally
+    int bench_input; // number of values for the input parsing benchmark
+    bool perf; // print hardware counters per compiler phase and per kind of node run
+    int loop_threads; // split reduction repeat loops over this many threads, 0 to run them serially
+    bool fp_reassociate; // with loop_threads, also split loops with real reductions, see RunLoopParallel
+    const char* specialize_str; // file with the values of the first read statements, write the residual program instead of running, see Specialize
+    const char* residual_str; // file to write the residual program to, 0 for stdout
+    const char* profile_out_str; // file to write the statement counts of the run to, see ProfileFeedback
+    const char* profile_in_str; // profile of an earlier run to optimize with
+    bool tier_up; // switch hot repeat loops to the flat tree while running, see RunLoopTier
+    bool closed_form; // set the results of counting loops with polynomial sums instead of running them
+    const char* checkpoint_str; // file to write the state of the run to, see Checkpoint
+    int checkpoint_ms; // time between checkpoints
+    const char* resume_str; // checkpoint to go on from
+    bool run_ir; // run the program from its SSA form, see RunIr
+    bool dump_ir; // print the SSA form with the registers
+    bool bench_ir; // compare RunIr with RunProgram
+    const char* cost_str; // file to write the cost estimate to as JSON ("-" for stdout) instead of running, see EstimateCost
+    bool lazy; // parse if and repeat bodies when they are first run, see ExpandLazy
+
+    CompilerOptions()
+    {
+        in_str="input.txt"; print_xref=true; read_str=0; diag_json_str=0;
+        records_str=0; bench_records=false; num_threads=0; bench_threads=false;
+        lex_threads=0; lex_pipe=false; bench_lex=false;
+        analyze_threads=0; bench_analyze=false;
+        stream=false; flat=false; bench_ast=false;
+        bench_compile=0; bench_api=0;
+        sessions=false; bench_sessions=false;
+        bench_symtab=0; bench_input=0;
+        perf=false;
+        loop_threads=0; fp_reassociate=false;
+        specialize_str=0; residual_str=0;
+        profile_out_str=0; profile_in_str=0;
+        tier_up=true;
+        closed_form=true;
+        checkpoint_str=0; checkpoint_ms=10000; resume_str=0;
+        run_ir=false; dump_ir=false; bench_ir=false;
+        cost_str=0;
+        lazy=false;
+    }
+};
+
+struct TokenArray;
+struct TokenPipe;
+
 struct CompilerInfo
 {
     InFile in_file;
     OutFile out_file;
     OutFile debug_file;
+    CompilerOptions options;
+
+    // tokens scanned ahead of parsing, 0 to scan in_file while parsing
+    TokenArray* token_array;
+    int token_pos;
+    TokenPipe* token_pipe; // tokens scanned on another thread while parsing, 0 if none
 
     CompilerInfo(const char* in_str, const char* out_str, const char* debug_str)
                 : in_file(in_str), out_file(out_str), debug_file(debug_str)
     {
+        token_array=0; token_pos=0; token_pipe=0;
     }
 };
 
@@ -151,7 +380,8 @@ enum TokenType{
                 ID, NUM,
                 ENDFILE, ERROR,
                 AND_OPER,
-                INT_TYPE, REAL_TYPE, BOOL_TYPE  // this line
+                INT_TYPE, REAL_TYPE, BOOL_TYPE,  // this line
+                LEFT_BRACKET, RIGHT_BRACKET
               };
 
 // Used for debugging only /////////////////////////////////////////////////////////
@@ -166,7 +396,8 @@ const char* TokenTypeStr[]=
                 "ID", "Num",
                 "EndFile", "Error",
                 "AndOper",
-                "IntType", "RealType", "BoolType"  //this line
+                "IntType", "RealType", "BoolType",  //this line
+                "LeftBracket", "RightBracket"
             };
 
 struct Token
@@ -210,10 +441,92 @@ const Token symbolic_tokens[]=
     Token(RIGHT_PAREN, ")"),
     Token(LEFT_BRACE, "{"),
     Token(RIGHT_BRACE, "}"),
-    Token(AND_OPER, "&")
+    Token(AND_OPER, "&"),
+    Token(LEFT_BRACKET, "["),
+    Token(RIGHT_BRACKET, "]")
 };
 const int num_symbolic_tokens=sizeof(symbolic_tokens)/sizeof(symbolic_tokens[0]);
 
+// A token scanned ahead of parsing. The text stays in the source buffer.
+struct LexToken
+{
+    unsigned char type;
+    unsigned char len; // at most MAX_TOKEN_LEN
+    int line_num;
+    long long offset; // of the token text in the source buffer
+};
+
+struct TokenArray
+{
+    const char* source;
+    LexToken* tokens;
+    int num, capacity;
+
+    TokenArray() {source=0; tokens=0; num=capacity=0;}
+    ~TokenArray() {if(tokens) free(tokens);}
+
+    void Add(TokenType type, const char* s, int len, int line_num)
+    {
+        if(num==capacity)
+        {
+            capacity=capacity ? 2*capacity : 1024;
+            tokens=(LexToken*)realloc(tokens, capacity*sizeof(LexToken));
+        }
+        LexToken* t=&tokens[num++];
+        t->type=type;
+        t->len=(len>MAX_TOKEN_LEN) ? MAX_TOKEN_LEN : len;
+        t->line_num=line_num;
+        t->offset=s-source;
+    }
+
+    void Clear() {num=0;}
+};
+
+const unsigned int TOKEN_RING_SIZE=1<<12; // tokens, a power of 2
+const unsigned int TOKEN_BATCH=256; // tokens published or released at a time, divides TOKEN_RING_SIZE
+
+// Tokens scanned on another thread while parsing, see Pipelined Scanner. The lexer
+// thread is the only writer of the ring and of head, the parser the only writer of tail.
+struct TokenPipe
+{
+    const char* source;
+    long long size;
+    LexToken ring[TOKEN_RING_SIZE];
+    alignas(64) atomic<unsigned int> head; // tokens written by the lexer
+    alignas(64) atomic<unsigned int> tail; // tokens the parser is done with
+    alignas(64) atomic<bool> stop; // the parser won't take more
+    unsigned int read_pos, read_limit; // the parser's position and the head it saw last
+    LexToken last; // the ENDFILE token, repeated once reached
+    bool at_end;
+    long long num_waits; // times the parser found the ring empty
+    thread lexer;
+
+    TokenPipe() {source=0; size=0; head=0; tail=0; stop=false; read_pos=read_limit=0; at_end=false; num_waits=0;}
+    ~TokenPipe() {Stop();}
+
+    void Start(const char* source, long long size);
+    void Stop();
+
+    void Refill()
+    {
+        tail.store(read_pos, memory_order_release); // the lexer may be waiting for room
+        num_waits++;
+        int spins=0;
+        while((read_limit=head.load(memory_order_acquire))==read_pos)
+            if(++spins>64) this_thread::yield();
+    }
+
+    void Pop(LexToken* t)
+    {
+        if(at_end) {*t=last; return;}
+        if(read_pos==read_limit) Refill();
+        *t=ring[read_pos&(TOKEN_RING_SIZE-1)];
+        read_pos++;
+        if((read_pos&(TOKEN_BATCH-1))==0) tail.store(read_pos, memory_order_release);
+        if(t->type==ENDFILE) {at_end=true; last=*t;}
+    }
+};
+
 inline bool IsDigit(char ch){return (ch>='0' && ch<='9');}
 inline bool IsLetter(char ch){return ((ch>='a' && ch<='z') || (ch>='A' && ch<='Z'));}
 inline bool IsLetterOrUnderscore(char ch){return (IsLetter(ch) || ch=='_');}
@@ -223,6 +536,30 @@ void GetNextToken(CompilerInfo* pci, Token* ptoken)
     ptoken->type=ERROR;
     ptoken->str[0]=0;
 
+    if(pci->token_array || pci->token_pipe)
+    {
+        LexToken pipe_token;
+        const LexToken* t=&pipe_token;
+        const char* source;
+        if(pci->token_array)
+        {
+            TokenArray* ta=pci->token_array;
+            t=&ta->tokens[pci->token_pos];
+            if(pci->token_pos<ta->num-1) pci->token_pos++; // stays at the last token, which is ENDFILE
+            source=ta->source;
+        }
+        else
+        {
+            pci->token_pipe->Pop(&pipe_token);
+            source=pci->token_pipe->source;
+        }
+        ptoken->type=(TokenType)t->type;
+        memcpy(ptoken->str, source+t->offset, t->len); // the source may not end in a 0
+        ptoken->str[t->len]=0;
+        pci->in_file.cur_line_num=t->line_num;
+        return;
+    }
+
     int i;
     char* s=pci->in_file.GetNextTokenStr();
     if(!s)
@@ -289,11 +626,394 @@ else if (IsDigit(s[0]))               //from this line
             }
         }
     }
+    else Copy(ptoken->str, s, 1); // unknown character, skip it as an error token
 
     int len=strlen(ptoken->str);
     if(len>0) pci->in_file.Advance(len);
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Parallel Scanner ////////////////////////////////////////////////////////////////
+
+// The source is split at line boundaries into chunks which are scanned on several
+// threads, each chunk into its own token array. A chunk is scanned assuming it doesn't
+// start inside a { } comment. A serial pass then goes over the chunks in order and scans
+// again the (rare) chunks that actually start inside a comment opened in an earlier chunk.
+// Finally the chunks are stitched into one array, with the line numbers made absolute.
+
+const int MIN_LEX_CHUNK_SIZE=1<<16;
+
+struct LexChunk
+{
+    const char* begin;
+    const char* end;
+    TokenArray tokens; // line numbers relative to the chunk, starting at 0
+    int num_newlines;
+    bool starts_in_comment;
+    bool ends_in_comment;
+};
+
+inline int CountNewlines(const char* p, const char* end)
+{
+    int n=0;
+    while((p=(const char*)memchr(p, '\n', end-p))) {n++; p++;}
+    return n;
+}
+
+// Scans the tokens of a buffer one at a time, the same way GetNextToken scans a file
+struct LexScanner
+{
+    const char* source; // token offsets are from here
+    const char* p;
+    const char* end;
+    int line;
+    bool in_comment; // at the end, a comment isn't closed
+
+    LexScanner(const char* _source, const char* begin, const char* _end, int first_line, bool _in_comment)
+    {
+        source=_source; p=begin; end=_end; line=first_line; in_comment=_in_comment;
+    }
+
+    // Returns false at the end of the buffer
+    bool Next(LexToken* t)
+    {
+        int i;
+        while(true)
+        {
+            if(in_comment)
+            {
+                const char* q=(const char*)memchr(p, '}', end-p);
+                if(!q) {line+=CountNewlines(p, end); p=end; return false;}
+                line+=CountNewlines(p, q);
+                p=q+1;
+                in_comment=false;
+            }
+
+            while(p<end && (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n')) {if(*p=='\n') line++; p++;}
+            if(p==end) return false;
+            if(*p!='{') break;
+            p++;
+            in_comment=true;
+        }
+
+        const char* s=p;
+        TokenType type=ERROR;
+        for(i=0;i<num_symbolic_tokens;i++)
+        {
+            const char* sym=symbolic_tokens[i].str;
+            if(p[0]==sym[0] && (sym[1]==0 || (p+1<end && p[1]==sym[1]))) break;
+        }
+
+        if(i<num_symbolic_tokens)
+        {
+            type=symbolic_tokens[i].type;
+            p+=strlen(symbolic_tokens[i].str);
+        }
+        else if(IsDigit(p[0]))
+        {
+            type=INT_TYPE;
+            p++;
+            while(p<end && IsDigit(*p)) p++;
+            if(p<end && *p=='.')
+            {
+                type=REAL_TYPE;
+                p++;
+                while(p<end && IsDigit(*p)) p++;
+            }
+        }
+        else if(IsLetterOrUnderscore(p[0]))
+        {
+            p++;
+            while(p<end && IsLetterOrUnderscore(*p)) p++;
+            type=ID;
+            int len=p-s;
+            for(i=0;i<num_reserved_words;i++)
+            {
+                const char* word=reserved_words[i].str;
+                if((int)strlen(word)==len && strncmp(s, word, len)==0) {type=reserved_words[i].type; break;}
+            }
+        }
+        else p++; // unknown character
+
+        int len=p-s;
+        t->type=type;
+        t->len=(len>MAX_TOKEN_LEN) ? MAX_TOKEN_LEN : len;
+        t->line_num=line;
+        t->offset=s-source;
+        return true;
+    }
+};
+
+// Scans the chunk, the line numbers start at 0
+void LexChunkTokens(LexChunk* chunk, bool in_comment)
+{
+    chunk->tokens.Clear();
+    chunk->starts_in_comment=in_comment;
+    chunk->num_newlines=CountNewlines(chunk->begin, chunk->end);
+
+    LexScanner scanner(chunk->tokens.source, chunk->begin, chunk->end, 0, in_comment);
+    LexToken t;
+    while(scanner.Next(&t)) chunk->tokens.Add((TokenType)t.type, chunk->tokens.source+t.offset, t.len, t.line_num);
+    chunk->ends_in_comment=scanner.in_comment;
+}
+
+struct ParallelLexInfo
+{
+    LexChunk* chunks;
+    int num_chunks;
+    atomic<int> next_chunk;
+};
+
+void LexWorker(ParallelLexInfo* plx)
+{
+    while(true)
+    {
+        int k=plx->next_chunk++;
+        if(k>=plx->num_chunks) return;
+        LexChunkTokens(&plx->chunks[k], false);
+    }
+}
+
+// Scans source[0..size-1] into ta, ending with an ENDFILE token
+void LexParallel(const char* source, long long size, int num_threads, TokenArray* ta)
+{
+    int i, k;
+
+    int num_chunks=4*num_threads;
+    if(size/num_chunks<MIN_LEX_CHUNK_SIZE) num_chunks=size/MIN_LEX_CHUNK_SIZE;
+    if(num_chunks<1) num_chunks=1;
+
+    ParallelLexInfo plx;
+    plx.chunks=new LexChunk[num_chunks];
+    plx.num_chunks=num_chunks;
+    plx.next_chunk=0;
+
+    // chunk boundaries just after a newline
+    const char* p=source;
+    const char* end=source+size;
+    for(k=0;k<num_chunks;k++)
+    {
+        LexChunk* chunk=&plx.chunks[k];
+        chunk->begin=p;
+        chunk->tokens.source=source;
+        const char* q=(k==num_chunks-1) ? end : source+size*(k+1)/num_chunks;
+        if(q<p) q=p;
+        if(q<end) {q=(const char*)memchr(q, '\n', end-q); q=q ? q+1 : end;}
+        chunk->end=q;
+        p=q;
+    }
+
+    thread* workers=new thread[num_threads];
+    for(i=1;i<num_threads;i++) workers[i]=thread(LexWorker, &plx);
+    LexWorker(&plx);
+    for(i=1;i<num_threads;i++) workers[i].join();
+    delete[] workers;
+
+    // fix up the chunks whose comment state was guessed wrong
+    bool in_comment=false;
+    int total=0;
+    for(k=0;k<num_chunks;k++)
+    {
+        LexChunk* chunk=&plx.chunks[k];
+        if(chunk->starts_in_comment!=in_comment) LexChunkTokens(chunk, in_comment);
+        in_comment=chunk->ends_in_comment;
+        total+=chunk->tokens.num;
+    }
+
+    ta->source=source;
+    ta->Clear();
+    ta->capacity=total+2;
+    ta->tokens=(LexToken*)realloc(ta->tokens, ta->capacity*sizeof(LexToken));
+
+    int line_base=1;
+    for(k=0;k<num_chunks;k++)
+    {
+        LexChunk* chunk=&plx.chunks[k];
+        LexToken* dst=&ta->tokens[ta->num];
+        memcpy(dst, chunk->tokens.tokens, chunk->tokens.num*sizeof(LexToken));
+        for(i=0;i<chunk->tokens.num;i++) dst[i].line_num+=line_base;
+        ta->num+=chunk->tokens.num;
+        line_base+=chunk->num_newlines;
+    }
+
+    // the line number at end of file is the number of lines
+    int last_line=line_base-1;
+    if(size>0 && source[size-1]!='\n') last_line++;
+    if(in_comment) ta->Add(ERROR, end, 0, last_line); // comment not closed
+    ta->Add(ENDFILE, end, 0, last_line);
+
+    delete[] plx.chunks;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Pipelined Scanner ///////////////////////////////////////////////////////////////
+
+// With -lex-pipe a thread scans the source into the ring of a TokenPipe while the parser
+// takes the tokens out, so scanning and parsing overlap on two cores. The ring is lock
+// free with one producer and one consumer: the lexer publishes head once per TOKEN_BATCH
+// tokens and the parser releases tail as often, so the counters move between the cores
+// once per batch and not once per token. A side that has to wait publishes its own
+// counter first, then spins and yields. Unknown characters, an unclosed comment and the
+// end of the file go through the ring as tokens, as in the token array of LexParallel.
+
+struct TokenPipeWriter
+{
+    TokenPipe* pipe;
+    unsigned int pos; // tokens written
+    unsigned int limit; // pos at which the ring is full, as last seen
+    unsigned int published; // head as last stored
+
+    // Returns false if the parser stopped taking tokens
+    bool Push(const LexToken* t)
+    {
+        if(pos==limit)
+        {
+            Publish();
+            int spins=0;
+            while((limit=pipe->tail.load(memory_order_acquire)+TOKEN_RING_SIZE)==pos)
+            {
+                if(pipe->stop.load(memory_order_relaxed)) return false;
+                if(++spins>64) this_thread::yield();
+            }
+        }
+        pipe->ring[pos&(TOKEN_RING_SIZE-1)]=*t;
+        pos++;
+        if(pos-published>=TOKEN_BATCH) Publish();
+        return true;
+    }
+
+    void Publish() {pipe->head.store(pos, memory_order_release); published=pos;}
+};
+
+void LexPipeWorker(TokenPipe* pipe)
+{
+    TokenPipeWriter writer;
+    writer.pipe=pipe;
+    writer.pos=writer.published=0;
+    writer.limit=TOKEN_RING_SIZE;
+
+    LexScanner scanner(pipe->source, pipe->source, pipe->source+pipe->size, 1, false);
+    LexToken t;
+    while(scanner.Next(&t)) if(!writer.Push(&t)) return;
+
+    // the line number at end of file is the number of lines
+    t.len=0;
+    t.offset=pipe->size;
+    t.line_num=(pipe->size>0 && pipe->source[pipe->size-1]!='\n') ? scanner.line : scanner.line-1;
+    t.type=ERROR;
+    if(scanner.in_comment && !writer.Push(&t)) return; // comment not closed
+    t.type=ENDFILE;
+    if(!writer.Push(&t)) return;
+    writer.Publish();
+}
+
+// Starts scanning source[0..size-1] on a new thread, the tokens are taken by GetNextToken
+void TokenPipe::Start(const char* _source, long long _size)
+{
+    source=_source; size=_size;
+    head=0; tail=0; stop=false;
+    read_pos=read_limit=0; at_end=false; num_waits=0;
+    lexer=thread(LexPipeWorker, this);
+}
+
+// Lets the lexer thread end even if not all the tokens were taken
+void TokenPipe::Stop()
+{
+    stop=true;
+    if(lexer.joinable()) lexer.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Diagnostics /////////////////////////////////////////////////////////////////////
+
+// Syntax and semantic errors are collected instead of stopping at the first one,
+// so a single compile reports every error
+
+#define MAX_DIAGNOSTIC_LEN 200
+
+struct Diagnostic
+{
+    int line_num;
+    const char* phase; // "syntax" or "semantic"
+    char message[MAX_DIAGNOSTIC_LEN];
+};
+
+struct Diagnostics
+{
+    Diagnostic* items;
+    int num, capacity;
+
+    Diagnostics() {items=0; num=capacity=0;}
+    ~Diagnostics() {if(items) delete[] items;}
+
+    Diagnostic* NewItem()
+    {
+        if(num==capacity)
+        {
+            int new_capacity=capacity ? 2*capacity : 16;
+            Diagnostic* new_items=new Diagnostic[new_capacity];
+            if(items) {memcpy(new_items, items, num*sizeof(Diagnostic)); delete[] items;}
+            items=new_items; capacity=new_capacity;
+        }
+        return &items[num++];
+    }
+
+    void Add(const char* phase, int line_num, const char* fmt, ...)
+    {
+        Diagnostic* d=NewItem();
+        d->line_num=line_num;
+        d->phase=phase;
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(d->message, MAX_DIAGNOSTIC_LEN, fmt, args);
+        va_end(args);
+    }
+
+    // appends the errors of other after the ones already here
+    void Append(const Diagnostics* other)
+    {
+        int i;
+        for(i=0;i<other->num;i++) *NewItem()=other->items[i];
+    }
+
+    // stable, so errors on the same line keep the order they were found in
+    void SortByLine()
+    {
+        int i, j;
+        for(i=1;i<num;i++)
+        {
+            Diagnostic d=items[i];
+            for(j=i;j>0 && items[j-1].line_num>d.line_num;j--) items[j]=items[j-1];
+            items[j]=d;
+        }
+    }
+
+    void Print()
+    {
+        int i;
+        for(i=0;i<num;i++) printf("ERROR: %s at line %d\n", items[i].message, items[i].line_num);
+        fflush(NULL);
+    }
+
+    // One JSON object per line: {"line":3,"phase":"syntax","message":"..."}
+    void PrintJson(FILE* file)
+    {
+        int i;
+        const char* c;
+        for(i=0;i<num;i++)
+        {
+            fprintf(file, "{\"line\":%d,\"phase\":\"%s\",\"message\":\"", items[i].line_num, items[i].phase);
+            for(c=items[i].message;*c;c++)
+            {
+                if(*c=='"' || *c=='\\') fputc('\\', file);
+                if((unsigned char)*c>=' ') fputc(*c, file);
+            }
+            fprintf(file, "\"}\n");
+        }
+        fflush(file);
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////////
 // Parser //////////////////////////////////////////////////////////////////////////
 
@@ -302,34 +1022,41 @@ else if (IsDigit(s[0]))               //from this line
 // stmt -> ifstmt | repeatstmt | assignstmt | readstmt | writestmt
 // ifstmt -> if exp then stmtseq [ else stmtseq ] end
 // repeatstmt -> repeat stmtseq until expr
-// assignstmt -> identifier := expr
-// readstmt -> read identifier
+// assignstmt -> identifier [ '[' mathexpr ']' ] := expr
+// readstmt -> read identifier [ '[' mathexpr ']' ]
 // writestmt -> write expr
 // expr -> mathexpr [ (<|=) mathexpr ]
 // mathexpr -> term { (+|-) term }    left associative
 // term -> ampersand_term { (*|/) ampersand_term}   left associative
 // ampersand_term -> factor { (& factor }    left associative
 // factor -> newexpr { ^ newexpr }    right associative
-// newexpr -> ( mathexpr ) | number | identifier
+// newexpr -> ( mathexpr ) | number | identifier [ '[' mathexpr ']' ]
 
 enum NodeKind{
                 IF_NODE, REPEAT_NODE, ASSIGN_NODE, READ_NODE, WRITE_NODE,
-                OPER_NODE, NUM_NODE, ID_NODE, DECLARE_NODE                        // add declare node
+                OPER_NODE, NUM_NODE, ID_NODE, DECLARE_NODE,                       // add declare node
+                INDEX_NODE, // array element, the index is child[0]
+                LAZY_NODE, // body not parsed yet, num is the index of its first token, see ExpandLazy
+                SEQ_NODE // statement list, used in the flat tree only
              };
 
 // Used for debugging only /////////////////////////////////////////////////////////
 const char* NodeKindStr[]=
             {
                 "If", "Repeat", "Assign", "Read", "Write",
-                "Oper", "Num", "ID" , "Decl"                      //add decl for debugging
+                "Oper", "Num", "ID" , "Decl",                     //add decl for debugging
+                "Index",
+                "Lazy",
+                "Seq"
             };
 
-enum ExprDataType {VOID, INTEGER, REAL , BOOLEAN};                // add REAL expression data type
+// INVALID is given to expressions with a semantic error, so the error is reported only once
+enum ExprDataType {VOID, INTEGER, REAL , BOOLEAN, INVALID};                // add REAL expression data type
 
 // Used for debugging only /////////////////////////////////////////////////////////
 const char* ExprDataTypeStr[]=
             {
-                "Void", "Integer" ,"Real", "Boolean"                    //add real expr for debugging
+                "Void", "Integer" ,"Real", "Boolean", "Invalid"         //add real expr for debugging
             };
 
 #define MAX_CHILDREN 3
@@ -340,17 +1067,23 @@ struct TreeNode
     TreeNode* sibling; // used for sibling statements only
 
     NodeKind node_kind;
+    int stmt_num; // pre-order number of a statement for the profile feedback, 0 if not numbered
 
     union{TokenType oper; int num; char* id; double real_num;};                // Add real_num
     ExprDataType expr_data_type; // defined for expression/int/identifier only
     ExprDataType var_type;                                  // Add for variable declarations
 
     int line_num;
+    bool in_bounds; // array index proven in range by the enclosing repeat loop, see HoistBoundsChecks
+    bool closed_form; // a repeat loop that has been run by RunLoopClosedForm
 
     TreeNode() {
         int i; 
         for(i=0;i<MAX_CHILDREN;i++) child[i]=0; 
         sibling=0; 
+        stmt_num=0;
+        in_bounds=false;
+        closed_form=false;
         expr_data_type=VOID; 
         var_type=VOID;
         num=0;  // Initialize union to zero
@@ -360,21 +1093,86 @@ struct TreeNode
 struct ParseInfo
 {
     Token next_token;
+    Diagnostics* diag;
+    Arena* arena; // 0 to allocate the nodes with new, then the tree is freed with DestroyTree
+    bool lazy; // skim the bodies of ifs and repeats, needs a token array
+
+    ParseInfo() {diag=0; arena=0; lazy=false;}
 };
 
+TreeNode* NewNode(ParseInfo* ppi)
+{
+    if(ppi->arena) return new(ppi->arena->Alloc(sizeof(TreeNode))) TreeNode;
+    return new TreeNode;
+}
+
+void CopyId(ParseInfo* ppi, char** id, const char* str)
+{
+    if(ppi->arena) *id=ppi->arena->Copy(str);
+    else AllocateAndCopy(id, str);
+}
+
+// How a token type is written in the source, for error messages
+const char* TokenTypeSpelling(TokenType type)
+{
+    int i;
+    for(i=0;i<num_reserved_words;i++) if(reserved_words[i].type==type) return reserved_words[i].str;
+    for(i=0;i<num_symbolic_tokens;i++) if(symbolic_tokens[i].type==type) return symbolic_tokens[i].str;
+    if(type==ID) return "identifier";
+    if(type==ENDFILE) return "end of file";
+    return TokenTypeStr[type];
+}
+
+void DescribeToken(Token* token, char* str)
+{
+    if(token->type==ENDFILE) Copy(str, "end of file");
+    else sprintf(str, "'%s'", token->str);
+}
+
+// Records the error and throws 0, which is caught where the parser resynchronizes
+void SyntaxError(CompilerInfo* pci, ParseInfo* ppi, const char* expected)
+{
+    char found[MAX_TOKEN_LEN+3];
+    DescribeToken(&ppi->next_token, found);
+    ppi->diag->Add("syntax", pci->in_file.cur_line_num, "Expected %s but found %s", expected, found);
+    pci->debug_file.Out("Syntax Error");
+    throw 0;
+}
+
+// Panic mode: skip tokens up to ; end until else (or end of file) that are not
+// inside an if or repeat which started while skipping, or only up to stop if given
+void Synchronize(CompilerInfo* pci, ParseInfo* ppi, TokenType stop=ERROR)
+{
+    int depth=0;
+    while(ppi->next_token.type!=ENDFILE)
+    {
+        TokenType t=ppi->next_token.type;
+        if(depth==0 && (stop!=ERROR ? t==stop : t==SEMI_COLON || t==END || t==UNTIL || t==ELSE)) break;
+        if(t==IF || t==REPEAT) depth++;
+        else if((t==END || t==UNTIL) && depth>0) depth--;
+        GetNextToken(pci, &ppi->next_token);
+    }
+}
+
 void Match(CompilerInfo* pci, ParseInfo* ppi, TokenType expected_token_type)
 {
     pci->debug_file.Out("Start Match");
 
-    if(ppi->next_token.type!=expected_token_type) throw 0;
+    if(ppi->next_token.type!=expected_token_type)
+    {
+        char expected[MAX_TOKEN_LEN+3];
+        sprintf(expected, "'%s'", TokenTypeSpelling(expected_token_type));
+        if(expected_token_type==ID || expected_token_type==ENDFILE) Copy(expected, TokenTypeSpelling(expected_token_type));
+        SyntaxError(pci, ppi, expected);
+    }
     GetNextToken(pci, &ppi->next_token);
 
-    fprintf(pci->debug_file.file, "[%d] %s (%s)\n", pci->in_file.cur_line_num, ppi->next_token.str, TokenTypeStr[ppi->next_token.type]); fflush(pci->debug_file.file);
+    if(pci->debug_file.file) {fprintf(pci->debug_file.file, "[%d] %s (%s)\n", pci->in_file.cur_line_num, ppi->next_token.str, TokenTypeStr[ppi->next_token.type]); fflush(pci->debug_file.file);}
 }
 
 TreeNode* MathExpr(CompilerInfo*, ParseInfo*);
 
-// newexpr -> ( mathexpr ) | number | identifier
+// newexpr -> ( mathexpr ) | number | identifier [ '[' mathexpr ']' ]
 TreeNode* NewExpr(CompilerInfo* pci, ParseInfo* ppi)
 {
     pci->debug_file.Out("Start NewExpr");
@@ -382,7 +1180,7 @@ TreeNode* NewExpr(CompilerInfo* pci, ParseInfo* ppi)
     // Compare the next token with the First() of possible statements
     if(ppi->next_token.type==REAL_TYPE || ppi->next_token.type==INT_TYPE )         // from this
     {
-        TreeNode* tree=new TreeNode;
+        TreeNode* tree=NewNode(ppi);
         tree->node_kind=NUM_NODE;
         char* num_str=ppi->next_token.str;
         
@@ -410,11 +1208,17 @@ TreeNode* NewExpr(CompilerInfo* pci, ParseInfo* ppi)
     }
     if(ppi->next_token.type==ID)
     {
-        TreeNode* tree=new TreeNode;
+        TreeNode* tree=NewNode(ppi);
         tree->node_kind=ID_NODE;
-        AllocateAndCopy(&tree->id, ppi->next_token.str);
+        CopyId(ppi, &tree->id, ppi->next_token.str);
         tree->line_num=pci->in_file.cur_line_num;
         Match(pci, ppi, ppi->next_token.type);
+        if(ppi->next_token.type==LEFT_BRACKET)
+        {
+            tree->node_kind=INDEX_NODE;
+            Match(pci, ppi, LEFT_BRACKET); tree->child[0]=MathExpr(pci, ppi);
+            Match(pci, ppi, RIGHT_BRACKET);
+        }
 
         pci->debug_file.Out("End NewExpr");
         return tree;
@@ -430,7 +1234,7 @@ TreeNode* NewExpr(CompilerInfo* pci, ParseInfo* ppi)
         return tree;
     }
 
-    throw "Unexpected token found";
+    SyntaxError(pci, ppi, "a number, identifier or '('");
     return 0;
 }
 
@@ -443,7 +1247,7 @@ TreeNode* Factor(CompilerInfo* pci, ParseInfo* ppi)
 
     if(ppi->next_token.type==POWER)
     {
-        TreeNode* new_tree=new TreeNode;
+        TreeNode* new_tree=NewNode(ppi);
         new_tree->node_kind=OPER_NODE;
         new_tree->oper=ppi->next_token.type;
         new_tree->line_num=pci->in_file.cur_line_num;
@@ -466,7 +1270,7 @@ TreeNode* AmpersandTerm(CompilerInfo* pci, ParseInfo* ppi)
     
     while(ppi->next_token.type== AND_OPER)
     {
-        TreeNode* new_tree = new TreeNode;
+        TreeNode* new_tree = NewNode(ppi);
         new_tree->node_kind = OPER_NODE;
         new_tree->oper = ppi->next_token.type;
         new_tree->line_num = pci->in_file.cur_line_num;
@@ -490,7 +1294,7 @@ TreeNode* Term(CompilerInfo* pci, ParseInfo* ppi)
 
     while(ppi->next_token.type==TIMES || ppi->next_token.type==DIVIDE)
     {
-        TreeNode* new_tree=new TreeNode;
+        TreeNode* new_tree=NewNode(ppi);
         new_tree->node_kind=OPER_NODE;
         new_tree->oper=ppi->next_token.type;
         new_tree->line_num=pci->in_file.cur_line_num;
@@ -516,7 +1320,7 @@ TreeNode* MathExpr(CompilerInfo* pci, ParseInfo* ppi)
 
     while(ppi->next_token.type==PLUS || ppi->next_token.type==MINUS)
     {
-        TreeNode* new_tree=new TreeNode;
+        TreeNode* new_tree=NewNode(ppi);
         new_tree->node_kind=OPER_NODE;
         new_tree->oper=ppi->next_token.type;
         new_tree->line_num=pci->in_file.cur_line_num;
@@ -540,7 +1344,7 @@ TreeNode* Expr(CompilerInfo* pci, ParseInfo* ppi)
 
     if(ppi->next_token.type==EQUAL || ppi->next_token.type==LESS_THAN)
     {
-        TreeNode* new_tree=new TreeNode;
+        TreeNode* new_tree=NewNode(ppi);
         new_tree->node_kind=OPER_NODE;
         new_tree->oper=ppi->next_token.type;
         new_tree->line_num=pci->in_file.cur_line_num;
@@ -561,7 +1365,7 @@ TreeNode* WriteStmt(CompilerInfo* pci, ParseInfo* ppi)
 {
     pci->debug_file.Out("Start WriteStmt");
 
-    TreeNode* tree=new TreeNode;
+    TreeNode* tree=NewNode(ppi);
     tree->node_kind=WRITE_NODE;
     tree->line_num=pci->in_file.cur_line_num;
 
@@ -572,34 +1376,44 @@ TreeNode* WriteStmt(CompilerInfo* pci, ParseInfo* ppi)
     return tree;
 }
 
-// readstmt -> read identifier
+// readstmt -> read identifier [ '[' mathexpr ']' ]
 TreeNode* ReadStmt(CompilerInfo* pci, ParseInfo* ppi)
 {
     pci->debug_file.Out("Start ReadStmt");
 
-    TreeNode* tree=new TreeNode;
+    TreeNode* tree=NewNode(ppi);
     tree->node_kind=READ_NODE;
     tree->line_num=pci->in_file.cur_line_num;
 
     Match(pci, ppi, READ);
-    if(ppi->next_token.type==ID) AllocateAndCopy(&tree->id, ppi->next_token.str);
+    if(ppi->next_token.type==ID) CopyId(ppi, &tree->id, ppi->next_token.str);
     Match(pci, ppi, ID);
+    if(ppi->next_token.type==LEFT_BRACKET)
+    {
+        Match(pci, ppi, LEFT_BRACKET); tree->child[0]=MathExpr(pci, ppi);
+        Match(pci, ppi, RIGHT_BRACKET);
+    }
 
     pci->debug_file.Out("End ReadStmt");
     return tree;
 }
 
-// assignstmt -> identifier := expr
+// assignstmt -> identifier [ '[' mathexpr ']' ] := expr
 TreeNode* AssignStmt(CompilerInfo* pci, ParseInfo* ppi)
 {
     pci->debug_file.Out("Start AssignStmt");
 
-    TreeNode* tree=new TreeNode;
+    TreeNode* tree=NewNode(ppi);
     tree->node_kind=ASSIGN_NODE;
     tree->line_num=pci->in_file.cur_line_num;
 
-    if(ppi->next_token.type==ID) AllocateAndCopy(&tree->id, ppi->next_token.str);
+    if(ppi->next_token.type==ID) CopyId(ppi, &tree->id, ppi->next_token.str);
     Match(pci, ppi, ID);
+    if(ppi->next_token.type==LEFT_BRACKET)
+    {
+        Match(pci, ppi, LEFT_BRACKET); tree->child[1]=MathExpr(pci, ppi);
+        Match(pci, ppi, RIGHT_BRACKET);
+    }
     Match(pci, ppi, ASSIGN); tree->child[0]=Expr(pci, ppi);
 
     pci->debug_file.Out("End AssignStmt");
@@ -608,17 +1422,64 @@ TreeNode* AssignStmt(CompilerInfo* pci, ParseInfo* ppi)
 
 TreeNode* StmtSeq(CompilerInfo*, ParseInfo*);
 
+bool IsStmtStart(TokenType type)
+{
+    return type==IF || type==REPEAT || type==ID || type==READ || type==WRITE;
+}
+
+#define MAX_LAZY_DEPTH 64
+
+// With ppi->lazy, skips the statements of a body up to the end1 or end2 that closes it,
+// matching ifs with ends and repeats with untils, and returns a LAZY_NODE for them.
+// Otherwise, or if the nesting doesn't match, parses them with StmtSeq.
+TreeNode* BodyStmtSeq(CompilerInfo* pci, ParseInfo* ppi, TokenType end1, TokenType end2)
+{
+    TokenArray* ta=pci->token_array;
+    if(!ppi->lazy || !ta || !IsStmtStart(ppi->next_token.type)) return StmtSeq(pci, ppi);
+
+    int begin=pci->token_pos-1; // of next_token
+    TokenType open[MAX_LAZY_DEPTH];
+    int i, depth=0;
+    for(i=begin;i<ta->num;i++)
+    {
+        TokenType t=(TokenType)ta->tokens[i].type;
+        if(t==ENDFILE || t==ERROR) break;
+        if(t==IF || t==REPEAT)
+        {
+            if(depth==MAX_LAZY_DEPTH) break;
+            open[depth++]=t;
+        }
+        else if(t==END || t==UNTIL || t==ELSE)
+        {
+            if(depth==0) break;
+            if(t==ELSE ? open[depth-1]!=IF : open[--depth]!=(t==END ? IF : REPEAT)) {depth=-1; break;}
+        }
+    }
+    if(depth!=0 || i==ta->num || (ta->tokens[i].type!=end1 && ta->tokens[i].type!=end2)) return StmtSeq(pci, ppi);
+
+    TreeNode* tree=NewNode(ppi);
+    tree->node_kind=LAZY_NODE;
+    tree->line_num=pci->in_file.cur_line_num;
+    tree->num=begin;
+    pci->token_pos=i;
+    GetNextToken(pci, &ppi->next_token);
+    return tree;
+}
+
 // repeatstmt -> repeat stmtseq until expr
 TreeNode* RepeatStmt(CompilerInfo* pci, ParseInfo* ppi)
 {
     pci->debug_file.Out("Start RepeatStmt");
 
-    TreeNode* tree=new TreeNode;
+    TreeNode* tree=NewNode(ppi);
     tree->node_kind=REPEAT_NODE;
     tree->line_num=pci->in_file.cur_line_num;
 
-    Match(pci, ppi, REPEAT); tree->child[0]=StmtSeq(pci, ppi);
-    Match(pci, ppi, UNTIL); tree->child[1]=Expr(pci, ppi);
+    Match(pci, ppi, REPEAT); tree->child[0]=BodyStmtSeq(pci, ppi, UNTIL, UNTIL);
+    // a stray else or end in the body is skipped with the rest of it up to the until
+    try {Match(pci, ppi, UNTIL);}
+    catch(int) {Synchronize(pci, ppi, UNTIL); throw;}
+    tree->child[1]=Expr(pci, ppi);
 
     pci->debug_file.Out("End RepeatStmt");
     return tree;
@@ -629,13 +1490,13 @@ TreeNode* IfStmt(CompilerInfo* pci, ParseInfo* ppi)
 {
     pci->debug_file.Out("Start IfStmt");
 
-    TreeNode* tree=new TreeNode;
+    TreeNode* tree=NewNode(ppi);
     tree->node_kind=IF_NODE;
     tree->line_num=pci->in_file.cur_line_num;
 
     Match(pci, ppi, IF); tree->child[0]=Expr(pci, ppi);
-    Match(pci, ppi, THEN); tree->child[1]=StmtSeq(pci, ppi);
-    if(ppi->next_token.type==ELSE) {Match(pci, ppi, ELSE); tree->child[2]=StmtSeq(pci, ppi);}
+    Match(pci, ppi, THEN); tree->child[1]=BodyStmtSeq(pci, ppi, ELSE, END);
+    if(ppi->next_token.type==ELSE) {Match(pci, ppi, ELSE); tree->child[2]=BodyStmtSeq(pci, ppi, END, END);}
     Match(pci, ppi, END);
 
     pci->debug_file.Out("End IfStmt");
@@ -643,29 +1504,42 @@ TreeNode* IfStmt(CompilerInfo* pci, ParseInfo* ppi)
 }
 
 // stmt -> ifstmt | repeatstmt | assignstmt | readstmt | writestmt
+// Returns 0 for a statement with a syntax error, after skipping the rest of it
 TreeNode* Stmt(CompilerInfo* pci, ParseInfo* ppi)
 {
     pci->debug_file.Out("Start Stmt");
 
     // Compare the next token with the First() of possible statements
     TreeNode* tree=0;
-    if(ppi->next_token.type==IF) tree=IfStmt(pci, ppi);
-    else if(ppi->next_token.type==REPEAT) tree=RepeatStmt(pci, ppi);
-    else if(ppi->next_token.type==ID) tree=AssignStmt(pci, ppi);
-    else if(ppi->next_token.type==READ) tree=ReadStmt(pci, ppi);
-    else if(ppi->next_token.type==WRITE) tree=WriteStmt(pci, ppi);
-    else throw 0;
+    TokenType first=ppi->next_token.type;
+    try {
+        if(first==IF) tree=IfStmt(pci, ppi);
+        else if(first==REPEAT) tree=RepeatStmt(pci, ppi);
+        else if(first==ID) tree=AssignStmt(pci, ppi);
+        else if(first==READ) tree=ReadStmt(pci, ppi);
+        else if(first==WRITE) tree=WriteStmt(pci, ppi);
+        else SyntaxError(pci, ppi, "a statement");
+    }
+    catch(int) {
+        Synchronize(pci, ppi);
+        // the else branch and end or the until of the broken statement itself
+        if(first==IF && ppi->next_token.type==ELSE) {GetNextToken(pci, &ppi->next_token); Synchronize(pci, ppi, END);}
+        if(first==IF && ppi->next_token.type==END) GetNextToken(pci, &ppi->next_token);
+        else if(first==REPEAT && ppi->next_token.type==UNTIL) {GetNextToken(pci, &ppi->next_token); Synchronize(pci, ppi);}
+        pci->debug_file.Out("End Stmt");
+        return 0;
+    }
 
     pci->debug_file.Out("End Stmt");
     return tree;
 }
 
-// declaration -> type identifier
+// declaration -> type identifier [ '[' number ']' ]      the size of an array is child[0]
 TreeNode* Declaration(CompilerInfo* pci, ParseInfo* ppi)           // from this
 {
     pci->debug_file.Out("Start Declaration");
 
-    TreeNode* tree = new TreeNode;
+    TreeNode* tree = NewNode(ppi);
     tree->node_kind = DECLARE_NODE;
     tree->line_num = pci->in_file.cur_line_num;
 
@@ -683,15 +1557,23 @@ TreeNode* Declaration(CompilerInfo* pci, ParseInfo* ppi)           // from this
         Match(pci, ppi, BOOL_TYPE);
     }
     else {
-        throw "Unexpected type found!"; 
+        SyntaxError(pci, ppi, "a type");
     }                                                              // to this
 
     // Get the identifier
     if(ppi->next_token.type == ID) {
-        AllocateAndCopy(&tree->id, ppi->next_token.str);
+        CopyId(ppi, &tree->id, ppi->next_token.str);
     }
     Match(pci, ppi, ID);
 
+    // Get the size of an array
+    if(ppi->next_token.type == LEFT_BRACKET) {
+        Match(pci, ppi, LEFT_BRACKET);
+        if(ppi->next_token.type != INT_TYPE || !IsDigit(ppi->next_token.str[0])) SyntaxError(pci, ppi, "an array size");
+        tree->child[0] = NewExpr(pci, ppi);
+        Match(pci, ppi, RIGHT_BRACKET);
+    }
+
     pci->debug_file.Out("End Declaration");
     return tree;
 }
@@ -700,26 +1582,33 @@ TreeNode* Declarations(CompilerInfo* pci, ParseInfo* ppi)            //from this
 {
     pci->debug_file.Out("Start Declarations");
 
-    TreeNode* first_tree = Declaration(pci, ppi);
-    TreeNode* last_tree = first_tree;
+    TreeNode* first_tree = 0;
+    TreeNode* last_tree = 0;
 
-    // Continue parsing declarations while we see semicolons followed by type keywords
-    while(ppi->next_token.type == SEMI_COLON)
+    while(true)
     {
-        // Look ahead to see if next is a type keyword
-        Token saved_token = ppi->next_token;
-        Match(pci, ppi, SEMI_COLON);
-        
-        // Check if this is a declaration or start of statements
-        if(ppi->next_token.type == INT_TYPE || 
-           ppi->next_token.type == REAL_TYPE || 
-           ppi->next_token.type == BOOL_TYPE)
+        TreeNode* next_tree = 0;
+        try {
+            next_tree = Declaration(pci, ppi);
+        }
+        catch(int) {
+            Synchronize(pci, ppi);
+        }
+        if(next_tree)
         {
-            TreeNode* next_tree = Declaration(pci, ppi);
-            last_tree->sibling = next_tree;
+            if(!first_tree) first_tree = next_tree;
+            else last_tree->sibling = next_tree;
             last_tree = next_tree;
         }
-        else
+
+        // Continue parsing declarations while we see semicolons followed by type keywords
+        if(ppi->next_token.type != SEMI_COLON) break;
+        Match(pci, ppi, SEMI_COLON);
+
+        // Check if this is a declaration or start of statements
+        if(ppi->next_token.type != INT_TYPE && 
+           ppi->next_token.type != REAL_TYPE && 
+           ppi->next_token.type != BOOL_TYPE)
         {
             // Not a declaration, we're done with declarations
             break;
@@ -741,7 +1630,18 @@ TreeNode* StmtSeq(CompilerInfo* pci, ParseInfo* ppi)
           ppi->next_token.type!=ELSE && 
           ppi->next_token.type!=UNTIL)
     {
-        Match(pci, ppi, SEMI_COLON);
+        try {
+            Match(pci, ppi, SEMI_COLON);
+        }
+        catch(int) {
+            // a missing ; before a statement is reported and the statement parsed as usual,
+            // anything else is skipped
+            if(!IsStmtStart(ppi->next_token.type))
+            {
+                Synchronize(pci, ppi);
+                if(ppi->next_token.type==SEMI_COLON) Match(pci, ppi, SEMI_COLON);
+            }
+        }
         
         // Check if there's actually another statement to parse
         if(ppi->next_token.type==ENDFILE || 
@@ -751,7 +1651,9 @@ TreeNode* StmtSeq(CompilerInfo* pci, ParseInfo* ppi)
             break;
             
         TreeNode* next_tree=Stmt(pci, ppi);
-        last_tree->sibling=next_tree;
+        if(!next_tree) continue;
+        if(!first_tree) first_tree=next_tree;
+        else last_tree->sibling=next_tree;
         last_tree=next_tree;
     }
     
@@ -761,45 +1663,53 @@ TreeNode* StmtSeq(CompilerInfo* pci, ParseInfo* ppi)
 
 // program -> stmtseq
 // program -> declarations stmtseq
-TreeNode* Parse(CompilerInfo* pci)                                    //from this
+TreeNode* Parse(CompilerInfo* pci, Diagnostics* diag, Arena* arena=0)  //from this
 {
     ParseInfo parse_info;
+    parse_info.diag = diag;
+    parse_info.arena = arena;
+    parse_info.lazy = pci->options.lazy;
     GetNextToken(pci, &parse_info.next_token);
 
     TreeNode* syntax_tree = 0;
-    TreeNode* declarations_tree = 0;
-    TreeNode* statements_tree = 0;
+    TreeNode* last_tree = 0;
 
     // Check if we have declarations (starts with type keyword)
     if(parse_info.next_token.type == INT_TYPE || 
        parse_info.next_token.type == REAL_TYPE || 
        parse_info.next_token.type == BOOL_TYPE)
     {
-        declarations_tree = Declarations(pci, &parse_info);
+        syntax_tree = Declarations(pci, &parse_info);
+        last_tree = syntax_tree;
     }
 
-    // Now parse statements
-    if(parse_info.next_token.type != ENDFILE)
+    // Now parse statements, a stray end, else or until is reported and skipped
+    while(parse_info.next_token.type != ENDFILE)
     {
-        statements_tree = StmtSeq(pci, &parse_info);
-    }
+        if(parse_info.next_token.type == END || 
+           parse_info.next_token.type == ELSE || 
+           parse_info.next_token.type == UNTIL)
+        {
+            char found[MAX_TOKEN_LEN+3];
+            DescribeToken(&parse_info.next_token, found);
+            diag->Add("syntax", pci->in_file.cur_line_num, "Unexpected %s", found);
+            GetNextToken(pci, &parse_info.next_token);
+            if(parse_info.next_token.type == SEMI_COLON) GetNextToken(pci, &parse_info.next_token);
+            continue;
+        }
 
-    // Link declarations and statements
-    if(declarations_tree)
-    {
-        syntax_tree = declarations_tree;
-        // Find last declaration
-        TreeNode* last_decl = declarations_tree;
-        while(last_decl->sibling) last_decl = last_decl->sibling;
-        last_decl->sibling = statements_tree;
-    }
-    else
-    {
-        syntax_tree = statements_tree;
-    }
+        TreeNode* statements_tree = StmtSeq(pci, &parse_info);
 
-    if(parse_info.next_token.type != ENDFILE)
-        pci->debug_file.Out("Error code ends before file ends");
+        // Link declarations and statements
+        if(!statements_tree) continue;
+        if(!syntax_tree) syntax_tree = statements_tree;
+        else
+        {
+            while(last_tree->sibling) last_tree = last_tree->sibling;
+            last_tree->sibling = statements_tree;
+        }
+        last_tree = statements_tree;
+    }
 
     return syntax_tree;
 }                                                                     // to this line
@@ -820,7 +1730,7 @@ void PrintTree(TreeNode* node, int sh=0)
             printf("[%d]", node->num);       // Print as integer
         }
     }
-    else if(node->node_kind==ID_NODE || node->node_kind==READ_NODE || 
+    else if(node->node_kind==ID_NODE || node->node_kind==READ_NODE || node->node_kind==INDEX_NODE ||
             node->node_kind==ASSIGN_NODE || node->node_kind==DECLARE_NODE) {
         if(node->id) printf("[%s]", node->id);  // Add null check
     }
@@ -843,7 +1753,7 @@ void DestroyTree(TreeNode* node)
 {
     int i;
 
-    if(node->node_kind==ID_NODE || node->node_kind==READ_NODE || 
+    if(node->node_kind==ID_NODE || node->node_kind==READ_NODE || node->node_kind==INDEX_NODE ||
        node->node_kind==ASSIGN_NODE || node->node_kind==DECLARE_NODE)                                                // ADD DECL_NODE
         if(node->id) delete[] node->id;
 
@@ -856,449 +1766,5710 @@ void DestroyTree(TreeNode* node)
 ////////////////////////////////////////////////////////////////////////////////////
 // Analyzer ////////////////////////////////////////////////////////////////////////
 
-const int SYMBOL_HASH_SIZE=10007;
-
-struct LineLocation
-{
-    int line_num;
-    LineLocation* next;
-};
+// Open addressing table of variables. The variables themselves are stored
+// contiguously in memloc order, the slots array only maps a hash position
+// to a memloc (-1 for an empty slot). The slots array is kept at most half full.
+const int SYMBOL_INITIAL_SLOTS=64; // must be a power of 2
+const int SYMBOL_INITIAL_VARS=16;
+const int LINES_INITIAL_SIZE=4;
+const int MAX_ARRAY_SIZE=1<<26; // elements
 
 struct VariableInfo
 {
     char* name;
+    unsigned int hash;
     int memloc;
-    LineLocation* head_line; // the head of linked list of source line locations
-    LineLocation* tail_line; // the tail of linked list of source line locations
-    VariableInfo* next_var; // the next variable in the linked list in the same hash bucket of the symbol table
+    int* lines; // source line locations (cross reference), 0 if not tracked
+    int num_lines, lines_capacity;
     ExprDataType var_type;                                                                                           // ADD THIS
+    int size; // number of elements of an array, 0 for a scalar
 };
 
 struct SymbolTable
 {
     int num_vars;
-    VariableInfo* var_info[SYMBOL_HASH_SIZE];
+    int vars_capacity;
+    VariableInfo* vars; // vars[memloc]
+
+    int* slots;
+    int slots_mask; // number of slots - 1
 
-    SymbolTable() {num_vars=0; int i; for(i=0;i<SYMBOL_HASH_SIZE;i++) var_info[i]=0;}
+    bool track_lines; // false if no cross reference listing is needed
+    Arena* arena; // names and line lists come from here if not 0, and aren't freed by Destroy
 
-    int Hash(const char* name)
+    SymbolTable(bool _track_lines=true, Arena* _arena=0)
     {
-        int i, len=strlen(name);
-        int hash_val=11;
-        for(i=0;i<len;i++) hash_val=(hash_val*17+(int)name[i])%SYMBOL_HASH_SIZE;
-        return hash_val;
+        num_vars=0; track_lines=_track_lines; arena=_arena;
+        vars_capacity=SYMBOL_INITIAL_VARS; vars=new VariableInfo[vars_capacity];
+        slots_mask=SYMBOL_INITIAL_SLOTS-1; slots=new int[SYMBOL_INITIAL_SLOTS];
+        int i; for(i=0;i<SYMBOL_INITIAL_SLOTS;i++) slots[i]=-1;
     }
 
-    VariableInfo* Find(const char* name)
+    // FNV-1a followed by a final avalanche, so that similar names don't cluster in the probe sequence
+    static unsigned int Hash(const char* name)
+    {
+        unsigned int h=2166136261u;
+        while(*name) {h^=(unsigned char)*name++; h*=16777619u;}
+        h^=h>>16; h*=0x85ebca6bu; h^=h>>13; h*=0xc2b2ae35u; h^=h>>16;
+        return h;
+    }
+
+    // returns the slot holding name, or the empty slot where it should be inserted
+    int FindSlot(const char* name, unsigned int h)
     {
-        int h=Hash(name);
-        VariableInfo* cur=var_info[h];
-        while(cur)
+        int s=h&slots_mask;
+        while(slots[s]>=0)
         {
-            if(Equals(name, cur->name)) return cur;
-            cur=cur->next_var;
+            VariableInfo* cur=&vars[slots[s]];
+            if(cur->hash==h && Equals(name, cur->name)) return s;
+            s=(s+1)&slots_mask;
         }
-        return 0;
+        return s;
     }
 
-    void Insert(const char* name, int line_num ,ExprDataType type = VOID)
+    VariableInfo* Find(const char* name)
     {
-        LineLocation* lineloc=new LineLocation;
-        lineloc->line_num=line_num;
-        lineloc->next=0;
-
-        int h=Hash(name);
-        VariableInfo* prev=0;
-        VariableInfo* cur=var_info[h];
+        int s=FindSlot(name, Hash(name));
+        if(slots[s]<0) return 0;
+        return &vars[slots[s]];
+    }
 
-        while(cur)
+    void Grow()
+    {
+        int i;
+        if(num_vars==vars_capacity)
+        {
+            VariableInfo* new_vars=new VariableInfo[vars_capacity*2];
+            for(i=0;i<num_vars;i++) new_vars[i]=vars[i];
+            delete[] vars; vars=new_vars; vars_capacity*=2;
+        }
+        if(2*(num_vars+1)>slots_mask+1)
         {
-            if(Equals(name, cur->name))
+            int new_size=2*(slots_mask+1);
+            delete[] slots; slots=new int[new_size]; slots_mask=new_size-1;
+            for(i=0;i<new_size;i++) slots[i]=-1;
+            for(i=0;i<num_vars;i++)
             {
-                // just add this line location to the list of line locations of the existing var
-                cur->tail_line->next=lineloc;
-                cur->tail_line=lineloc;
-                return;
+                int s=vars[i].hash&slots_mask;
+                while(slots[s]>=0) s=(s+1)&slots_mask;
+                slots[s]=i;
             }
-            prev=cur;
-            cur=cur->next_var;
         }
+    }
+
+    void AddLine(VariableInfo* vi, int line_num)
+    {
+        if(!track_lines) return;
+        if(vi->num_lines==vi->lines_capacity)
+        {
+            int new_capacity=vi->lines_capacity ? 2*vi->lines_capacity : LINES_INITIAL_SIZE;
+            int* new_lines=arena ? (int*)arena->Alloc(new_capacity*sizeof(int)) : new int[new_capacity];
+            if(vi->lines) {memcpy(new_lines, vi->lines, vi->num_lines*sizeof(int)); if(!arena) delete[] vi->lines;}
+            vi->lines=new_lines; vi->lines_capacity=new_capacity;
+        }
+        vi->lines[vi->num_lines++]=line_num;
+    }
+
+    void Insert(const char* name, int line_num ,ExprDataType type = VOID, int size = 0)
+    {
+        unsigned int h=Hash(name);
+        int s=FindSlot(name, h);
+
+        if(slots[s]>=0)
+        {
+            // just add this line location to the list of line locations of the existing var
+            AddLine(&vars[slots[s]], line_num);
+            return;
+        }
+
+        Grow();
+        s=FindSlot(name, h); // slots may have been rehashed
 
-        VariableInfo* vi=new VariableInfo;
-        vi->head_line=vi->tail_line=lineloc;
-        vi->next_var=0;
-        vi->memloc=num_vars++;
+        VariableInfo* vi=&vars[num_vars];
+        vi->hash=h;
+        vi->memloc=num_vars;
+        vi->lines=0; vi->num_lines=vi->lines_capacity=0;
         vi->var_type=type;                                           //  add variable type
-        AllocateAndCopy(&vi->name, name);
+        vi->size=size;
+        if(arena) vi->name=arena->Copy(name);
+        else AllocateAndCopy(&vi->name, name);
+        slots[s]=num_vars++;
 
-        if(!prev) var_info[h]=vi;
-        else prev->next_var=vi;
+        AddLine(vi, line_num);
     }
 
     void Print()
     {
-        int i;
-        for(i=0;i<SYMBOL_HASH_SIZE;i++)
+        int i, j;
+        for(i=0;i<num_vars;i++)
         {
-            VariableInfo* curv=var_info[i];
-            while(curv)
-            {
-                printf("[Var=%s][Mem=%d]", curv->name, curv->memloc);
-                LineLocation* curl=curv->head_line;
-                while(curl)
-                {
-                    printf("[Line=%d]", curl->line_num);
-                    curl=curl->next;
-                }
-                printf("\n");
-                curv=curv->next_var;
-            }
+            VariableInfo* curv=&vars[i];
+            printf("[Var=%s][Mem=%d]", curv->name, curv->memloc);
+            if(curv->size) printf("[Size=%d]", curv->size);
+            for(j=0;j<curv->num_lines;j++) printf("[Line=%d]", curv->lines[j]);
+            printf("\n");
         }
     }
 
+    bool HasArrays() const
+    {
+        int i;
+        for(i=0;i<num_vars;i++) if(vars[i].size) return true;
+        return false;
+    }
+
     void Destroy()
     {
         int i;
-        for(i=0;i<SYMBOL_HASH_SIZE;i++)
+        for(i=0;i<num_vars && !arena;i++)
         {
-            VariableInfo* curv=var_info[i];
-            while(curv)
-            {
-                LineLocation* curl=curv->head_line;
-                while(curl)
-                {
-                    LineLocation* pl=curl;
-                    curl=curl->next;
-                    delete pl;
-                }
-                VariableInfo* p=curv;
-                curv=curv->next_var;
-                delete p;
-            }
-            var_info[i]=0;
+            delete[] vars[i].name;
+            if(vars[i].lines) delete[] vars[i].lines;
+        }
+        delete[] vars; vars=0;
+        delete[] slots; slots=0;
+        num_vars=0;
+    }
+};
+// Cross references found by one analysis thread, added to the symbol table after all threads are done
+struct XrefEntry
+{
+    int memloc;
+    int line_num;
+};
+
+struct XrefBuffer
+{
+    XrefEntry* entries;
+    int num, capacity;
+
+    XrefBuffer() {entries=0; num=capacity=0;}
+    ~XrefBuffer() {if(entries) delete[] entries;}
+
+    void Add(int memloc, int line_num)
+    {
+        if(num==capacity)
+        {
+            int new_capacity=capacity ? 2*capacity : 64;
+            XrefEntry* new_entries=new XrefEntry[new_capacity];
+            if(entries) {memcpy(new_entries, entries, num*sizeof(XrefEntry)); delete[] entries;}
+            entries=new_entries; capacity=new_capacity;
         }
+        entries[num].memloc=memloc;
+        entries[num].line_num=line_num;
+        num++;
     }
 };
-void Analyze(TreeNode* node, SymbolTable* symbol_table)
+
+struct AnalyzeInfo
+{
+    SymbolTable* symbol_table; // only Find is used once the declarations are in
+    Diagnostics* diag;
+    XrefBuffer* xref; // 0 to add the line locations to the symbol table directly
+};
+
+void AddXref(AnalyzeInfo* pai, VariableInfo* var, int line_num)
+{
+    if(!pai->xref) pai->symbol_table->AddLine(var, line_num);
+    else if(pai->symbol_table->track_lines) pai->xref->Add(var->memloc, line_num);
+}
+
+// Analyzes node and its children, but not its siblings
+// Errors are added to diag and analysis continues, an expression with an error gets the INVALID type
+void AnalyzeNode(TreeNode* node, AnalyzeInfo* pai)
 {
     int i;
+    SymbolTable* symbol_table=pai->symbol_table;
+    Diagnostics* diag=pai->diag;
 
     // Handle declarations - register variables with their types
     if(node->node_kind == DECLARE_NODE) {
-        symbol_table->Insert(node->id, node->line_num, node->var_type);
+        int size = node->child[0] ? node->child[0]->num : 0;
+        if(node->child[0] && (size < 1 || size > MAX_ARRAY_SIZE)) {
+            diag->Add("semantic", node->line_num, "Size of array '%s' must be from 1 to %d", node->id, MAX_ARRAY_SIZE);
+            size = 1;
+        }
+        symbol_table->Insert(node->id, node->line_num, node->var_type, size);
     }
     
-    if(node->node_kind==ID_NODE || node->node_kind==READ_NODE || node->node_kind==ASSIGN_NODE) {
+    if(node->node_kind==ID_NODE || node->node_kind==READ_NODE || node->node_kind==ASSIGN_NODE || node->node_kind==INDEX_NODE) {
         VariableInfo* var = symbol_table->Find(node->id);
+        bool is_expr = node->node_kind==ID_NODE || node->node_kind==INDEX_NODE;
         if(!var) {
-            printf("ERROR: Variable '%s' used but not declared at line %d\n", node->id, node->line_num);
-            throw "Terminate Program!";
+            diag->Add("semantic", node->line_num, "Variable '%s' used but not declared", node->id);
+            if(is_expr) node->expr_data_type=INVALID;
+        }
+        else {
+            AddXref(pai, var, node->line_num);
+            bool indexed = node->node_kind==INDEX_NODE || (node->node_kind==ASSIGN_NODE && node->child[1]) ||
+                           (node->node_kind==READ_NODE && node->child[0]);
+            if(indexed != (var->size > 0)) {
+                if(indexed) diag->Add("semantic", node->line_num, "'%s' is not an array", node->id);
+                else diag->Add("semantic", node->line_num, "Array '%s' used without an index", node->id);
+                if(is_expr) node->expr_data_type=INVALID;
+            }
         }
-        symbol_table->Insert(node->id, node->line_num);
     }
 
     for(i=0;i<MAX_CHILDREN;i++) 
-        if(node->child[i]) 
-            Analyze(node->child[i], symbol_table);
+    {
+        TreeNode* child;
+        for(child=node->child[i];child;child=child->sibling) AnalyzeNode(child, pai);
+    }
 
     if(node->node_kind==OPER_NODE)             
     {
-        if(node->oper==EQUAL || node->oper==LESS_THAN) {
+        ExprDataType left=node->child[0]->expr_data_type, right=node->child[1]->expr_data_type;
+        if(left==INVALID || right==INVALID) {
+            node->expr_data_type=INVALID;
+        }
+        else if(node->oper==EQUAL || node->oper==LESS_THAN) {
             // Comparison operators - check operands are int or real (not bool)
-            if(node->child[0]->expr_data_type == BOOLEAN || node->child[1]->expr_data_type == BOOLEAN) {
-                printf("ERROR: Cannot use comparison operators on BOOLEAN at line %d\n", node->line_num);
-                throw "Terminate Program!";
+            if(left == BOOLEAN || right == BOOLEAN) {
+                diag->Add("semantic", node->line_num, "Cannot use comparison operators on BOOLEAN");
+                node->expr_data_type=INVALID;
             }
-            node->expr_data_type=BOOLEAN;
+            else node->expr_data_type=BOOLEAN;
         }
         else if(node->oper==AND_OPER) {
             // AND operator only for integers
-            if(node->child[0]->expr_data_type != INTEGER || node->child[1]->expr_data_type != INTEGER) {
-                printf("ERROR: AND operator requires INTEGER operands at line %d\n", node->line_num);
-                throw "Terminate Program!";
+            if(left != INTEGER || right != INTEGER) {
+                diag->Add("semantic", node->line_num, "AND operator requires INTEGER operands");
+                node->expr_data_type=INVALID;
             }
-            node->expr_data_type=INTEGER;
+            else node->expr_data_type=INTEGER;
         }
         else {
             // Arithmetic operators - check not boolean
-            if(node->child[0]->expr_data_type == BOOLEAN || node->child[1]->expr_data_type == BOOLEAN) {
-                printf("ERROR: Cannot do arithmetic on BOOLEAN at line %d\n", node->line_num);
-                throw "Terminate Program!";
+            if(left == BOOLEAN || right == BOOLEAN) {
+                diag->Add("semantic", node->line_num, "Cannot do arithmetic on BOOLEAN");
+                node->expr_data_type=INVALID;
             }
-            
             // Type promotion: if either operand is REAL, result is REAL
-            if(node->child[0]->expr_data_type == REAL || node->child[1]->expr_data_type == REAL)
+            else if(left == REAL || right == REAL)
                 node->expr_data_type = REAL;
             else
                 node->expr_data_type = INTEGER;
         }
     }
-    else if(node->node_kind==ID_NODE) {
+    else if(node->node_kind==ID_NODE || node->node_kind==INDEX_NODE) {
         VariableInfo* var = symbol_table->Find(node->id);
-        if(var) node->expr_data_type = var->var_type;
+        if(var && node->expr_data_type != INVALID) node->expr_data_type = var->var_type;
     }
 
+    // The index of an array element
+    TreeNode* index = node->node_kind==INDEX_NODE || node->node_kind==READ_NODE ? node->child[0] :
+                      node->node_kind==ASSIGN_NODE ? node->child[1] : 0;
+    if(index && index->expr_data_type != INTEGER && index->expr_data_type != INVALID)
+        diag->Add("semantic", node->line_num, "Array index must be INTEGER");
+
     // Type checking for statements
     if(node->node_kind==IF_NODE) {
-        if(node->child[0]->expr_data_type != BOOLEAN) {
-            printf("ERROR: If condition must be BOOLEAN at line %d\n", node->line_num);
-            throw "Terminate Program!";
-        }
+        ExprDataType cond=node->child[0]->expr_data_type;
+        if(cond != BOOLEAN && cond != INVALID)
+            diag->Add("semantic", node->line_num, "If condition must be BOOLEAN");
     }
     
     if(node->node_kind==REPEAT_NODE) {
-        if(node->child[1]->expr_data_type != BOOLEAN) {
-            printf("ERROR: Repeat condition must be BOOLEAN at line %d\n", node->line_num);
-            throw "Terminate Program!";
-        }
+        ExprDataType cond=node->child[1]->expr_data_type;
+        if(cond != BOOLEAN && cond != INVALID)
+            diag->Add("semantic", node->line_num, "Repeat condition must be BOOLEAN");
     }
     
     if(node->node_kind==ASSIGN_NODE) {
         VariableInfo* var = symbol_table->Find(node->id);
-        if(var && var->var_type != node->child[0]->expr_data_type) {
-            printf("ERROR: Cannot assign %s to %s variable '%s' at line %d\n", 
-                   ExprDataTypeStr[node->child[0]->expr_data_type],
-                   ExprDataTypeStr[var->var_type],
-                   node->id, node->line_num);
-            throw "Terminate Program!";
+        ExprDataType value=node->child[0]->expr_data_type;
+        if(var && value != INVALID && var->var_type != value) {
+            diag->Add("semantic", node->line_num, "Cannot assign %s to %s variable '%s'",
+                      ExprDataTypeStr[value], ExprDataTypeStr[var->var_type], node->id);
         }
     }
+}
 
-    if(node->sibling) Analyze(node->sibling, symbol_table);
+void Analyze(TreeNode* node, SymbolTable* symbol_table, Diagnostics* diag)
+{
+    AnalyzeInfo analyze_info;
+    analyze_info.symbol_table=symbol_table;
+    analyze_info.diag=diag;
+    analyze_info.xref=0;
+    for(;node;node=node->sibling) AnalyzeNode(node, &analyze_info);
 }
 
-////////////////////////////////////////////////////////////////////////////////////
-// Code Generator //////////////////////////////////////////////////////////////////
+// Parallel Analyzer ///////////////////////////////////////////////////////////////
 
-struct Variable {
-    ExprDataType type;
-    union {
-        int int_val;
-        double real_val;
-        bool bool_val;
-    };
-    
-    Variable() {
-        type = VOID;
-        int_val = 0;  // Initialize union
-    }
+// The declarations come first in the program, so once they are in the symbol table
+// each top level statement can be checked against a read only table. The statements
+// are split into runs of consecutive statements, each with its own cross references
+// and errors. Merging the runs in program order gives the same result as Analyze.
+// The chunks are cut while walking the statement list once, walking it is a
+// cache miss per statement and costs about as much as checking the statements.
+const int ANALYZE_CHUNK_STMTS=1024;
+
+struct AnalyzeChunk
+{
+    TreeNode* first;
+    int num_stmts;
+    XrefBuffer xref;
+    Diagnostics diag;
 };
 
-int Power(int a, int b)
+struct ParallelAnalyzeInfo
 {
-    if(a==0) return 0;
-    if(b==0) return 1;
-    if(b>=1) return a*Power(a, b-1);
-    return 0;
-}
+    SymbolTable* symbol_table;
+    AnalyzeChunk* chunks;
+    int num_chunks;
+    atomic<int> next_chunk;
+};
 
-//interpreter
-// Unified evaluation function that handles all types
-double EvaluateReal(TreeNode* node, SymbolTable* symbol_table, Variable* variables)
+void AnalyzeWorker(ParallelAnalyzeInfo* ppa)
 {
-    // Base cases: NUM_NODE and ID_NODE
-    if(node->node_kind == NUM_NODE) {
-        if(node->expr_data_type == REAL) 
-            return node->real_num;
-        else 
-            return (double)node->num;
-    }
-    
-    if(node->node_kind == ID_NODE) {
-        VariableInfo* var_info = symbol_table->Find(node->id);
-        if(!var_info) {
-            printf("ERROR: Variable '%s' not found\n", node->id);
-            throw "Terminate Program!";
-        }
-        int memloc = var_info->memloc;
-        
-        if(variables[memloc].type == REAL) 
-            return variables[memloc].real_val;
-        else if(variables[memloc].type == INTEGER) 
-            return (double)variables[memloc].int_val;
-        else if(variables[memloc].type == BOOLEAN)
-            return variables[memloc].bool_val ? 1.0 : 0.0;
-        
-        return 0.0;
-    }
+    while(true)
+    {
+        int k=ppa->next_chunk++;
+        if(k>=ppa->num_chunks) return;
+        AnalyzeChunk* chunk=&ppa->chunks[k];
 
-    // Recursive evaluation for operators
-    double a = EvaluateReal(node->child[0], symbol_table, variables);
-    double b = EvaluateReal(node->child[1], symbol_table, variables);
-
-    if(node->oper == EQUAL) return (a == b) ? 1.0 : 0.0;
-    if(node->oper == LESS_THAN) return (a < b) ? 1.0 : 0.0;
-    if(node->oper == PLUS) return a + b;
-    if(node->oper == MINUS) return a - b;
-    if(node->oper == TIMES) return a * b;
-    if(node->oper == DIVIDE) return a / b;
-    if(node->oper == POWER) return pow(a, b);  
-    if(node->oper == AND_OPER) return (a * a) - (b * b);
-    
-    return 0.0;
+        AnalyzeInfo analyze_info;
+        analyze_info.symbol_table=ppa->symbol_table;
+        analyze_info.diag=&chunk->diag;
+        analyze_info.xref=&chunk->xref;
+
+        int i;
+        TreeNode* node=chunk->first;
+        for(i=0;i<chunk->num_stmts;i++, node=node->sibling) AnalyzeNode(node, &analyze_info);
+    }
 }
 
-// NEW: Updated RunProgram to handle multiple types
-void RunProgram(TreeNode* node, SymbolTable* symbol_table, Variable* variables)
+void AnalyzeParallel(TreeNode* node, SymbolTable* symbol_table, Diagnostics* diag, int num_threads)
 {
-    if(!node) return;  // Safety check
-    
-    // Handle declarations - skip them during execution
-    if(node->node_kind == DECLARE_NODE) {
-        // Declarations already processed, just skip
-        if(node->sibling) RunProgram(node->sibling, symbol_table, variables);
-        return;
+    int i, k;
+    if(num_threads<=1) {Analyze(node, symbol_table, diag); return;}
+
+    // serial phase: the declarations
+    AnalyzeInfo analyze_info;
+    analyze_info.symbol_table=symbol_table;
+    analyze_info.diag=diag;
+    analyze_info.xref=0;
+    for(;node && node->node_kind==DECLARE_NODE;node=node->sibling) AnalyzeNode(node, &analyze_info);
+
+    // the first statement of each chunk
+    int num_chunks=0, capacity=64;
+    TreeNode** firsts=new TreeNode*[capacity];
+    int last_size=0;
+    TreeNode* cur;
+    for(cur=node;cur;cur=cur->sibling)
+    {
+        if(cur->node_kind==DECLARE_NODE) {delete[] firsts; Analyze(node, symbol_table, diag); return;} // not produced by the parser
+        if(num_chunks==0 || last_size==ANALYZE_CHUNK_STMTS)
+        {
+            if(num_chunks==capacity)
+            {
+                TreeNode** new_firsts=new TreeNode*[2*capacity];
+                memcpy(new_firsts, firsts, num_chunks*sizeof(TreeNode*));
+                delete[] firsts; firsts=new_firsts; capacity*=2;
+            }
+            firsts[num_chunks++]=cur;
+            last_size=0;
+        }
+        last_size++;
     }
-    
-    // IF statement
-    if(node->node_kind == IF_NODE)
+    if(num_chunks<=1) {delete[] firsts; Analyze(node, symbol_table, diag); return;}
+
+    ParallelAnalyzeInfo ppa;
+    ppa.symbol_table=symbol_table;
+    ppa.chunks=new AnalyzeChunk[num_chunks];
+    ppa.num_chunks=num_chunks;
+    ppa.next_chunk=0;
+    for(k=0;k<num_chunks;k++)
     {
-        double cond_val = EvaluateReal(node->child[0], symbol_table, variables);
-        bool cond = (cond_val != 0.0);  // Convert to boolean
-        
-        if(cond) 
-            RunProgram(node->child[1], symbol_table, variables);
-        else if(node->child[2]) 
-            RunProgram(node->child[2], symbol_table, variables);
+        ppa.chunks[k].first=firsts[k];
+        ppa.chunks[k].num_stmts=(k==num_chunks-1) ? last_size : ANALYZE_CHUNK_STMTS;
     }
-    
-    // ASSIGN statement
-    else if(node->node_kind == ASSIGN_NODE)
+    delete[] firsts;
+
+    thread* workers=new thread[num_threads];
+    for(i=1;i<num_threads;i++) workers[i]=thread(AnalyzeWorker, &ppa);
+    AnalyzeWorker(&ppa);
+    for(i=1;i<num_threads;i++) workers[i].join();
+    delete[] workers;
+
+    // merge in program order
+    for(k=0;k<num_chunks;k++)
     {
-        VariableInfo* var_info = symbol_table->Find(node->id);
-        if(!var_info) {
-            printf("ERROR: Variable '%s' not declared\n", node->id);
-            throw "Terminate Program!";
-        }
-        
-        int memloc = var_info->memloc;
-        double eval_result = EvaluateReal(node->child[0], symbol_table, variables);
-        
-        if(variables[memloc].type == REAL) {
-            variables[memloc].real_val = eval_result;
-        }
-        else if(variables[memloc].type == INTEGER) {
-            variables[memloc].int_val = (int)eval_result;
-        }
-        else if(variables[memloc].type == BOOLEAN) {
-            variables[memloc].bool_val = (eval_result != 0.0);
-        }
+        AnalyzeChunk* chunk=&ppa.chunks[k];
+        for(i=0;i<chunk->xref.num;i++)
+            symbol_table->AddLine(&symbol_table->vars[chunk->xref.entries[i].memloc], chunk->xref.entries[i].line_num);
+        diag->Append(&chunk->diag);
     }
-    
-    // READ statement
-    else if(node->node_kind == READ_NODE)
+    delete[] ppa.chunks;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Program Input ///////////////////////////////////////////////////////////////////
+
+// Values for read statements taken from a file, a pipe or a memory buffer instead of
+// prompting on the keyboard. Values are separated by white space.
+struct InputSource
+{
+    const char* cur;
+    const char* end;
+    int num_values; // number of values consumed so far
+
+    char* owned_buf; // buffer read from a pipe, 0 otherwise
+    void* mapped_buf; // mmap'd regular file, 0 otherwise
+    size_t mapped_size;
+
+    InputSource() {cur=end=0; num_values=0; owned_buf=0; mapped_buf=0; mapped_size=0;}
+    ~InputSource() {Close();}
+
+    void SetBuffer(const char* buf, int len) {Close(); cur=buf; end=buf+len;}
+
+    // "-" reads standard input. Regular files are mmap'd, anything else is read till end of file.
+    bool Open(const char* str)
     {
-        VariableInfo* var_info = symbol_table->Find(node->id);
-        if(!var_info) {
-            printf("ERROR: Variable '%s' not declared\n", node->id);
-            throw "Terminate Program!";
+        Close();
+        int fd=Equals(str, "-") ? 0 : open(str, O_RDONLY);
+        if(fd<0) return false;
+
+        struct stat st;
+        if(fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0)
+        {
+            void* p=mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p!=MAP_FAILED)
+            {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                mapped_buf=p; mapped_size=st.st_size;
+                cur=(const char*)p; end=cur+st.st_size;
+                if(fd!=0) close(fd);
+                return true;
+            }
         }
-        
-        int memloc = var_info->memloc;
-        printf("Enter %s: ", node->id);
-        
-        if(variables[memloc].type == REAL) {
-            scanf("%lf", &variables[memloc].real_val);
+
+        size_t size=0, capacity=1<<16;
+        owned_buf=(char*)malloc(capacity);
+        while(true)
+        {
+            if(size==capacity) {capacity*=2; owned_buf=(char*)realloc(owned_buf, capacity);}
+            ssize_t n=read(fd, owned_buf+size, capacity-size);
+            if(n<=0) break;
+            size+=n;
         }
-        else if(variables[memloc].type == INTEGER) {
-            scanf("%d", &variables[memloc].int_val);
+        cur=owned_buf; end=owned_buf+size;
+        if(fd!=0) close(fd);
+        return true;
+    }
+
+    void Close()
+    {
+        if(mapped_buf) munmap(mapped_buf, mapped_size);
+        if(owned_buf) free(owned_buf);
+        mapped_buf=0; mapped_size=0; owned_buf=0;
+        cur=end=0; num_values=0;
+    }
+
+    // Returns false at end of input
+    bool NextField(const char** pstart, const char** pend)
+    {
+        while(cur<end && (*cur==' ' || *cur=='\t' || *cur=='\r' || *cur=='\n')) cur++;
+        if(cur==end) return false;
+        *pstart=cur;
+        while(cur<end && *cur!=' ' && *cur!='\t' && *cur!='\r' && *cur!='\n') cur++;
+        *pend=cur;
+        num_values++;
+        return true;
+    }
+};
+
+// [+|-]digits, fails on overflow or trailing characters
+bool ParseIntFast(const char* s, const char* e, int* val)
+{
+    bool neg=false;
+    if(s<e && (*s=='+' || *s=='-')) {neg=(*s=='-'); s++;}
+    if(s==e) return false;
+
+    long long v=0;
+    for(;s<e;s++)
+    {
+        if(!IsDigit(*s)) return false;
+        v=v*10+(*s-'0');
+        if(v>2147483648LL) return false;
+    }
+    if(neg) v=-v;
+    if(v>2147483647LL) return false;
+    *val=(int)v;
+    return true;
+}
+
+// [+|-]digits[.digits][(e|E)[+|-]digits]
+// Values with at most 15 significant digits and a small exponent are exact in double
+// arithmetic, anything else falls back to strtod so the result is always correctly rounded.
+bool ParseRealFast(const char* s, const char* e, double* val)
+{
+    static const double pow10[]={1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char* start=s;
+    bool neg=false;
+    if(s<e && (*s=='+' || *s=='-')) {neg=(*s=='-'); s++;}
+
+    unsigned long long mant=0;
+    int num_digits=0, exp10=0;
+    bool any_digit=false;
+
+    for(;s<e && IsDigit(*s);s++)
+    {
+        any_digit=true;
+        if(mant==0 && *s=='0') continue; // leading zeros
+        if(num_digits<19) {mant=mant*10+(*s-'0'); num_digits++;}
+        else {exp10++; num_digits++;}
+    }
+    if(s<e && *s=='.')
+    {
+        s++;
+        for(;s<e && IsDigit(*s);s++)
+        {
+            any_digit=true;
+            if(mant==0 && *s=='0') {exp10--; continue;}
+            if(num_digits<19) {mant=mant*10+(*s-'0'); num_digits++; exp10--;}
+            else num_digits++;
         }
-        else if(variables[memloc].type == BOOLEAN) {
+    }
+    if(!any_digit) return false;
+    if(s<e && (*s=='e' || *s=='E'))
+    {
+        s++;
+        bool exp_neg=false;
+        if(s<e && (*s=='+' || *s=='-')) {exp_neg=(*s=='-'); s++;}
+        if(s==e) return false;
+        int x=0;
+        for(;s<e;s++)
+        {
+            if(!IsDigit(*s)) return false;
+            if(x<100000) x=x*10+(*s-'0');
+        }
+        exp10+=exp_neg ? -x : x;
+    }
+    if(s!=e) return false;
+
+    if(num_digits<=15 && exp10>=-22 && exp10<=22)
+    {
+        double v=(double)mant;
+        if(exp10<0) v/=pow10[-exp10]; else v*=pow10[exp10];
+        *val=neg ? -v : v;
+        return true;
+    }
+
+    char tmp[64];
+    int len=e-start;
+    if(len>=(int)sizeof(tmp)) len=sizeof(tmp)-1;
+    Copy(tmp, start, len);
+    *val=strtod(tmp, 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Performance Counters ////////////////////////////////////////////////////////////
+
+// Counters of the calling thread read with perf_event_open, for -perf. Each event is
+// opened on its own so that one the machine doesn't have (e.g. in a virtual machine)
+// only blanks its column. The task clock is a software event and is nearly always
+// there. Kernel and hypervisor time are excluded, which perf_event_paranoid 2 allows.
+enum CounterId{
+                COUNTER_TASK_CLOCK, COUNTER_CYCLES, COUNTER_INSTRUCTIONS,
+                COUNTER_BRANCH_MISSES, COUNTER_L1D_MISSES, COUNTER_LLC_MISSES,
+                NUM_COUNTERS
+              };
+
+struct CounterValues
+{
+    long long v[NUM_COUNTERS];
+
+    CounterValues() {memset(v, 0, sizeof(v));}
+
+    // adds the counts between the readings from and to
+    void AddDiff(const CounterValues* from, const CounterValues* to)
+    {
+        int i;
+        for(i=0;i<NUM_COUNTERS;i++) v[i]+=to->v[i]-from->v[i];
+    }
+};
+
+struct PerfCounters
+{
+    int fd[NUM_COUNTERS]; // -1 if the event is not available
+
+    PerfCounters() {int i; for(i=0;i<NUM_COUNTERS;i++) fd[i]=-1;}
+    ~PerfCounters() {Close();}
+
+    // Returns false if no event could be opened
+    bool Open()
+    {
+        const unsigned int types[NUM_COUNTERS]=
+            {PERF_TYPE_SOFTWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+        const unsigned long long read_miss=(PERF_COUNT_HW_CACHE_OP_READ<<8) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16);
+        const unsigned long long configs[NUM_COUNTERS]=
+            {PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+             PERF_COUNT_HW_CACHE_L1D | read_miss, PERF_COUNT_HW_CACHE_LL | read_miss};
+
+        bool any=false;
+        int i;
+        for(i=0;i<NUM_COUNTERS;i++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size=sizeof(attr);
+            attr.type=types[i];
+            attr.config=configs[i];
+            attr.exclude_kernel=1;
+            attr.exclude_hv=1;
+            fd[i]=syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if(fd[i]>=0) any=true;
+        }
+        return any;
+    }
+
+    bool Has(int id) const {return fd[id]>=0;}
+
+    void Read(CounterValues* cv) const
+    {
+        int i;
+        for(i=0;i<NUM_COUNTERS;i++)
+        {
+            cv->v[i]=0;
+            if(fd[i]>=0 && read(fd[i], &cv->v[i], sizeof(long long))!=sizeof(long long)) cv->v[i]=0;
+        }
+    }
+
+    void Close()
+    {
+        int i;
+        for(i=0;i<NUM_COUNTERS;i++) if(fd[i]>=0) {close(fd[i]); fd[i]=-1;}
+    }
+};
+
+void PrintCountersHeader(const char* first)
+{
+    printf("%-14s %10s %9s %13s %5s %8s %8s %8s\n", first, "count", "ms", "instructions", "IPC", "br-miss", "L1D-miss", "LLC-miss");
+}
+
+// One line of the report, misses are per 1000 instructions and - means not available
+void PrintCounters(const PerfCounters* pc, const char* name, long long count, const CounterValues* cv)
+{
+    const long long* v=cv->v;
+    long long instructions=v[COUNTER_INSTRUCTIONS];
+    printf("%-14s", name);
+    if(count>=0) printf(" %10lld", count); else printf(" %10s", "");
+    if(pc->Has(COUNTER_TASK_CLOCK)) printf(" %9.3f", v[COUNTER_TASK_CLOCK]*1e-6); else printf(" %9s", "-");
+    if(pc->Has(COUNTER_INSTRUCTIONS)) printf(" %13lld", instructions); else printf(" %13s", "-");
+    if(pc->Has(COUNTER_CYCLES) && pc->Has(COUNTER_INSTRUCTIONS) && v[COUNTER_CYCLES]>0) printf(" %5.2f", (double)instructions/v[COUNTER_CYCLES]);
+    else printf(" %5s", "-");
+    int i;
+    for(i=COUNTER_BRANCH_MISSES;i<=COUNTER_LLC_MISSES;i++)
+    {
+        if(pc->Has(i) && pc->Has(COUNTER_INSTRUCTIONS) && instructions>0) printf(" %8.3f", v[i]*1000.0/instructions);
+        else printf(" %8s", "-");
+    }
+    printf("\n");
+}
+
+const int NUM_TOKEN_TYPES=sizeof(TokenTypeStr)/sizeof(TokenTypeStr[0]);
+const int NUM_PROFILE_SLOTS=SEQ_NODE+1+NUM_TOKEN_TYPES; // a slot per node kind, then one per operator
+
+int ProfileSlot(const TreeNode* node)
+{
+    if(node->node_kind==OPER_NODE) return SEQ_NODE+1+node->oper;
+    return node->node_kind;
+}
+
+// Charges the counters to the kind of node being run, excluding its children. They
+// are read when a node is entered and left, and the counts since the last reading go
+// to the node on top of the stack. Each reading is a system call per event, which is
+// included in the counts, so the profile is for comparing kinds, not for totals.
+struct NodeProfile
+{
+    const PerfCounters* counters;
+    CounterValues last;
+    int* stack; // slots of the nodes being run
+    int depth, capacity;
+    CounterValues totals[NUM_PROFILE_SLOTS];
+    long long counts[NUM_PROFILE_SLOTS];
+
+    NodeProfile(const PerfCounters* pc)
+    {
+        counters=pc; stack=0; depth=0; capacity=0;
+        memset(counts, 0, sizeof(counts));
+    }
+    ~NodeProfile() {free(stack);}
+
+    void Charge()
+    {
+        CounterValues now;
+        counters->Read(&now);
+        if(depth>0) totals[stack[depth-1]].AddDiff(&last, &now);
+        last=now;
+    }
+
+    void Enter(const TreeNode* node)
+    {
+        Charge();
+        if(depth==capacity)
+        {
+            capacity=capacity ? capacity*2 : 64;
+            stack=(int*)realloc(stack, capacity*sizeof(int));
+        }
+        int slot=ProfileSlot(node);
+        stack[depth++]=slot;
+        counts[slot]++;
+    }
+
+    void Exit() {Charge(); depth--;}
+
+    void Print() const
+    {
+        PrintCountersHeader("node");
+        int i;
+        for(i=0;i<NUM_PROFILE_SLOTS;i++)
+        {
+            if(!counts[i]) continue;
+            char name[32];
+            if(i<=SEQ_NODE) Copy(name, NodeKindStr[i]);
+            else sprintf(name, "Oper %s", TokenTypeSpelling((TokenType)(i-SEQ_NODE-1)));
+            PrintCounters(counters, name, counts[i], &totals[i]);
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////////
+// Code Generator //////////////////////////////////////////////////////////////////
+
+struct Variable {
+    ExprDataType type; // of the elements for an array
+    int size; // number of elements of an array, 0 for a scalar
+    union {
+        int int_val;
+        double real_val;
+        bool bool_val;
+        void* elems; // the int, double or bool elements of an array, one after the other
+    };
+    
+    Variable() {
+        type = VOID;
+        size = 0;
+        elems = 0;  // Initialize union
+    }
+};
+
+const long long LIMIT_POLL_INTERVAL=256;
+
+// Input and output of a run through callbacks, for programs run from a library
+struct ExecIO
+{
+    void* user; // passed back to the callbacks
+    void (*write)(void* user, const char* text, int len); // output of write statements and runtime errors
+    bool (*read)(void* user, const char* name, char* buf, int size); // next input value as text, false at end of input
+};
+
+// How often a statement ran, and for an if how often the then branch was taken, for a
+// repeat how many iterations it ran in all
+struct NodeFeedback
+{
+    long long count, taken, iterations;
+};
+
+struct FlatTree;
+struct LoopTier;
+struct LazyBodies;
+
+// Execution state shared by all the statements of one run
+struct Checkpoint;
+
+struct RunInfo
+{
+    InputSource* input; // values of read statements, 0 to prompt on the keyboard
+    OutBuffer* output; // output of write statements and runtime errors, 0 for stdout
+    const ExecIO* io; // if not 0, used instead of input and output
+
+    RunLimits* limits; // 0 for no limits
+    long long num_back_edges;
+    long long next_check; // num_back_edges at which the limits are checked next
+    long long num_output_bytes;
+    int num_io_values; // values read through io
+    NodeProfile* profile; // 0 unless -perf
+    int loop_threads; // threads for reduction loops, 0 to run every loop serially
+    bool fp_reassociate; // real reductions may be summed in a different order
+    NodeFeedback* feedback; // counts by stmt_num for -profile-out, 0 otherwise
+    const FlatTree* tier; // hot loops chosen from a profile, run from this flat tree
+    const unsigned int* tier_nodes; // by stmt_num, the flat node of a hot loop or FLAT_NONE
+    bool tier_up; // switch loops that run TIER_UP_ITERATIONS to the flat tree
+    LoopTier* loop_tier; // the loops switched so far, 0 if none, freed with ReleaseTier
+    bool has_arrays; // look for bounds checks to hoist out of repeat loops
+    bool closed_form; // see RunLoopClosedForm
+    Checkpoint* checkpoint; // 0 unless -checkpoint
+    double checkpoint_time; // GetTime() at which the next checkpoint is due
+    bool checkpoint_due; // written at the next back-edge of a repeat loop
+    LazyBodies* lazy; // 0 unless -lazy
+
+    RunInfo()
+    {
+        input=0; output=0; io=0; limits=0; profile=0; loop_threads=0; fp_reassociate=false;
+        feedback=0; tier=0; tier_nodes=0; tier_up=false; loop_tier=0; has_arrays=false;
+        closed_form=false; checkpoint=0; checkpoint_time=0; checkpoint_due=false; lazy=0;
+        StartRun();
+    }
+
+    // resets the counters, for running the same program again
+    void StartRun()
+    {
+        num_back_edges=0; num_output_bytes=0; num_io_values=0;
+        next_check=LLONG_MAX;
+        if(limits && (limits->max_back_edges || limits->time_up))
+        {
+            next_check=LIMIT_POLL_INTERVAL;
+            if(limits->max_back_edges && limits->max_back_edges<next_check) next_check=limits->max_back_edges;
+        }
+        if(checkpoint && next_check>LIMIT_POLL_INTERVAL) next_check=LIMIT_POLL_INTERVAL;
+    }
+};
+
+// Returns the number of characters printed
+int RunPrint(RunInfo* pri, const char* fmt, ...)
+{
+    char tmp[256];
+    int n;
+    va_list args;
+    va_start(args, fmt);
+    if(pri->io)
+    {
+        n=vsnprintf(tmp, sizeof(tmp), fmt, args);
+        if(n>=(int)sizeof(tmp)) n=sizeof(tmp)-1;
+        if(n>0) pri->io->write(pri->io->user, tmp, n);
+    }
+    else if(pri->output)
+    {
+        n=vsnprintf(tmp, sizeof(tmp), fmt, args);
+        if(n>=(int)sizeof(tmp)) n=sizeof(tmp)-1;
+        if(n>0) pri->output->Append(tmp, n);
+    }
+    else n=vprintf(fmt, args);
+    va_end(args);
+    return n;
+}
+
+void LimitExceeded(RunInfo* pri, const char* what, long long limit, const char* where, int line_num)
+{
+    RunPrint(pri, "ERROR: %s limit of %lld exceeded in %s at line %d\n", what, limit, where, line_num);
+    throw "Terminate Program!";
+}
+
+// Slow path of the back-edge check of a repeat loop
+void CheckLimits(RunInfo* pri, int line_num)
+{
+    pri->next_check=pri->num_back_edges+LIMIT_POLL_INTERVAL;
+    if(pri->checkpoint && GetTime()>=pri->checkpoint_time) pri->checkpoint_due=true;
+    RunLimits* limits=pri->limits;
+    if(!limits) return;
+    if(limits->max_back_edges && pri->num_back_edges>=limits->max_back_edges)
+        LimitExceeded(pri, "Loop iteration", limits->max_back_edges, "repeat", line_num);
+    if(limits->time_up && limits->time_up->load(memory_order_relaxed))
+        LimitExceeded(pri, "Time (ms)", limits->max_time_ms, "repeat", line_num);
+    if(limits->max_back_edges && limits->max_back_edges<pri->next_check) pri->next_check=limits->max_back_edges;
+}
+
+// Called once per iteration of the repeat loop node, after its body
+inline void BackEdge(RunInfo* pri, int line_num)
+{
+    if(++pri->num_back_edges>=pri->next_check) CheckLimits(pri, line_num);
+}
+
+void WriteValue(RunInfo* pri, ExprDataType type, double v, int line_num)
+{
+    int n=0;
+    if(type == REAL) n=RunPrint(pri, "Val: %g\n", v);
+    else if(type == INTEGER) n=RunPrint(pri, "Val: %d\n", (int)v);
+    else if(type == BOOLEAN) n=RunPrint(pri, "Val: %s\n", (v != 0.0) ? "true" : "false");
+
+    pri->num_output_bytes+=n;
+    if(pri->limits && pri->limits->max_output_bytes && pri->num_output_bytes>pri->limits->max_output_bytes)
+        LimitExceeded(pri, "Output (bytes)", pri->limits->max_output_bytes, "write", line_num);
+}
+
+// Sets *flag after max_time_ms unless stopped before
+struct Watchdog
+{
+    thread timer;
+    mutex lock;
+    condition_variable cond;
+    bool stopped;
+    atomic<bool> time_up;
+
+    Watchdog() {stopped=false; time_up=false;}
+    ~Watchdog() {Stop();}
+
+    void Start(int max_time_ms)
+    {
+        stopped=false; time_up=false;
+        timer=thread(&Watchdog::Wait, this, max_time_ms);
+    }
+
+    void Wait(int max_time_ms)
+    {
+        unique_lock<mutex> guard(lock);
+        if(!cond.wait_for(guard, chrono::milliseconds(max_time_ms), [this]{return stopped;})) time_up=true;
+    }
+
+    void Stop()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopped=true;
+        }
+        cond.notify_all();
+        if(timer.joinable()) timer.join();
+    }
+};
+
+void ReadValue(RunInfo* pri, const char* name, int line_num, Variable* var)
+{
+    if(!pri->input && !pri->io)
+    {
+        printf("Enter %s: ", name);
+
+        if(var->type == REAL) {
+            scanf("%lf", &var->real_val);
+        }
+        else if(var->type == INTEGER) {
+            scanf("%d", &var->int_val);
+        }
+        else if(var->type == BOOLEAN) {
             int temp;
             scanf("%d", &temp);
-            variables[memloc].bool_val = (temp != 0);
+            var->bool_val = (temp != 0);
+        }
+        return;
+    }
+
+    const char* s; const char* e;
+    char buf[MAX_TOKEN_LEN+1];
+    int num_values;
+    if(pri->io)
+    {
+        num_values=pri->num_io_values;
+        if(!pri->io->read(pri->io->user, name, buf, sizeof(buf))) {
+            RunPrint(pri, "ERROR: End of input while reading '%s' at line %d (%d values read)\n", name, line_num, num_values);
+            throw "Terminate Program!";
+        }
+        num_values=++pri->num_io_values;
+        s=buf; e=buf+strlen(buf);
+    }
+    else
+    {
+        if(!pri->input->NextField(&s, &e)) {
+            RunPrint(pri, "ERROR: End of input while reading '%s' at line %d (%d values read)\n", name, line_num, pri->input->num_values);
+            throw "Terminate Program!";
+        }
+        num_values=pri->input->num_values;
+    }
+
+    bool ok=false;
+    if(var->type == REAL) ok=ParseRealFast(s, e, &var->real_val);
+    else if(var->type == INTEGER) ok=ParseIntFast(s, e, &var->int_val);
+    else if(var->type == BOOLEAN) {
+        int temp;
+        ok=ParseIntFast(s, e, &temp);
+        var->bool_val = (temp != 0);
+    }
+    if(!ok) {
+        RunPrint(pri, "ERROR: Invalid %s value '%.*s' for '%s' at line %d (input value %d)\n",
+               ExprDataTypeStr[var->type], (int)(e-s), s, name, line_num, num_values);
+        throw "Terminate Program!";
+    }
+}
+
+int Power(int a, int b)
+{
+    if(a==0) return 0;
+    if(b==0) return 1;
+    if(b>=1) return a*Power(a, b-1);
+    return 0;
+}
+
+inline double ApplyOper(TokenType oper, double a, double b)
+{
+    if(oper == EQUAL) return (a == b) ? 1.0 : 0.0;
+    if(oper == LESS_THAN) return (a < b) ? 1.0 : 0.0;
+    if(oper == PLUS) return a + b;
+    if(oper == MINUS) return a - b;
+    if(oper == TIMES) return a * b;
+    if(oper == DIVIDE) return a / b;
+    if(oper == POWER) return pow(a, b);  
+    if(oper == AND_OPER) return (a * a) - (b * b);
+    
+    return 0.0;
+}
+
+// Index of the element of array var that node refers to, a runtime error if it is out of
+// bounds. The index is truncated like a value assigned to an int.
+inline int ElementIndex(const Variable* var, const TreeNode* node, double index, RunInfo* pri)
+{
+    if(!node->in_bounds && !(index > -1 && index < var->size)) {
+        RunPrint(pri, "ERROR: Index %g out of bounds for '%s[%d]' at line %d\n", index, node->id, var->size, node->line_num);
+        throw "Terminate Program!";
+    }
+    return (int)index;
+}
+
+inline double ElementValue(const Variable* var, int i)
+{
+    if(var->type == REAL) return ((double*)var->elems)[i];
+    if(var->type == INTEGER) return (double)((int*)var->elems)[i];
+    return ((bool*)var->elems)[i] ? 1.0 : 0.0;
+}
+
+inline void SetElement(Variable* var, int i, double v)
+{
+    if(var->type == REAL) ((double*)var->elems)[i] = v;
+    else if(var->type == INTEGER) ((int*)var->elems)[i] = (int)v;
+    else ((bool*)var->elems)[i] = (v != 0.0);
+}
+
+//interpreter
+// Unified evaluation function that handles all types
+double EvaluateProfiled(TreeNode* node, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, NodeProfile* profile);
+
+// pri is where runtime errors are written
+double EvaluateReal(TreeNode* node, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, NodeProfile* profile=0)
+{
+    if(profile) return EvaluateProfiled(node, symbol_table, variables, pri, profile);
+
+    // Base cases: NUM_NODE and ID_NODE
+    if(node->node_kind == NUM_NODE) {
+        if(node->expr_data_type == REAL) 
+            return node->real_num;
+        else 
+            return (double)node->num;
+    }
+    
+    if(node->node_kind == ID_NODE) {
+        VariableInfo* var_info = symbol_table->Find(node->id);
+        if(!var_info) {
+            printf("ERROR: Variable '%s' not found\n", node->id);
+            throw "Terminate Program!";
+        }
+        int memloc = var_info->memloc;
+        
+        if(variables[memloc].type == REAL) 
+            return variables[memloc].real_val;
+        else if(variables[memloc].type == INTEGER) 
+            return (double)variables[memloc].int_val;
+        else if(variables[memloc].type == BOOLEAN)
+            return variables[memloc].bool_val ? 1.0 : 0.0;
+        
+        return 0.0;
+    }
+
+    if(node->node_kind == INDEX_NODE) {
+        const Variable* var = &variables[symbol_table->Find(node->id)->memloc];
+        return ElementValue(var, ElementIndex(var, node, EvaluateReal(node->child[0], symbol_table, variables, pri), pri));
+    }
+
+    // Recursive evaluation for operators
+    double a = EvaluateReal(node->child[0], symbol_table, variables, pri);
+    double b = EvaluateReal(node->child[1], symbol_table, variables, pri);
+    return ApplyOper(node->oper, a, b);
+}
+
+// EvaluateReal for -perf, kept apart so that the normal one doesn't pay for the profile
+double EvaluateProfiled(TreeNode* node, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, NodeProfile* profile)
+{
+    profile->Enter(node);
+    double v;
+    if(node->node_kind == OPER_NODE)
+    {
+        double a = EvaluateProfiled(node->child[0], symbol_table, variables, pri, profile);
+        double b = EvaluateProfiled(node->child[1], symbol_table, variables, pri, profile);
+        v = ApplyOper(node->oper, a, b);
+    }
+    else v = EvaluateReal(node, symbol_table, variables, pri);
+    profile->Exit();
+    return v;
+}
+
+bool RunLoopClosedForm(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri);
+bool RunLoopParallel(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri);
+void RunFlat(const FlatTree* ft, unsigned int n, Variable* variables, RunInfo* pri);
+bool RunLoopTier(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, bool tier_up);
+void ReleaseTier(RunInfo* pri);
+int HoistBoundsChecks(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, TreeNode** hoisted);
+void WriteCheckpoint(TreeNode* loop, Variable* variables, RunInfo* pri);
+void ExpandLazy(TreeNode* lazy, RunInfo* pri);
+void RunProgram(TreeNode* node, SymbolTable* symbol_table, Variable* variables, RunInfo* pri);
+
+const int TIER_UP_ITERATIONS=1000;
+const int MAX_HOISTED_CHECKS=64; // per loop
+
+void RunRepeat(TreeNode* node, SymbolTable* symbol_table, Variable* variables, RunInfo* pri)
+{
+    if(node->child[0]->node_kind == LAZY_NODE) ExpandLazy(node->child[0], pri);
+    bool done = pri->closed_form && RunLoopClosedForm(node, symbol_table, variables, pri);
+    if(!done && pri->loop_threads) done = RunLoopParallel(node, symbol_table, variables, pri);
+    if(!done && pri->tier_nodes && pri->tier_nodes[node->stmt_num]) {
+        RunFlat(pri->tier, pri->tier_nodes[node->stmt_num], variables, pri);
+        done = true;
+    }
+    if(!done && pri->loop_tier) done = RunLoopTier(node, symbol_table, variables, pri, false);
+    // a runtime error ends the run, so the marks are only taken back on a normal exit
+    TreeNode* hoisted[MAX_HOISTED_CHECKS];
+    int num_hoisted = !done && pri->has_arrays ? HoistBoundsChecks(node, symbol_table, variables, pri, hoisted) : 0;
+    int iterations = 0;
+    while(!done) {
+        if(pri->feedback) pri->feedback[node->stmt_num].iterations++;
+        RunProgram(node->child[0], symbol_table, variables, pri);
+        if(EvaluateReal(node->child[1], symbol_table, variables, pri, pri->profile) != 0.0) break;
+        BackEdge(pri, node->line_num);
+        if(pri->checkpoint_due) WriteCheckpoint(node, variables, pri);
+
+        // on-stack replacement: the variables are shared, so the flat tree picks
+        // the loop up at the next iteration and returns here when it exits
+        if(++iterations == TIER_UP_ITERATIONS && pri->tier_up)
+            done = RunLoopTier(node, symbol_table, variables, pri, true);
+    }
+    while(num_hoisted) hoisted[--num_hoisted]->in_bounds = false;
+}
+
+// NEW: Updated RunProgram to handle multiple types
+void RunProgram(TreeNode* node, SymbolTable* symbol_table, Variable* variables, RunInfo* pri)
+{
+    if(!node) return;  // Safety check
+    
+    // Handle declarations - skip them during execution
+    if(node->node_kind == DECLARE_NODE) {
+        // Declarations already processed, just skip
+        if(node->sibling) RunProgram(node->sibling, symbol_table, variables, pri);
+        return;
+    }
+
+    if(pri->profile) pri->profile->Enter(node);
+    if(pri->feedback) pri->feedback[node->stmt_num].count++;
+    
+    // IF statement
+    if(node->node_kind == IF_NODE)
+    {
+        double cond_val = EvaluateReal(node->child[0], symbol_table, variables, pri, pri->profile);
+        bool cond = (cond_val != 0.0);  // Convert to boolean
+        if(pri->feedback && cond) pri->feedback[node->stmt_num].taken++;
+        
+        TreeNode* branch = cond ? node->child[1] : node->child[2];
+        if(branch && branch->node_kind == LAZY_NODE) ExpandLazy(branch, pri);
+        if(branch)
+            RunProgram(branch, symbol_table, variables, pri);
+    }
+    
+    // ASSIGN statement
+    else if(node->node_kind == ASSIGN_NODE)
+    {
+        VariableInfo* var_info = symbol_table->Find(node->id);
+        if(!var_info) {
+            printf("ERROR: Variable '%s' not declared\n", node->id);
+            throw "Terminate Program!";
+        }
+        
+        int memloc = var_info->memloc;
+        double eval_result = EvaluateReal(node->child[0], symbol_table, variables, pri, pri->profile);
+        
+        if(node->child[1]) {
+            Variable* var = &variables[memloc];
+            SetElement(var, ElementIndex(var, node, EvaluateReal(node->child[1], symbol_table, variables, pri, pri->profile), pri), eval_result);
+        }
+        else if(variables[memloc].type == REAL) {
+            variables[memloc].real_val = eval_result;
+        }
+        else if(variables[memloc].type == INTEGER) {
+            variables[memloc].int_val = (int)eval_result;
+        }
+        else if(variables[memloc].type == BOOLEAN) {
+            variables[memloc].bool_val = (eval_result != 0.0);
+        }
+    }
+    
+    // READ statement
+    else if(node->node_kind == READ_NODE)
+    {
+        VariableInfo* var_info = symbol_table->Find(node->id);
+        if(!var_info) {
+            printf("ERROR: Variable '%s' not declared\n", node->id);
+            throw "Terminate Program!";
+        }
+        
+        int memloc = var_info->memloc;
+        if(node->child[0]) {
+            Variable* var = &variables[memloc];
+            int i = ElementIndex(var, node, EvaluateReal(node->child[0], symbol_table, variables, pri, pri->profile), pri);
+            Variable element;
+            element.type = var->type;
+            ReadValue(pri, node->id, node->line_num, &element);
+            SetElement(var, i, element.type == REAL ? element.real_val : element.type == INTEGER ? element.int_val : element.bool_val);
+        }
+        else ReadValue(pri, node->id, node->line_num, &variables[memloc]);
+    }
+    
+    // WRITE statement
+    else if(node->node_kind == WRITE_NODE)
+    {
+        double v = EvaluateReal(node->child[0], symbol_table, variables, pri, pri->profile);
+        WriteValue(pri, node->child[0]->expr_data_type, v, node->line_num);
+    }
+    
+    // REPEAT statement
+    else if(node->node_kind == REPEAT_NODE)
+        RunRepeat(node, symbol_table, variables, pri);
+
+    if(pri->profile) pri->profile->Exit();
+    
+    // Process sibling statements
+    if(node->sibling) 
+        RunProgram(node->sibling, symbol_table, variables, pri);
+}
+int ElementSize(ExprDataType type)
+{
+    return type == REAL ? sizeof(double) : type == INTEGER ? sizeof(int) : sizeof(bool);
+}
+
+// Initialize all variables based on their declared types
+void InitVariables(const SymbolTable* symbol_table, Variable* variables)
+{
+    int i;
+    for(i = 0; i < symbol_table->num_vars; i++)
+    {
+        const VariableInfo* curv = &symbol_table->vars[i];
+        Variable* var = &variables[curv->memloc];
+        var->type = curv->var_type;
+
+        if(curv->size) {
+            // an array keeps its elements from an earlier run, they are only cleared
+            int elem_size = ElementSize(curv->var_type);
+            if(!var->elems) var->elems = calloc(curv->size, elem_size);
+            else memset(var->elems, 0, (size_t)curv->size*elem_size);
+            var->size = curv->size;
+        }
+        else if(curv->var_type == INTEGER)
+            variables[curv->memloc].int_val = 0;
+        else if(curv->var_type == REAL)
+            variables[curv->memloc].real_val = 0.0;
+        else if(curv->var_type == BOOLEAN)
+            variables[curv->memloc].bool_val = false;
+    }
+}
+
+// Frees the variables with the elements of the arrays among them
+void FreeVariables(const SymbolTable* symbol_table, Variable* variables)
+{
+    int i;
+    for(i = 0; i < symbol_table->num_vars; i++) if(variables[i].size) free(variables[i].elems);
+    delete[] variables;
+}
+
+// NEW: Updated entry point for RunProgram
+void RunProgram(TreeNode* syntax_tree, SymbolTable* symbol_table, RunInfo* pri)
+{
+    // Allocate array of Variable structures instead of just ints
+    Variable* variables = new Variable[symbol_table->num_vars];
+    InitVariables(symbol_table, variables);
+    
+    // Run the program
+    try {
+        RunProgram(syntax_tree, symbol_table, variables, pri);
+    }
+    catch(...) {
+        FreeVariables(symbol_table, variables);
+        ReleaseTier(pri);
+        throw;
+    }
+    
+    // Clean up
+    FreeVariables(symbol_table, variables);
+    ReleaseTier(pri);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Lazy Parsing ////////////////////////////////////////////////////////////////////
+
+// With -lazy the source is scanned into a token array, and the parser only skims the
+// body of each if branch and repeat loop, matching the ifs and repeats in it with their
+// ends and untils, and leaves a LAZY_NODE holding the index of its first token. The
+// first time the body is run it is parsed and analyzed from there, which skims the
+// bodies nested in it in turn, and its first statement takes the place of the LAZY_NODE,
+// so the tree is then the same as if it had been parsed at once. Compiling takes time
+// for the top level statements only, and code that never runs is never parsed. The
+// errors of a body are only found when it is first run, and end the run then. Loops
+// that still have an unparsed body in them get no bounds checks hoisted.
+
+struct LazyBodies
+{
+    TokenArray* tokens;
+    Arena* arena; // the parsed bodies
+    SymbolTable* symbol_table;
+    int num_expanded;
+    double expand_time;
+
+    LazyBodies() {tokens=0; arena=0; symbol_table=0; num_expanded=0; expand_time=0;}
+};
+
+// Number of the LAZY_NODEs in the tree
+int CountLazy(const TreeNode* node)
+{
+    int n=0;
+    for(;node;node=node->sibling)
+    {
+        if(node->node_kind==LAZY_NODE) n++;
+        else if(node->node_kind==IF_NODE || node->node_kind==REPEAT_NODE)
+        {
+            int i;
+            for(i=0;i<MAX_CHILDREN;i++) n+=CountLazy(node->child[i]);
+        }
+    }
+    return n;
+}
+
+// Parses and analyzes the body that lazy stands for and puts it in its place
+void ExpandLazy(TreeNode* lazy, RunInfo* pri)
+{
+    LazyBodies* lb=pri->lazy;
+    double t0=GetTime();
+    CompilerInfo compiler_info(0, 0, 0);
+    compiler_info.token_array=lb->tokens;
+    compiler_info.token_pos=lazy->num;
+
+    Diagnostics diag;
+    ParseInfo parse_info;
+    parse_info.diag=&diag;
+    parse_info.arena=lb->arena;
+    parse_info.lazy=true;
+    GetNextToken(&compiler_info, &parse_info.next_token);
+    TreeNode* body=StmtSeq(&compiler_info, &parse_info);
+    if(body) Analyze(body, lb->symbol_table, &diag);
+    if(diag.num || !body)
+    {
+        diag.SortByLine();
+        diag.Print();
+        printf("%d error(s) found\n", diag.num); fflush(NULL);
+        throw "Terminate Program!";
+    }
+    *lazy=*body;
+    lb->num_expanded++;
+    lb->expand_time+=GetTime()-t0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Parallel Loops //////////////////////////////////////////////////////////////////
+
+// A repeat loop is split over threads when its body is only assignments of the forms
+//     i := i + c        (or c + i, i - c; c an integer literal, i an int variable)
+//     v := v + e        (or e + v, v - e, v * e, e * v, v + e1 - e2 + ...,  v * e1 * e2 ...)
+// and its condition compares i with an expression of variables the loop doesn't assign
+// (i < n, n < i or i = n). Then the trip count is known before the loop starts, and
+// each term e depends only on i, so every thread evaluates a contiguous block of iterations
+// into partial results that are combined in block order.
+//
+// Int reductions give the same result as the serial loop: every e must be a whole
+// number and every value assigned must stay in the int range, which is checked from
+// the prefix minimum and maximum of each block, otherwise the loop is run serially.
+// Real reductions are only split with -fp-reassociate, because a block sums its own
+// terms from 0 (or multiplies them from 1) and the partials are added to the initial
+// value in block order, which rounds differently from the serial loop. The result
+// depends on the number of threads but is the same from run to run.
+
+#define MAX_LOOP_REDUCTIONS 16
+#define MAX_REDUCTION_TERMS 8
+const long long PARALLEL_LOOP_MIN_TRIPS=1<<14; // per thread, shorter loops aren't worth the threads
+
+struct LoopReduction
+{
+    int memloc;
+    ExprDataType type;
+    TokenType oper; // PLUS or TIMES
+    TreeNode* terms[MAX_REDUCTION_TERMS]; // in the order they are applied to v
+    bool negate[MAX_REDUCTION_TERMS]; // subtracted
+    int num_terms;
+    int i_offset; // 1 if the induction variable is stepped before this statement
+};
+
+struct ReductionLoop
+{
+    int i_memloc;
+    long long i0, step; // induction variable on entry and its step
+    long long trips; // iterations until the condition holds
+    LoopReduction reds[MAX_LOOP_REDUCTIONS];
+    int num_reds;
+};
+
+bool IsIdNode(const TreeNode* node, const char* id)
+{
+    return node->node_kind==ID_NODE && Equals(node->id, id);
+}
+
+// True if the expression reads an array element. Its index is checked, and a bounds
+// error can't be raised on a worker thread.
+bool ReadsArray(const TreeNode* node)
+{
+    if(!node) return false;
+    return node->node_kind==INDEX_NODE || ReadsArray(node->child[0]) || ReadsArray(node->child[1]);
+}
+
+// True if the expression reads one of the variables assigned in the loop, other than except
+bool ReadsAssigned(const TreeNode* node, TreeNode** assigns, int num_assigns, const char* except)
+{
+    if(!node) return false;
+    if(node->node_kind==ID_NODE || node->node_kind==INDEX_NODE)
+    {
+        int i;
+        for(i=0;i<num_assigns;i++) if(Equals(node->id, assigns[i]->id) && !(except && Equals(node->id, except))) return true;
+        return node->node_kind==INDEX_NODE && ReadsAssigned(node->child[0], assigns, num_assigns, except);
+    }
+    if(node->node_kind!=OPER_NODE) return false;
+    return ReadsAssigned(node->child[0], assigns, num_assigns, except) || ReadsAssigned(node->child[1], assigns, num_assigns, except);
+}
+
+// Splits v := v + e1 - e2 ... or v := v * e1 * e2 ... (parsed as ((v + e1) - e2) ...)
+// or v := e + v or v := e * v into its terms, returns false for any other form
+bool MatchReduction(TreeNode* v, LoopReduction* red)
+{
+    TreeNode* e=v->child[0];
+    if(e->node_kind!=OPER_NODE) return false;
+    if((e->oper==PLUS || e->oper==TIMES) && IsIdNode(e->child[1], v->id))
+    {
+        red->oper=e->oper;
+        red->terms[0]=e->child[0];
+        red->negate[0]=false;
+        red->num_terms=1;
+        return true;
+    }
+
+    red->oper=e->oper==TIMES ? TIMES : PLUS;
+    TreeNode* spine[MAX_REDUCTION_TERMS];
+    int n=0;
+    while(true)
+    {
+        if(e->node_kind!=OPER_NODE || n==MAX_REDUCTION_TERMS) return false;
+        if(red->oper==TIMES ? e->oper!=TIMES : (e->oper!=PLUS && e->oper!=MINUS)) return false;
+        spine[n++]=e;
+        if(IsIdNode(e->child[0], v->id)) break;
+        e=e->child[0];
+    }
+    red->num_terms=n;
+    int i;
+    for(i=0;i<n;i++)
+    {
+        red->terms[i]=spine[n-1-i]->child[1];
+        red->negate[i]=spine[n-1-i]->oper==MINUS;
+    }
+    return true;
+}
+
+// Value of the condition after iteration k (counted from 1) of the loop
+bool LoopCondAt(TokenType oper, bool i_on_left, double bound, long long i0, long long step, long long k)
+{
+    double i=(double)(i0+k*step);
+    if(oper==EQUAL) return i==bound;
+    return i_on_left ? i<bound : bound<i;
+}
+
+// Trip count of a loop that steps i from i0 and ends when the condition holds: the first
+// k>=1 at which it does. i changes monotonically, so it is found from an estimate and
+// checked. Returns false for a loop that never ends or takes i out of the int range.
+bool LoopTrips(TokenType oper, bool i_on_left, double bound, long long i0, long long step, long long* trips)
+{
+    if(!(fabs(bound)<2147483648.0)) return false;
+    long long k=(long long)((bound-i0)/step);
+    if(oper==EQUAL)
+    {
+        if(k<1 || !LoopCondAt(oper, i_on_left, bound, i0, step, k)) return false;
+    }
+    else
+    {
+        // the condition must turn true as i moves
+        if(i_on_left ? step>0 : step<0)
+        {
+            if(!LoopCondAt(oper, i_on_left, bound, i0, step, 1)) return false;
+            k=1;
+        }
+        if(k<1) k=1;
+        while(!LoopCondAt(oper, i_on_left, bound, i0, step, k)) k++;
+        while(k>1 && LoopCondAt(oper, i_on_left, bound, i0, step, k-1)) k--;
+    }
+    long long last=i0+k*step;
+    if(last<INT_MIN || last>INT_MAX) return false;
+    *trips=k;
+    return true;
+}
+
+// Fills rl if the loop has the form above and ends, with the variables as they are now
+bool MatchReductionLoop(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, ReductionLoop* rl)
+{
+    TreeNode* assigns[MAX_LOOP_REDUCTIONS+1];
+    int num_assigns=0;
+    TreeNode* stmt;
+    int i;
+    for(stmt=loop->child[0];stmt;stmt=stmt->sibling)
+    {
+        if(stmt->node_kind!=ASSIGN_NODE || stmt->child[1] || num_assigns==MAX_LOOP_REDUCTIONS+1) return false;
+        for(i=0;i<num_assigns;i++) if(Equals(assigns[i]->id, stmt->id)) return false;
+        assigns[num_assigns++]=stmt;
+    }
+
+    // the condition names the induction variable
+    TreeNode* cond=loop->child[1];
+    if(cond->node_kind!=OPER_NODE || (cond->oper!=LESS_THAN && cond->oper!=EQUAL)) return false;
+    int i_pos=-1;
+    bool i_on_left=false;
+    for(i=0;i<num_assigns && i_pos<0;i++)
+    {
+        if(IsIdNode(cond->child[0], assigns[i]->id)) {i_pos=i; i_on_left=true;}
+        else if(IsIdNode(cond->child[1], assigns[i]->id)) i_pos=i;
+    }
+    if(i_pos<0) return false;
+    TreeNode* bound_expr=cond->child[i_on_left ? 1 : 0];
+    if(ReadsAssigned(bound_expr, assigns, num_assigns, 0)) return false;
+
+    // i := i + c
+    TreeNode* i_stmt=assigns[i_pos];
+    TreeNode* e=i_stmt->child[0];
+    const char* i_id=i_stmt->id;
+    if(e->node_kind!=OPER_NODE || (e->oper!=PLUS && e->oper!=MINUS)) return false;
+    TreeNode* c=0;
+    if(IsIdNode(e->child[0], i_id)) c=e->child[1];
+    else if(e->oper==PLUS && IsIdNode(e->child[1], i_id)) c=e->child[0];
+    if(!c || c->node_kind!=NUM_NODE || c->expr_data_type!=INTEGER || c->num==0) return false;
+    rl->i_memloc=symbol_table->Find(i_id)->memloc;
+    if(variables[rl->i_memloc].type!=INTEGER) return false;
+    rl->i0=variables[rl->i_memloc].int_val;
+    rl->step=e->oper==MINUS ? -(long long)c->num : c->num;
+
+    // the other statements are reductions of terms that depend on i only
+    rl->num_reds=0;
+    for(i=0;i<num_assigns;i++)
+    {
+        if(i==i_pos) continue;
+        LoopReduction* red=&rl->reds[rl->num_reds++];
+        TreeNode* v=assigns[i];
+        if(!MatchReduction(v, red)) return false;
+        int t;
+        for(t=0;t<red->num_terms;t++) if(ReadsAssigned(red->terms[t], assigns, num_assigns, i_id) || ReadsArray(red->terms[t])) return false;
+
+        red->memloc=symbol_table->Find(v->id)->memloc;
+        red->type=variables[red->memloc].type;
+        if(red->type!=INTEGER && !(red->type==REAL && pri->fp_reassociate)) return false;
+        red->i_offset=i>i_pos;
+    }
+
+    double bound=EvaluateReal(bound_expr, symbol_table, variables, pri);
+    return LoopTrips(cond->oper, i_on_left, bound, rl->i0, rl->step, &rl->trips);
+}
+
+// Partial results of one block of iterations
+struct LoopBlock
+{
+    long long lo, hi; // iterations lo..hi-1, counted from 0
+    long long int_acc[MAX_LOOP_REDUCTIONS];
+    long long int_min[MAX_LOOP_REDUCTIONS], int_max[MAX_LOOP_REDUCTIONS]; // of the running sums, or max magnitude of the running products
+    double real_acc[MAX_LOOP_REDUCTIONS];
+    bool ok; // false if an int reduction can't be combined exactly
+};
+
+void RunLoopBlock(const ReductionLoop* rl, SymbolTable* symbol_table, const Variable* variables, int num_vars, LoopBlock* block)
+{
+    Variable* vars=new Variable[num_vars];
+    memcpy(vars, variables, num_vars*sizeof(Variable));
+
+    const double limit=4294967296.0; // an int value past this can't stay in range
+    int j, t;
+    for(j=0;j<rl->num_reds;j++)
+    {
+        const LoopReduction* red=&rl->reds[j];
+        block->int_acc[j]=red->oper==TIMES;
+        block->int_min[j]=block->int_max[j]=block->int_acc[j];
+        block->real_acc[j]=red->oper==TIMES;
+    }
+    block->ok=true;
+
+    long long k;
+    try {
+        for(k=block->lo;k<block->hi && block->ok;k++)
+        {
+            for(j=0;j<rl->num_reds;j++)
+            {
+                const LoopReduction* red=&rl->reds[j];
+                vars[rl->i_memloc].int_val=(int)(rl->i0+(k+red->i_offset)*rl->step);
+
+                // what the statement adds to or multiplies v by
+                double real_x=red->oper==TIMES;
+                long long x=red->oper==TIMES;
+                for(t=0;t<red->num_terms;t++)
+                {
+                    double term=EvaluateReal(red->terms[t], symbol_table, vars, 0); // the terms read no arrays, so no errors
+                    if(red->negate[t]) term=-term;
+                    if(red->type==REAL) {if(red->oper==PLUS) real_x+=term; else real_x*=term; continue;}
+                    if(!(fabs(term)<limit) || term!=floor(term)) {block->ok=false; break;}
+                    if(red->oper==PLUS) x+=(long long)term; else x*=(long long)term;
+                    if(x<=-limit || x>=limit) {block->ok=false; break;}
+                }
+                if(!block->ok) break;
+                if(red->type==REAL)
+                {
+                    if(red->oper==PLUS) block->real_acc[j]+=real_x;
+                    else block->real_acc[j]*=real_x;
+                    continue;
+                }
+
+                long long acc=block->int_acc[j];
+                if(red->oper==PLUS)
+                {
+                    acc+=x;
+                    if(acc<block->int_min[j]) block->int_min[j]=acc;
+                    if(acc>block->int_max[j]) block->int_max[j]=acc;
+                }
+                else
+                {
+                    acc*=x;
+                    long long m=acc<0 ? -acc : acc;
+                    if(m>block->int_max[j]) block->int_max[j]=m;
+                }
+                if(acc<=-limit || acc>=limit) {block->ok=false; break;}
+                block->int_acc[j]=acc;
+            }
+        }
+    }
+    catch(...) {
+        block->ok=false;
+    }
+    delete[] vars;
+}
+
+// Runs the loop on pri->loop_threads threads if it has the form above and is long
+// enough, returns false without changing the variables otherwise. Runs with limits
+// stay serial, so that a limit stops at the same iteration.
+bool RunLoopParallel(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri)
+{
+    if(pri->limits || pri->profile) return false;
+    ReductionLoop rl;
+    if(!MatchReductionLoop(loop, symbol_table, variables, pri, &rl)) return false;
+
+    long long num_threads=rl.trips/PARALLEL_LOOP_MIN_TRIPS;
+    if(num_threads>pri->loop_threads) num_threads=pri->loop_threads;
+    if(num_threads<2) return false;
+
+    LoopBlock* blocks=new LoopBlock[num_threads];
+    thread* threads=new thread[num_threads];
+    int t;
+    for(t=0;t<num_threads;t++)
+    {
+        blocks[t].lo=rl.trips*t/num_threads;
+        blocks[t].hi=rl.trips*(t+1)/num_threads;
+        threads[t]=thread(RunLoopBlock, &rl, symbol_table, variables, symbol_table->num_vars, &blocks[t]);
+    }
+    for(t=0;t<num_threads;t++) threads[t].join();
+    delete[] threads;
+
+    // combine in block order, checking every running int value stays in range
+    long long int_vals[MAX_LOOP_REDUCTIONS];
+    bool ok=true;
+    for(t=0;t<num_threads;t++) if(!blocks[t].ok) ok=false;
+    int j;
+    for(j=0;j<rl.num_reds && ok;j++)
+    {
+        const LoopReduction* red=&rl.reds[j];
+        Variable* v=&variables[red->memloc];
+        if(red->type==REAL) continue;
+        long long acc=v->int_val;
+        for(t=0;t<num_threads && ok;t++)
+        {
+            LoopBlock* b=&blocks[t];
+            if(red->oper==PLUS)
+            {
+                ok=acc+b->int_min[j]>=INT_MIN && acc+b->int_max[j]<=INT_MAX;
+                acc+=b->int_acc[j];
+            }
+            else
+            {
+                long long m=acc<0 ? -acc : acc;
+                ok=m==0 || b->int_max[j]<=INT_MAX/m;
+                acc*=b->int_acc[j];
+            }
+        }
+        int_vals[j]=acc;
+    }
+    if(!ok) {delete[] blocks; return false;}
+
+    for(j=0;j<rl.num_reds;j++)
+    {
+        const LoopReduction* red=&rl.reds[j];
+        Variable* v=&variables[red->memloc];
+        if(red->type==INTEGER) {v->int_val=(int)int_vals[j]; continue;}
+        for(t=0;t<num_threads;t++)
+        {
+            if(red->oper==PLUS) v->real_val+=blocks[t].real_acc[j];
+            else v->real_val*=blocks[t].real_acc[j];
+        }
+    }
+    variables[rl.i_memloc].int_val=(int)(rl.i0+rl.trips*rl.step);
+    pri->num_back_edges+=rl.trips-1;
+    delete[] blocks;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Closed Form Loops ///////////////////////////////////////////////////////////////
+
+// A loop of the form the parallel loops take, whose terms are polynomials in i of degree
+// MAX_CLOSED_DEGREE at most, isn't run at all. i moves along an arithmetic sequence, so
+// a sum of terms of degree d follows from the first d+1 of them by forward differences,
+//     p(0) + p(1) + ... + p(T-1) = C(T,1) p(0) + C(T,2) dp(0) + ... + C(T,d+1) d^d p(0)
+// a product of a constant term is a power, and a loop that only counts just sets i.
+// Int results are exactly those of the loop: the terms have no division, and bounds on
+// every value the loop would compute show that it is exact in a double and that the
+// variable never leaves the int range, otherwise the loop is run. Real results round
+// differently from the loop, so they need -fp-reassociate.
+
+#define MAX_CLOSED_DEGREE 3
+const long long CLOSED_FORM_MIN_TRIPS=MAX_CLOSED_DEGREE+2;
+const double CLOSED_FORM_EXACT=4503599627370496.0; // 2^52, leaves room to add the variable
+
+struct Interval
+{
+    double lo, hi;
+};
+
+Interval IntervalTimes(Interval a, Interval b)
+{
+    double p[4]={a.lo*b.lo, a.lo*b.hi, a.hi*b.lo, a.hi*b.hi};
+    Interval r={p[0], p[0]};
+    int k;
+    for(k=1;k<4;k++) {if(p[k]<r.lo) r.lo=p[k]; if(p[k]>r.hi) r.hi=p[k];}
+    return r;
+}
+
+// Degree in i of a term, -1 if it isn't a polynomial of degree MAX_CLOSED_DEGREE at most
+// or, for an int reduction, has a division. range gets the values of the term while i
+// stays in i_range, a term with a part that could reach CLOSED_FORM_EXACT is also -1.
+int TermDegree(const TreeNode* node, const ReductionLoop* rl, Interval i_range, bool is_int,
+               SymbolTable* symbol_table, const Variable* variables, Interval* range)
+{
+    int degree;
+    if(node->node_kind==NUM_NODE)
+    {
+        range->lo=range->hi=node->expr_data_type==REAL ? node->real_num : (double)node->num;
+        degree=0;
+    }
+    else if(node->node_kind==ID_NODE)
+    {
+        int memloc=symbol_table->Find(node->id)->memloc;
+        const Variable* v=&variables[memloc];
+        if(memloc==rl->i_memloc) {*range=i_range; degree=1;}
+        else {range->lo=range->hi=v->type==REAL ? v->real_val : (double)v->int_val; degree=0;}
+    }
+    else if(node->node_kind==OPER_NODE)
+    {
+        Interval a, b;
+        int da=TermDegree(node->child[0], rl, i_range, is_int, symbol_table, variables, &a);
+        int db=TermDegree(node->child[1], rl, i_range, is_int, symbol_table, variables, &b);
+        if(da<0 || db<0) return -1;
+        if(node->oper==PLUS) {range->lo=a.lo+b.lo; range->hi=a.hi+b.hi; degree=da>db ? da : db;}
+        else if(node->oper==MINUS) {range->lo=a.lo-b.hi; range->hi=a.hi-b.lo; degree=da>db ? da : db;}
+        else if(node->oper==TIMES) {*range=IntervalTimes(a, b); degree=da+db;}
+        else if(node->oper==AND_OPER)
+        {
+            // a*a - b*b
+            Interval aa=IntervalTimes(a, a), bb=IntervalTimes(b, b);
+            range->lo=aa.lo-bb.hi; range->hi=aa.hi-bb.lo;
+            degree=2*(da>db ? da : db);
+        }
+        else if(node->oper==POWER)
+        {
+            const TreeNode* e=node->child[1];
+            if(e->node_kind!=NUM_NODE || e->expr_data_type!=INTEGER || e->num<0 || e->num>MAX_CLOSED_DEGREE) return -1;
+            range->lo=range->hi=1;
+            int k;
+            for(k=0;k<e->num;k++) *range=IntervalTimes(*range, a);
+            degree=da*e->num;
+        }
+        else if(node->oper==DIVIDE && !is_int && db==0 && (b.lo>0 || b.hi<0))
+        {
+            Interval inv={1/b.hi, 1/b.lo};
+            *range=IntervalTimes(a, inv);
+            degree=da;
+        }
+        else return -1;
+    }
+    else return -1;
+
+    if(degree>MAX_CLOSED_DEGREE || !(range->lo>-CLOSED_FORM_EXACT && range->hi<CLOSED_FORM_EXACT)) return -1;
+    return degree;
+}
+
+// Sets the variables to their values after the loop if it has the form above, returns
+// false without changing them otherwise. Runs with limits or counts run the loop.
+bool RunLoopClosedForm(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri)
+{
+    if(pri->limits || pri->profile || pri->feedback) return false;
+    ReductionLoop rl;
+    if(!MatchReductionLoop(loop, symbol_table, variables, pri, &rl) || rl.trips<CLOSED_FORM_MIN_TRIPS) return false;
+
+    long long trips=rl.trips;
+    Variable* iv=&variables[rl.i_memloc];
+    long long int_vals[MAX_LOOP_REDUCTIONS];
+    double real_vals[MAX_LOOP_REDUCTIONS];
+    int j, t, k;
+    for(j=0;j<rl.num_reds;j++)
+    {
+        const LoopReduction* red=&rl.reds[j];
+        const Variable* v=&variables[red->memloc];
+        bool is_int=red->type==INTEGER;
+
+        // i as this statement sees it in the first and the last iteration
+        long long first=rl.i0+red->i_offset*rl.step, last=first+(trips-1)*rl.step;
+        Interval i_range={(double)(first<last ? first : last), (double)(first<last ? last : first)};
+        Interval q={0, 0}; // of the change in one iteration
+        double q_abs=0; // bounds the partial changes as well
+        int degree=0;
+        for(t=0;t<red->num_terms;t++)
+        {
+            Interval r;
+            int d=TermDegree(red->terms[t], &rl, i_range, is_int, symbol_table, variables, &r);
+            if(d<0) return false;
+            if(d>degree) degree=d;
+            if(red->negate[t]) {q.lo-=r.hi; q.hi-=r.lo;}
+            else {q.lo+=r.lo; q.hi+=r.hi;}
+            q_abs+=fabs(r.lo)>fabs(r.hi) ? fabs(r.lo) : fabs(r.hi);
+        }
+        if(!(q_abs<CLOSED_FORM_EXACT)) return false;
+
+        // the first degree+1 changes, with i set as in those iterations
+        double p[MAX_CLOSED_DEGREE+1];
+        int saved_i=iv->int_val;
+        for(k=0;k<=degree;k++)
+        {
+            iv->int_val=(int)(first+k*rl.step);
+            p[k]=red->oper==TIMES ? 1 : 0;
+            for(t=0;t<red->num_terms;t++)
+            {
+                double x=EvaluateReal(red->terms[t], symbol_table, variables, pri);
+                if(red->oper==TIMES) p[k]*=x;
+                else p[k]+=red->negate[t] ? -x : x;
+            }
+        }
+        iv->int_val=saved_i;
+
+        if(red->oper==TIMES)
+        {
+            if(degree>0) return false;
+            if(!is_int) {real_vals[j]=v->real_val*pow(p[0], (double)trips); continue;}
+            // a factor of magnitude 2 or more leaves the int range within 32 iterations
+            if(red->num_terms>1) return false;
+            long long acc=v->int_val, f=(long long)p[0];
+            if(f==-1) acc=trips%2 ? -acc : acc;
+            else if(f!=1)
+                for(k=0;k<trips && acc!=0;k++)
+                {
+                    acc*=f;
+                    if(acc<INT_MIN || acc>INT_MAX) return false;
+                }
+            int_vals[j]=acc;
+            continue;
+        }
+
+        int m;
+        if(!is_int)
+        {
+            for(k=1;k<=degree;k++) for(m=degree;m>=k;m--) p[m]-=p[m-1]; // forward differences
+            double sum=0, c=1;
+            for(k=0;k<=degree;k++) {c=c*(trips-k)/(k+1); sum+=c*p[k];}
+            real_vals[j]=v->real_val+sum;
+            continue;
+        }
+        long long d[MAX_CLOSED_DEGREE+1];
+        for(k=0;k<=degree;k++) d[k]=(long long)p[k];
+        for(k=1;k<=degree;k++) for(m=degree;m>=k;m--) d[m]-=d[m-1];
+
+        // every running value stays in range: the running sums move one way if the changes
+        // have one sign, otherwise they are bounded by the largest change
+        double q_max=fabs(q.lo)>fabs(q.hi) ? fabs(q.lo) : fabs(q.hi);
+        if(q.lo<0 && q.hi>0 && fabs((double)v->int_val)+(double)trips*q_max>INT_MAX) return false;
+        __int128 sum=0, c=1;
+        for(k=0;k<=degree;k++)
+        {
+            __int128 term;
+            c=c*(trips-k)/(k+1);
+            if(__builtin_mul_overflow(c, (__int128)d[k], &term) || __builtin_add_overflow(sum, term, &sum)) return false;
+        }
+        sum+=v->int_val;
+        if(sum<INT_MIN || sum>INT_MAX) return false;
+        int_vals[j]=(long long)sum;
+    }
+
+    for(j=0;j<rl.num_reds;j++)
+    {
+        Variable* v=&variables[rl.reds[j].memloc];
+        if(rl.reds[j].type==INTEGER) v->int_val=(int)int_vals[j];
+        else v->real_val=real_vals[j];
+    }
+    iv->int_val=(int)(rl.i0+trips*rl.step);
+    loop->closed_form=true;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Bounds Checks ///////////////////////////////////////////////////////////////////
+
+// An array index i, i + c, c + i, i - c or c - i (c an integer literal) in a repeat loop with
+// the induction variable i is in range in every iteration if it is in range for the
+// first and the last value of i. That is checked once when the loop starts, and then the
+// index isn't checked in the iterations. i must be stepped like in the parallel loops,
+// i := i + c at the top of the body, it must not be assigned or read anywhere else in
+// the loop, and the condition must compare i with an expression of variables the loop
+// doesn't assign, so that the trip count is known before the loop starts.
+
+#define MAX_LOOP_ASSIGNS 256
+
+// Adds the assignments and reads anywhere in the statements, false if there are too many
+bool CollectAssigns(TreeNode* node, TreeNode** assigns, int* num_assigns)
+{
+    for(;node;node=node->sibling)
+    {
+        if(node->node_kind==ASSIGN_NODE || node->node_kind==READ_NODE)
+        {
+            if(*num_assigns==MAX_LOOP_ASSIGNS) return false;
+            assigns[(*num_assigns)++]=node;
+        }
+        else if(node->node_kind==IF_NODE)
+        {
+            if(!CollectAssigns(node->child[1], assigns, num_assigns) || !CollectAssigns(node->child[2], assigns, num_assigns)) return false;
+        }
+        else if(node->node_kind==REPEAT_NODE && !CollectAssigns(node->child[0], assigns, num_assigns)) return false;
+        else if(node->node_kind==LAZY_NODE) return false; // not parsed yet
+    }
+    return true;
+}
+
+// Writes an index of the forms above as sign*i + c, false for another index
+bool IndexForm(const TreeNode* index, const char* i_id, int* sign, long long* c)
+{
+    *sign=1;
+    if(IsIdNode(index, i_id)) {*c=0; return true;}
+    if(index->node_kind!=OPER_NODE || (index->oper!=PLUS && index->oper!=MINUS)) return false;
+    const TreeNode* num=0;
+    if(IsIdNode(index->child[0], i_id)) num=index->child[1];
+    else if(IsIdNode(index->child[1], i_id)) {num=index->child[0]; if(index->oper==MINUS) *sign=-1;}
+    if(!num || num->node_kind!=NUM_NODE || num->expr_data_type!=INTEGER) return false;
+    *c=index->oper==MINUS && *sign==1 ? -(long long)num->num : num->num;
+    return true;
+}
+
+// Marks the array accesses in node and its children whose index stays in range while
+// i goes from first to last
+void MarkInBounds(TreeNode* node, const char* i_id, long long first, long long last, SymbolTable* symbol_table,
+                  const Variable* variables, TreeNode** hoisted, int* num_hoisted)
+{
+    TreeNode* index = node->node_kind==INDEX_NODE || node->node_kind==READ_NODE ? node->child[0] :
+                      node->node_kind==ASSIGN_NODE ? node->child[1] : 0;
+    int sign;
+    long long c;
+    if(index && !node->in_bounds && *num_hoisted<MAX_HOISTED_CHECKS && IndexForm(index, i_id, &sign, &c))
+    {
+        int size=variables[symbol_table->Find(node->id)->memloc].size;
+        long long a=sign*first+c, b=sign*last+c;
+        if(a>=0 && a<size && b>=0 && b<size)
+        {
+            node->in_bounds=true;
+            hoisted[(*num_hoisted)++]=node;
+        }
+    }
+    int i;
+    TreeNode* child;
+    for(i=0;i<MAX_CHILDREN;i++)
+        for(child=node->child[i];child;child=child->sibling) MarkInBounds(child, i_id, first, last, symbol_table, variables, hoisted, num_hoisted);
+}
+
+// The statement i := i + c at the top of the body of the loop, where the condition
+// compares i, and which is the only assignment of i in assigns. 0 if there is none.
+TreeNode* FindInductionStep(TreeNode* loop, TreeNode** assigns, int num_assigns, long long* step)
+{
+    TreeNode* cond=loop->child[1];
+    if(cond->node_kind!=OPER_NODE || (cond->oper!=LESS_THAN && cond->oper!=EQUAL)) return 0;
+
+    TreeNode* stmt;
+    for(stmt=loop->child[0];stmt;stmt=stmt->sibling)
+    {
+        if(stmt->node_kind!=ASSIGN_NODE || stmt->child[1]) continue;
+        if(!IsIdNode(cond->child[0], stmt->id) && !IsIdNode(cond->child[1], stmt->id)) continue;
+        int sign;
+        if(!IndexForm(stmt->child[0], stmt->id, &sign, step) || sign!=1 || *step==0) continue;
+        int i, n=0;
+        for(i=0;i<num_assigns;i++) if(Equals(assigns[i]->id, stmt->id)) n++;
+        if(n==1) return stmt;
+    }
+    return 0;
+}
+
+// Called when the loop starts with the variables as they are then. Marks the accesses
+// that need no check in this run of the loop and returns how many, they are in hoisted.
+int HoistBoundsChecks(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, TreeNode** hoisted)
+{
+    TreeNode* assigns[MAX_LOOP_ASSIGNS];
+    int num_assigns=0;
+    if(!CollectAssigns(loop->child[0], assigns, &num_assigns)) return 0;
+
+    // i := i + c at the top of the body, the only assignment of i
+    TreeNode* cond=loop->child[1];
+    long long step;
+    TreeNode* stmt=FindInductionStep(loop, assigns, num_assigns, &step);
+    if(!stmt) return 0;
+    const char* i_id=stmt->id;
+    const Variable* i_var=&variables[symbol_table->Find(i_id)->memloc];
+    if(i_var->type!=INTEGER || i_var->size) return 0;
+
+    bool i_on_left=IsIdNode(cond->child[0], i_id);
+    TreeNode* bound_expr=cond->child[i_on_left ? 1 : 0];
+    if(ReadsAssigned(bound_expr, assigns, num_assigns, 0) || ReadsArray(bound_expr)) return 0;
+
+    long long i0=i_var->int_val, trips;
+    double bound=EvaluateReal(bound_expr, symbol_table, variables, pri);
+    if(!LoopTrips(cond->oper, i_on_left, bound, i0, step, &trips)) return 0;
+
+    // in iteration k (from 1) i is i0 + (k-1)*step before the step and i0 + k*step after it
+    int num_hoisted=0;
+    bool before=true;
+    TreeNode* cur;
+    for(cur=loop->child[0];cur;cur=cur->sibling)
+    {
+        if(cur==stmt) {before=false; continue;}
+        if(before) MarkInBounds(cur, i_id, i0, i0+(trips-1)*step, symbol_table, variables, hoisted, &num_hoisted);
+        else MarkInBounds(cur, i_id, i0+step, i0+trips*step, symbol_table, variables, hoisted, &num_hoisted);
+    }
+    MarkInBounds(cond, i_id, i0+step, i0+trips*step, symbol_table, variables, hoisted, &num_hoisted);
+    return num_hoisted;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Cost Model //////////////////////////////////////////////////////////////////////
+
+// -cost estimates what a run of the program costs without running it, for a scheduler
+// that places and orders jobs. Each node has a weight, about its time relative to an add,
+// and a statement costs the weights of the nodes it runs. The scalars are followed through
+// the program as ranges of values, all 0 at the start, so an if with a known condition
+// counts only its branch and a repeat loop with an induction variable, as the bounds checks
+// find it, gets its trip count from the ranges of i and of the bound when it starts. The
+// count moves monotonically with each, so the fewest and the most trips are at the corners.
+// A loop whose condition reads nothing it assigns runs once or never ends. The variables a
+// loop assigns are unknown in its body, except the induction variable, and after it.
+//
+// The program is constant if it runs no loop, bounded if every loop it runs has a trip
+// count, unbounded if it runs a loop that never ends unless a runtime error stops it, and
+// unknown otherwise, which includes every loop that depends on read values.
+
+enum CostClass {COST_CONSTANT, COST_BOUNDED, COST_UNKNOWN, COST_UNBOUNDED}; // a program has the last of its statements
+
+const char* CostClassStr[]={"constant", "bounded", "unknown", "unbounded"};
+
+// Values a scalar can have at some point of the program
+struct ValueRange
+{
+    bool known;
+    double lo, hi;
+};
+
+struct CostRange
+{
+    double lo, hi; // hi is HUGE_VAL if not bounded
+    CostClass cost_class;
+};
+
+struct LoopCost
+{
+    int line_num;
+    CostClass cost_class;
+    long long min_trips, max_trips; // of each run of the loop, max_trips is -1 if not bounded
+    double iteration_cost; // the most one iteration costs
+};
+
+struct StmtCost // top level statement
+{
+    int line_num;
+    NodeKind node_kind;
+    CostRange cost;
+};
+
+struct CostEstimate
+{
+    CostRange cost; // of the whole program
+    LoopCost* loops; // in source order
+    int num_loops, loops_capacity;
+    StmtCost* stmts;
+    int num_stmts, stmts_capacity;
+
+    CostEstimate() {loops=0; num_loops=loops_capacity=0; stmts=0; num_stmts=stmts_capacity=0;}
+    ~CostEstimate() {delete[] loops; delete[] stmts;}
+
+    LoopCost* NewLoop()
+    {
+        if(num_loops==loops_capacity)
+        {
+            int new_capacity=loops_capacity ? 2*loops_capacity : 16;
+            LoopCost* new_loops=new LoopCost[new_capacity];
+            if(num_loops) memcpy(new_loops, loops, num_loops*sizeof(LoopCost));
+            delete[] loops;
+            loops=new_loops; loops_capacity=new_capacity;
+        }
+        return &loops[num_loops++];
+    }
+
+    StmtCost* NewStmt()
+    {
+        if(num_stmts==stmts_capacity)
+        {
+            int new_capacity=stmts_capacity ? 2*stmts_capacity : 16;
+            StmtCost* new_stmts=new StmtCost[new_capacity];
+            if(num_stmts) memcpy(new_stmts, stmts, num_stmts*sizeof(StmtCost));
+            delete[] stmts;
+            stmts=new_stmts; stmts_capacity=new_capacity;
+        }
+        return &stmts[num_stmts++];
+    }
+
+    void Print();
+    void PrintJson(FILE* file);
+};
+
+// Time of the node itself, relative to an add
+double CostWeight(const TreeNode* node)
+{
+    switch(node->node_kind)
+    {
+        case READ_NODE: case WRITE_NODE: return 100;
+        case INDEX_NODE: return 3;
+        case DECLARE_NODE: return 0;
+        case OPER_NODE: return node->oper==POWER ? 40 : node->oper==DIVIDE ? 8 : node->oper==TIMES ? 2 : 1;
+        default: return 1;
+    }
+}
+
+double ExprCost(const TreeNode* node)
+{
+    if(!node) return 0;
+    return CostWeight(node)+ExprCost(node->child[0])+(node->node_kind==OPER_NODE ? ExprCost(node->child[1]) : 0);
+}
+
+ValueRange MakeRange(double lo, double hi)
+{
+    ValueRange r;
+    r.known=(lo>-HUGE_VAL && hi<HUGE_VAL); // false for NaN too
+    r.lo=lo; r.hi=hi;
+    return r;
+}
+
+ValueRange UnknownRange() {return MakeRange(-HUGE_VAL, HUGE_VAL);}
+
+// Range of a*b from the corners
+ValueRange TimesRange(ValueRange a, ValueRange b)
+{
+    double c[4]={a.lo*b.lo, a.lo*b.hi, a.hi*b.lo, a.hi*b.hi};
+    return MakeRange(min(min(c[0], c[1]), min(c[2], c[3])), max(max(c[0], c[1]), max(c[2], c[3])));
+}
+
+ValueRange SquareRange(ValueRange a)
+{
+    if(a.lo>=0) return MakeRange(a.lo*a.lo, a.hi*a.hi);
+    if(a.hi<=0) return MakeRange(a.hi*a.hi, a.lo*a.lo);
+    return MakeRange(0, max(a.lo*a.lo, a.hi*a.hi));
+}
+
+// Values the expression can have with the scalars in env, as ApplyOper computes them
+ValueRange EvalRange(const TreeNode* node, const ValueRange* env, SymbolTable* symbol_table)
+{
+    if(node->node_kind==NUM_NODE)
+    {
+        double v=node->expr_data_type==REAL ? node->real_num : node->num;
+        return MakeRange(v, v);
+    }
+    if(node->node_kind==ID_NODE)
+    {
+        const VariableInfo* var=symbol_table->Find(node->id);
+        return var->size ? UnknownRange() : env[var->memloc];
+    }
+    if(node->node_kind!=OPER_NODE) return UnknownRange(); // array element
+
+    ValueRange a=EvalRange(node->child[0], env, symbol_table);
+    ValueRange b=EvalRange(node->child[1], env, symbol_table);
+    if(node->oper==EQUAL || node->oper==LESS_THAN)
+    {
+        bool is_true, is_false;
+        if(!a.known || !b.known) is_true=is_false=false;
+        else if(node->oper==EQUAL) {is_true=(a.lo==a.hi && b.lo==b.hi && a.lo==b.lo); is_false=(a.hi<b.lo || b.hi<a.lo);}
+        else {is_true=(a.hi<b.lo); is_false=(a.lo>=b.hi);}
+        return MakeRange(is_true ? 1 : 0, is_false ? 0 : 1);
+    }
+    if(!a.known || !b.known) return UnknownRange();
+    switch(node->oper)
+    {
+        case PLUS: return MakeRange(a.lo+b.lo, a.hi+b.hi);
+        case MINUS: return MakeRange(a.lo-b.hi, a.hi-b.lo);
+        case TIMES: return TimesRange(a, b);
+        case DIVIDE:
+            if(b.lo>0 || b.hi<0) return TimesRange(a, MakeRange(1/b.hi, 1/b.lo));
+            return UnknownRange();
+        case POWER:
+            if(a.lo==a.hi && b.lo==b.hi) return MakeRange(pow(a.lo, b.lo), pow(a.lo, b.lo));
+            return UnknownRange();
+        case AND_OPER:
+        {
+            ValueRange sa=SquareRange(a), sb=SquareRange(b);
+            return MakeRange(sa.lo-sb.hi, sa.hi-sb.lo);
+        }
+        default: return UnknownRange();
+    }
+}
+
+struct CostInfo
+{
+    SymbolTable* symbol_table;
+    CostEstimate* estimate;
+};
+
+// Sets the range of a scalar assigned values in r, converted like RunProgram does
+void AssignRange(ValueRange* env, const VariableInfo* var, ValueRange r)
+{
+    if(var->size) return;
+    if(r.known && var->var_type==INTEGER)
+        r=(r.lo>INT_MIN-1.0 && r.hi<INT_MAX+1.0) ? MakeRange(trunc(r.lo), trunc(r.hi)) : UnknownRange();
+    else if(var->var_type==BOOLEAN)
+        r=r.known && (r.lo>0 || r.hi<0) ? MakeRange(1, 1) : r.known && r.lo==0 && r.hi==0 ? MakeRange(0, 0) : MakeRange(0, 1);
+    env[var->memloc]=r;
+}
+
+// The scalars assigned or read by the statements become unknown
+void ForgetAssigned(TreeNode** assigns, int num_assigns, ValueRange* env, SymbolTable* symbol_table)
+{
+    int i;
+    for(i=0;i<num_assigns;i++)
+    {
+        const VariableInfo* var=symbol_table->Find(assigns[i]->id);
+        if(!var->size) env[var->memloc]=UnknownRange();
+    }
+}
+
+void ForgetAll(ValueRange* env, SymbolTable* symbol_table)
+{
+    int i;
+    for(i=0;i<symbol_table->num_vars;i++) env[i]=UnknownRange();
+}
+
+CostRange StmtsCost(TreeNode* node, ValueRange* env, CostInfo* ci, bool top_level=false);
+
+// Trip count range of the loop from the variables when it starts, fills the range of the
+// induction variable at the top of the body and after the loop if there is one, *i_memloc is -1 if not
+CostClass LoopTripRange(TreeNode* loop, TreeNode** assigns, int num_assigns, const ValueRange* env, CostInfo* ci,
+                        long long* min_trips, long long* max_trips, int* i_memloc, ValueRange* i_body, ValueRange* i_exit)
+{
+    SymbolTable* symbol_table=ci->symbol_table;
+    TreeNode* cond=loop->child[1];
+    *i_memloc=-1;
+
+    long long step;
+    TreeNode* stmt=FindInductionStep(loop, assigns, num_assigns, &step);
+    const VariableInfo* i_var=stmt ? symbol_table->Find(stmt->id) : 0;
+    if(i_var && i_var->var_type==INTEGER && !i_var->size)
+    {
+        bool i_on_left=IsIdNode(cond->child[0], stmt->id);
+        TreeNode* bound_expr=cond->child[i_on_left ? 1 : 0];
+        if(ReadsAssigned(bound_expr, assigns, num_assigns, 0) || ReadsArray(bound_expr)) return COST_UNKNOWN;
+        ValueRange i0=env[i_var->memloc], bound=EvalRange(bound_expr, env, symbol_table);
+        if(!i0.known || !bound.known || (cond->oper==EQUAL && (i0.lo!=i0.hi || bound.lo!=bound.hi))) return COST_UNKNOWN;
+
+        int a, b, num_ends=0;
+        double first=0, last=0;
+        for(a=0;a<2;a++) for(b=0;b<2;b++)
+        {
+            long long start=(long long)(a ? i0.hi : i0.lo), trips;
+            if(!LoopTrips(cond->oper, i_on_left, b ? bound.hi : bound.lo, start, step, &trips)) continue;
+            double end=(double)(start+trips*step);
+            if(num_ends==0) {*min_trips=*max_trips=trips; first=last=end;}
+            *min_trips=min(*min_trips, trips); *max_trips=max(*max_trips, trips);
+            first=min(first, end); last=max(last, end);
+            num_ends++;
+        }
+        if(num_ends==0) return COST_UNBOUNDED;
+        if(num_ends<4) return COST_UNKNOWN;
+        *i_memloc=i_var->memloc;
+        *i_body=MakeRange(min(i0.lo, first-step), max(i0.hi, last-step)); // before the step
+        *i_exit=MakeRange(first, last);
+        return COST_BOUNDED;
+    }
+
+    if(ReadsAssigned(cond, assigns, num_assigns, 0) || ReadsArray(cond)) return COST_UNKNOWN;
+    ValueRange c=EvalRange(cond, env, symbol_table);
+    if(c.known && (c.lo>0 || c.hi<0)) {*min_trips=*max_trips=1; return COST_BOUNDED;}
+    if(c.known && c.lo==0 && c.hi==0) return COST_UNBOUNDED;
+    return COST_UNKNOWN;
+}
+
+CostRange RepeatCost(TreeNode* loop, ValueRange* env, CostInfo* ci)
+{
+    SymbolTable* symbol_table=ci->symbol_table;
+    int index=ci->estimate->num_loops;
+    ci->estimate->NewLoop();
+
+    TreeNode* assigns[MAX_LOOP_ASSIGNS];
+    int num_assigns=0;
+    long long min_trips=1, max_trips=-1;
+    int i_memloc=-1;
+    ValueRange i_body, i_exit;
+    CostClass trips_class=COST_UNKNOWN;
+    bool all_assigns=CollectAssigns(loop->child[0], assigns, &num_assigns);
+    if(all_assigns)
+    {
+        trips_class=LoopTripRange(loop, assigns, num_assigns, env, ci, &min_trips, &max_trips, &i_memloc, &i_body, &i_exit);
+        ForgetAssigned(assigns, num_assigns, env, symbol_table);
+    }
+    else ForgetAll(env, symbol_table);
+    if(i_memloc>=0) env[i_memloc]=i_body;
+
+    CostRange body=StmtsCost(loop->child[0], env, ci);
+    double cond_cost=ExprCost(loop->child[1])+CostWeight(loop);
+
+    if(all_assigns) ForgetAssigned(assigns, num_assigns, env, symbol_table);
+    else ForgetAll(env, symbol_table);
+    if(i_memloc>=0) env[i_memloc]=i_exit;
+
+    CostRange r;
+    r.cost_class=max(trips_class, body.cost_class);
+    if(trips_class==COST_BOUNDED) {r.lo=min_trips*(body.lo+cond_cost); r.hi=max_trips*(body.hi+cond_cost);}
+    else if(trips_class==COST_UNKNOWN) {r.lo=body.lo+cond_cost; r.hi=HUGE_VAL; min_trips=1; max_trips=-1;}
+    else {r.lo=r.hi=HUGE_VAL; min_trips=1; max_trips=-1;} // a body that is reached runs at least once
+
+    LoopCost* lc=&ci->estimate->loops[index];
+    lc->line_num=loop->line_num;
+    lc->cost_class=r.cost_class;
+    lc->min_trips=min_trips;
+    lc->max_trips=max_trips;
+    lc->iteration_cost=body.hi+cond_cost;
+    return r;
+}
+
+CostRange IfCost(TreeNode* node, ValueRange* env, CostInfo* ci)
+{
+    double cond_cost=ExprCost(node->child[0])+CostWeight(node);
+    ValueRange c=EvalRange(node->child[0], env, ci->symbol_table);
+    CostRange r;
+    if(c.known && (c.lo>0 || c.hi<0)) r=StmtsCost(node->child[1], env, ci);
+    else if(c.known && c.lo==0 && c.hi==0) r=StmtsCost(node->child[2], env, ci);
+    else
+    {
+        // each branch from the same ranges, then the ranges of both
+        int n=ci->symbol_table->num_vars;
+        ValueRange* else_env=new ValueRange[n];
+        memcpy(else_env, env, n*sizeof(ValueRange));
+        CostRange a=StmtsCost(node->child[1], env, ci);
+        CostRange b=StmtsCost(node->child[2], else_env, ci);
+        int i;
+        for(i=0;i<n;i++)
+        {
+            if(!env[i].known || !else_env[i].known) env[i]=UnknownRange();
+            else env[i]=MakeRange(min(env[i].lo, else_env[i].lo), max(env[i].hi, else_env[i].hi));
+        }
+        delete[] else_env;
+
+        // a loop that never ends in one branch may not be reached
+        r.lo=min(a.lo, b.lo); r.hi=max(a.hi, b.hi);
+        r.cost_class=max(a.cost_class, b.cost_class);
+        if(r.cost_class==COST_UNBOUNDED && min(a.cost_class, b.cost_class)!=COST_UNBOUNDED) r.cost_class=COST_UNKNOWN;
+    }
+    r.lo+=cond_cost; r.hi+=cond_cost;
+    return r;
+}
+
+// Cost of the statements from node on, run with the scalars in env, which is updated
+CostRange StmtsCost(TreeNode* node, ValueRange* env, CostInfo* ci, bool top_level)
+{
+    CostRange sum;
+    sum.lo=sum.hi=0;
+    sum.cost_class=COST_CONSTANT;
+    for(;node;node=node->sibling)
+    {
+        SymbolTable* symbol_table=ci->symbol_table;
+        CostRange r;
+        r.cost_class=COST_CONSTANT;
+        r.lo=r.hi=0;
+        if(node->node_kind==IF_NODE) r=IfCost(node, env, ci);
+        else if(node->node_kind==REPEAT_NODE) r=RepeatCost(node, env, ci);
+        else if(node->node_kind!=DECLARE_NODE)
+        {
+            r.lo=r.hi=ExprCost(node->child[0])+CostWeight(node)+(node->node_kind==ASSIGN_NODE ? ExprCost(node->child[1]) : 0);
+            if(node->node_kind==ASSIGN_NODE && !node->child[1])
+                AssignRange(env, symbol_table->Find(node->id), EvalRange(node->child[0], env, symbol_table));
+            else if(node->node_kind==READ_NODE && !node->child[0])
+                AssignRange(env, symbol_table->Find(node->id), UnknownRange());
+        }
+
+        if(top_level && node->node_kind!=DECLARE_NODE)
+        {
+            StmtCost* sc=ci->estimate->NewStmt();
+            sc->line_num=node->line_num;
+            sc->node_kind=node->node_kind;
+            sc->cost=r;
+        }
+        sum.lo+=r.lo; sum.hi+=r.hi;
+        sum.cost_class=max(sum.cost_class, r.cost_class);
+    }
+    return sum;
+}
+
+// Fills the estimate for the analyzed program
+void EstimateCost(TreeNode* syntax_tree, SymbolTable* symbol_table, CostEstimate* estimate)
+{
+    ValueRange* env=new ValueRange[symbol_table->num_vars];
+    int i;
+    for(i=0;i<symbol_table->num_vars;i++)
+        env[i]=symbol_table->vars[i].var_type==REAL || symbol_table->vars[i].var_type==INTEGER || symbol_table->vars[i].var_type==BOOLEAN ?
+               MakeRange(0, 0) : UnknownRange();
+    CostInfo ci;
+    ci.symbol_table=symbol_table;
+    ci.estimate=estimate;
+    estimate->num_loops=estimate->num_stmts=0;
+    estimate->cost=StmtsCost(syntax_tree, env, &ci, true);
+    delete[] env;
+}
+
+void PrintCostNumber(FILE* file, double v)
+{
+    if(v<HUGE_VAL) fprintf(file, "%.15g", v);
+    else fprintf(file, "null");
+}
+
+void CostEstimate::Print()
+{
+    printf("%s", CostClassStr[cost.cost_class]);
+    if(cost.hi<HUGE_VAL) printf(", cost %.6g", cost.hi);
+    if(cost.lo<HUGE_VAL) printf(", at least %.6g", cost.lo);
+    printf(", %d loop(s)\n", num_loops);
+    int i;
+    for(i=0;i<num_loops;i++)
+    {
+        const LoopCost* lc=&loops[i];
+        printf("  repeat at line %d: %s", lc->line_num, CostClassStr[lc->cost_class]);
+        if(lc->max_trips>=0) printf(", %lld to %lld trips", lc->min_trips, lc->max_trips);
+        printf(", %.6g per iteration\n", lc->iteration_cost);
+    }
+}
+
+// One JSON object with the class and cost of the program, its loops and its statements.
+// cost and max_trips are null if not bounded.
+void CostEstimate::PrintJson(FILE* file)
+{
+    int i;
+    fprintf(file, "{\"class\":\"%s\",\"cost\":", CostClassStr[cost.cost_class]);
+    PrintCostNumber(file, cost.hi);
+    fprintf(file, ",\"min_cost\":");
+    PrintCostNumber(file, cost.lo);
+    fprintf(file, ",\"loops\":[");
+    for(i=0;i<num_loops;i++)
+    {
+        const LoopCost* lc=&loops[i];
+        fprintf(file, "%s{\"line\":%d,\"class\":\"%s\",\"min_trips\":%lld,\"max_trips\":", i ? "," : "",
+                lc->line_num, CostClassStr[lc->cost_class], lc->min_trips);
+        if(lc->max_trips>=0) fprintf(file, "%lld", lc->max_trips);
+        else fprintf(file, "null");
+        fprintf(file, ",\"iteration_cost\":");
+        PrintCostNumber(file, lc->iteration_cost);
+        fprintf(file, "}");
+    }
+    fprintf(file, "],\"stmts\":[");
+    for(i=0;i<num_stmts;i++)
+    {
+        const StmtCost* sc=&stmts[i];
+        fprintf(file, "%s{\"line\":%d,\"kind\":\"%s\",\"class\":\"%s\",\"cost\":", i ? "," : "",
+                sc->line_num, NodeKindStr[sc->node_kind], CostClassStr[sc->cost.cost_class]);
+        PrintCostNumber(file, sc->cost.hi);
+        fprintf(file, ",\"min_cost\":");
+        PrintCostNumber(file, sc->cost.lo);
+        fprintf(file, "}");
+    }
+    fprintf(file, "]}\n");
+    fflush(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Partial Evaluation //////////////////////////////////////////////////////////////
+
+// -specialize runs the program over the syntax tree with the values of its first read
+// statements known, and writes a residual program that does only the work depending on
+// the rest of the input. Known variables are replaced by literals, known expressions
+// are folded, an if with a known condition keeps only the branch taken, and a repeat
+// loop whose condition is known after every iteration is unrolled, or run away entirely
+// when its body leaves no code. The residual program reads the remaining values in the
+// same order and writes the same output.
+//
+// Before an if or loop with an unknown condition, the known variables it assigns are
+// written out as assignments and become unknown, and so are the ones assigned a known
+// value at the end of each branch and loop body, so that the residual code has the
+// right values on every path. Known values are only read outside of such statements,
+// and the first read left in the residual program ends them.
+
+const int PE_MAX_UNROLL_ITERATIONS=64; // of a loop whose iterations leave code
+const int PE_MAX_UNROLL_BYTES=1<<14; // of residual code from one unrolled loop
+const long long PE_MAX_STEPS=10000000; // statements run while specializing
+
+struct PeVar
+{
+    bool known;
+    Variable value;
+};
+
+struct PartialEval
+{
+    SymbolTable* symbol_table;
+    PeVar* vars; // by memloc
+    const char** names; // by memloc
+    OutBuffer out; // the statements of the residual program
+    RunInfo run_info; // reads the known values with ReadValue
+    InputSource known_values;
+    bool inputs_done; // a read was left in the residual program, the ones after it must be too
+    int dynamic_depth; // ifs and loops with unknown conditions around the statement
+    int indent;
+    int num_in_seq; // statements written to the current statement list
+    long long steps;
+};
+
+double PeValue(const Variable* v)
+{
+    if(v->type==REAL) return v->real_val;
+    if(v->type==INTEGER) return (double)v->int_val;
+    if(v->type==BOOLEAN) return v->bool_val ? 1.0 : 0.0;
+    return 0.0;
+}
+
+// Stores an expression value the way an assignment does
+void PeAssign(Variable* v, double x)
+{
+    if(v->type==REAL) v->real_val=x;
+    else if(v->type==INTEGER) v->int_val=(int)x;
+    else if(v->type==BOOLEAN) v->bool_val=(x!=0.0);
+}
+
+// Writes source text of the given type that evaluates to exactly v, returns false if
+// there is none (a whole real needs a fraction, there are no negative literals and no
+// exponents, and a number is at most MAX_TOKEN_LEN characters)
+bool FormatLiteral(ExprDataType type, double v, char* str)
+{
+    if(type==BOOLEAN) {Copy(str, v!=0.0 ? "0 = 0" : "0 < 0"); return true;}
+    if(type==INTEGER)
+    {
+        if(v!=floor(v) || v<INT_MIN || v>INT_MAX) return false;
+        if(v==INT_MIN) Copy(str, "(0 - 2147483647 - 1)");
+        else if(v<0) sprintf(str, "(0 - %d)", -(int)v);
+        else sprintf(str, "%d", (int)v);
+        return true;
+    }
+    if(type!=REAL || !isfinite(v) || (v==0.0 && signbit(v))) return false;
+
+    char num[64];
+    int precision;
+    for(precision=1;;precision++)
+    {
+        int n=snprintf(num, sizeof(num), "%.*f", precision, fabs(v));
+        if(n>MAX_TOKEN_LEN) return false;
+        if(atof(num)==fabs(v)) break;
+    }
+    if(v<0) sprintf(str, "(0 - %s)", num);
+    else Copy(str, num);
+    return true;
+}
+
+// Writes the expression with the known values substituted and the known parts folded.
+// Returns true with *v set if its value is known.
+bool PeExpr(PartialEval* pe, TreeNode* node, double* v)
+{
+    int start=pe->out.size;
+    if(node->node_kind==NUM_NODE) *v=node->expr_data_type==REAL ? node->real_num : (double)node->num;
+    else if(node->node_kind==ID_NODE)
+    {
+        PeVar* var=&pe->vars[pe->symbol_table->Find(node->id)->memloc];
+        if(!var->known) {pe->out.Append(node->id, strlen(node->id)); return false;}
+        *v=PeValue(&var->value);
+    }
+    else
+    {
+        // comparisons are only at the top of an expression, the rest is fully parenthesized
+        bool compare=node->oper==EQUAL || node->oper==LESS_THAN;
+        double a, b;
+        if(!compare) pe->out.Append("(", 1);
+        bool known_a=PeExpr(pe, node->child[0], &a);
+        pe->out.Print(" %s ", TokenTypeSpelling(node->oper));
+        bool known_b=PeExpr(pe, node->child[1], &b);
+        if(!compare) pe->out.Append(")", 1);
+        if(!known_a || !known_b) return false;
+        *v=ApplyOper(node->oper, a, b);
+    }
+
+    // else a known operator stays written out, e.g. 7 / 2 of type int
+    char literal[80];
+    if(FormatLiteral(node->expr_data_type, *v, literal))
+    {
+        pe->out.size=start;
+        pe->out.Append(literal, strlen(literal));
+    }
+    return true;
+}
+
+void PeBeginStmt(PartialEval* pe)
+{
+    if(pe->num_in_seq++>0) pe->out.Append(";\n", 2);
+    int i;
+    for(i=0;i<pe->indent;i++) pe->out.Append("  ", 2);
+}
+
+// Marks the variables assigned or read by the statements
+bool PeAssigned(PartialEval* pe, TreeNode* node, bool* assigned)
+{
+    bool has_read=false;
+    for(;node;node=node->sibling)
+    {
+        if(node->node_kind==ASSIGN_NODE || node->node_kind==READ_NODE) assigned[pe->symbol_table->Find(node->id)->memloc]=true;
+        if(node->node_kind==READ_NODE) has_read=true;
+        int i;
+        for(i=0;i<MAX_CHILDREN;i++) if(node->child[i] && PeAssigned(pe, node->child[i], assigned)) has_read=true;
+    }
+    return has_read;
+}
+
+// Writes assignments of the known values of the given variables, which become unknown
+void PeLift(PartialEval* pe, const bool* assigned)
+{
+    int i;
+    for(i=0;i<pe->symbol_table->num_vars;i++)
+    {
+        if(!assigned[i] || !pe->vars[i].known) continue;
+        char literal[80];
+        FormatLiteral(pe->vars[i].value.type, PeValue(&pe->vars[i].value), literal);
+        PeBeginStmt(pe);
+        pe->out.Print("%s := %s", pe->names[i], literal);
+        pe->vars[i].known=false;
+    }
+}
+
+void PeStmts(PartialEval* pe, TreeNode* node);
+
+// Writes a branch or loop body run with an unknown condition, as a statement list of its own
+void PeBranch(PartialEval* pe, TreeNode* node, const bool* assigned)
+{
+    int saved=pe->num_in_seq;
+    pe->num_in_seq=0;
+    pe->indent++;
+    PeStmts(pe, node);
+    PeLift(pe, assigned);
+    if(pe->num_in_seq==0) {PeBeginStmt(pe); pe->out.Print("%s := %s", pe->names[0], pe->names[0]);} // a list can't be empty
+    pe->indent--;
+    pe->num_in_seq=saved;
+}
+
+void PeNewLine(PartialEval* pe, const char* str)
+{
+    pe->out.Append("\n", 1);
+    int i;
+    for(i=0;i<pe->indent;i++) pe->out.Append("  ", 2);
+    pe->out.Append(str, strlen(str));
+}
+
+// Runs the loop at specialization time, keeping the code its iterations leave. Returns
+// false, with everything as it was, if its condition is unknown after an iteration or
+// the unrolled code gets too long.
+bool PeUnroll(PartialEval* pe, TreeNode* node)
+{
+    if(pe->steps>PE_MAX_STEPS) return false;
+    int num_vars=pe->symbol_table->num_vars;
+    int start=pe->out.size, saved_in_seq=pe->num_in_seq;
+    PeVar* saved_vars=new PeVar[num_vars];
+    memcpy(saved_vars, pe->vars, num_vars*sizeof(PeVar));
+    const char* saved_input=pe->known_values.cur;
+    int saved_num_values=pe->known_values.num_values;
+    bool saved_inputs_done=pe->inputs_done;
+
+    int iterations=0;
+    bool ok=true;
+    while(true)
+    {
+        PeStmts(pe, node->child[0]);
+        iterations++;
+        int end=pe->out.size;
+        double cond;
+        ok=PeExpr(pe, node->child[1], &cond);
+        pe->out.size=end;
+        if(end>start && iterations>PE_MAX_UNROLL_ITERATIONS) ok=false;
+        if(end-start>PE_MAX_UNROLL_BYTES || pe->steps>PE_MAX_STEPS) ok=false;
+        if(!ok || cond!=0.0) break;
+    }
+
+    if(!ok)
+    {
+        pe->out.size=start;
+        pe->num_in_seq=saved_in_seq;
+        memcpy(pe->vars, saved_vars, num_vars*sizeof(PeVar));
+        pe->known_values.cur=saved_input;
+        pe->known_values.num_values=saved_num_values;
+        pe->inputs_done=saved_inputs_done;
+    }
+    delete[] saved_vars;
+    return ok;
+}
+
+void PeStmt(PartialEval* pe, TreeNode* node)
+{
+    pe->steps++;
+    if(node->node_kind==ASSIGN_NODE)
+    {
+        PeVar* var=&pe->vars[pe->symbol_table->Find(node->id)->memloc];
+        int start=pe->out.size, saved_in_seq=pe->num_in_seq;
+        PeBeginStmt(pe);
+        pe->out.Print("%s := ", node->id);
+        double v;
+        bool known=PeExpr(pe, node->child[0], &v);
+        var->known=false;
+        if(known)
+        {
+            Variable value=var->value;
+            PeAssign(&value, v);
+            char literal[80];
+            if(FormatLiteral(value.type, PeValue(&value), literal))
+            {
+                pe->out.size=start;
+                pe->num_in_seq=saved_in_seq;
+                var->value=value;
+                var->known=true;
+            }
+        }
+    }
+    else if(node->node_kind==READ_NODE)
+    {
+        PeVar* var=&pe->vars[pe->symbol_table->Find(node->id)->memloc];
+        const char* s; const char* e;
+        InputSource* in=&pe->known_values;
+        const char* cur=in->cur;
+        int num_values=in->num_values;
+        if(!pe->inputs_done && pe->dynamic_depth==0 && in->NextField(&s, &e))
+        {
+            in->cur=cur; in->num_values=num_values;
+            ReadValue(&pe->run_info, node->id, node->line_num, &var->value);
+            char literal[80];
+            if(!FormatLiteral(var->value.type, PeValue(&var->value), literal))
+            {
+                printf("ERROR: Can't write the value read into '%s' at line %d as a literal\n", node->id, node->line_num);
+                throw "Terminate Program!";
+            }
+            var->known=true;
+            return;
+        }
+        pe->inputs_done=true;
+        PeBeginStmt(pe);
+        pe->out.Print("read %s", node->id);
+        var->known=false;
+    }
+    else if(node->node_kind==WRITE_NODE)
+    {
+        PeBeginStmt(pe);
+        pe->out.Append("write ", 6);
+        double v;
+        PeExpr(pe, node->child[0], &v);
+    }
+    else if(node->node_kind==IF_NODE || node->node_kind==REPEAT_NODE)
+    {
+        TreeNode* cond=node->child[node->node_kind==IF_NODE ? 0 : 1];
+        int start=pe->out.size;
+        double v;
+        bool known=PeExpr(pe, cond, &v);
+        pe->out.size=start;
+        if(node->node_kind==IF_NODE && known) {PeStmts(pe, v!=0.0 ? node->child[1] : node->child[2]); return;}
+        if(node->node_kind==REPEAT_NODE && PeUnroll(pe, node)) return;
+
+        bool* assigned=new bool[pe->symbol_table->num_vars]();
+        int i;
+        for(i=0;i<MAX_CHILDREN;i++) if(PeAssigned(pe, node->child[i], assigned)) pe->inputs_done=true;
+        PeLift(pe, assigned);
+        PeBeginStmt(pe);
+        pe->dynamic_depth++;
+        if(node->node_kind==IF_NODE)
+        {
+            pe->out.Append("if ", 3);
+            PeExpr(pe, cond, &v);
+            pe->out.Append(" then\n", 6);
+            PeBranch(pe, node->child[1], assigned);
+            if(node->child[2])
+            {
+                PeNewLine(pe, "else\n");
+                PeBranch(pe, node->child[2], assigned);
+            }
+            PeNewLine(pe, "end");
+        }
+        else
+        {
+            pe->out.Append("repeat\n", 7);
+            PeBranch(pe, node->child[0], assigned);
+            PeNewLine(pe, "until ");
+            PeExpr(pe, cond, &v);
+        }
+        pe->dynamic_depth--;
+        delete[] assigned;
+    }
+}
+
+void PeStmts(PartialEval* pe, TreeNode* node)
+{
+    for(;node;node=node->sibling) if(node->node_kind!=DECLARE_NODE) PeStmt(pe, node);
+}
+
+// Writes the residual program of the analyzed tree to file, with the values read from
+// values_str known
+void Specialize(TreeNode* syntax_tree, SymbolTable* symbol_table, const char* values_str, FILE* file)
+{
+    PartialEval pe;
+    if(!pe.known_values.Open(values_str)) {printf("ERROR: Can't open input '%s'\n", values_str); throw "Terminate Program!";}
+    pe.run_info.input=&pe.known_values;
+    pe.symbol_table=symbol_table;
+    pe.inputs_done=false; pe.dynamic_depth=0; pe.indent=0; pe.num_in_seq=0; pe.steps=0;
+
+    // variables start known, as 0
+    int num_vars=symbol_table->num_vars;
+    Variable* values=new Variable[num_vars];
+    InitVariables(symbol_table, values);
+    pe.vars=new PeVar[num_vars];
+    pe.names=new const char*[num_vars];
+    int i;
+    for(i=0;i<num_vars;i++)
+    {
+        pe.vars[i].known=true;
+        pe.vars[i].value=values[i];
+        pe.names[symbol_table->vars[i].memloc]=symbol_table->vars[i].name;
+    }
+    delete[] values;
+
+    PeStmts(&pe, syntax_tree);
+    if(pe.num_in_seq==0 && num_vars>0) {PeBeginStmt(&pe); pe.out.Print("%s := %s", pe.names[0], pe.names[0]);}
+
+    fprintf(file, "{ Residual program, %d input values known }\n", pe.known_values.num_values);
+    for(i=0;i<num_vars;i++)
+    {
+        const VariableInfo* var=&symbol_table->vars[i];
+        const char* type=var->var_type==REAL ? "real" : var->var_type==BOOLEAN ? "bool" : "int";
+        fprintf(file, "%s %s;\n", type, var->name);
+    }
+    fwrite(pe.out.buf, 1, pe.out.size, file);
+    fprintf(file, "\n");
+
+    delete[] pe.vars;
+    delete[] pe.names;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Flat Tree ///////////////////////////////////////////////////////////////////////
+
+// The analyzed syntax tree stored in parallel arrays indexed by 32 bit node numbers,
+// in pre-order, so a walk over the whole tree is a linear scan. A node's children
+// are linked by next_sibling from first_child. Statement lists are SEQ_NODEs, so
+// an if node has the children cond, then and optional else, and a repeat node has
+// body and cond. Identifiers are resolved to memlocs. Node 0 is not used, it means none.
+// With a profile the else branch of an if that mostly takes it is laid out before the
+// then branch, next to the condition, the links stay in the same order.
+const unsigned int FLAT_NONE=0;
+
+struct FlatTree
+{
+    int num_nodes, capacity;
+    unsigned char* kind; // NodeKind
+    unsigned char* oper; // TokenType of an OPER_NODE
+    unsigned char* type; // expr_data_type, or the type of the variable of an assign or read
+    unsigned int* first_child;
+    unsigned int* next_sibling;
+    unsigned int* value; // memloc of an ID, ASSIGN or READ node, index in literals of a NUM node
+
+    int* line_num; // side tables
+    double* literals;
+    int num_literals, literals_capacity;
+
+    const char** names; // names[memloc], for prompts and errors
+    const NodeFeedback* feedback; // by stmt_num, 0 to lay out in pre-order
+
+    FlatTree()
+    {
+        num_nodes=1; capacity=0;
+        kind=oper=type=0; first_child=next_sibling=value=0; line_num=0;
+        literals=0; num_literals=literals_capacity=0;
+        names=0; feedback=0;
+        Grow(256);
+    }
+
+    ~FlatTree()
+    {
+        free(kind); free(oper); free(type);
+        free(first_child); free(next_sibling); free(value);
+        free(line_num); free(literals);
+        if(names) delete[] names;
+    }
+
+    void Grow(int new_capacity)
+    {
+        capacity=new_capacity;
+        kind=(unsigned char*)realloc(kind, capacity);
+        oper=(unsigned char*)realloc(oper, capacity);
+        type=(unsigned char*)realloc(type, capacity);
+        first_child=(unsigned int*)realloc(first_child, capacity*sizeof(unsigned int));
+        next_sibling=(unsigned int*)realloc(next_sibling, capacity*sizeof(unsigned int));
+        value=(unsigned int*)realloc(value, capacity*sizeof(unsigned int));
+        line_num=(int*)realloc(line_num, capacity*sizeof(int));
+    }
+
+    void Clear() {num_nodes=1; num_literals=0;}
+
+    unsigned int NewNode(NodeKind k, int line)
+    {
+        if(num_nodes==capacity) Grow(2*capacity);
+        unsigned int n=num_nodes++;
+        kind[n]=k; oper[n]=0; type[n]=VOID;
+        first_child[n]=next_sibling[n]=FLAT_NONE; value[n]=0;
+        line_num[n]=line;
+        return n;
+    }
+
+    unsigned int AddLiteral(double v)
+    {
+        if(num_literals==literals_capacity)
+        {
+            literals_capacity=literals_capacity ? 2*literals_capacity : 64;
+            literals=(double*)realloc(literals, literals_capacity*sizeof(double));
+        }
+        literals[num_literals]=v;
+        return num_literals++;
+    }
+
+    // bytes per node of the arrays, not counting unused capacity
+    static int NodeBytes() {return 3*sizeof(unsigned char)+3*sizeof(unsigned int)+sizeof(int);}
+};
+
+unsigned int FlattenSeq(FlatTree*, TreeNode*, SymbolTable*, int line_num);
+
+// Flattens node and its children, but not its siblings
+unsigned int FlattenNode(FlatTree* ft, TreeNode* node, SymbolTable* symbol_table)
+{
+    unsigned int n=ft->NewNode(node->node_kind, node->line_num);
+    unsigned int last=FLAT_NONE;
+    unsigned int c[MAX_CHILDREN];
+    int i, num_children=0;
+
+    if(node->node_kind==ID_NODE || node->node_kind==ASSIGN_NODE || node->node_kind==READ_NODE || node->node_kind==INDEX_NODE)
+    {
+        VariableInfo* var=symbol_table->Find(node->id);
+        ft->value[n]=var->memloc;
+        ft->type[n]=(node->node_kind==ID_NODE || node->node_kind==INDEX_NODE) ? node->expr_data_type : var->var_type;
+    }
+    else if(node->node_kind==NUM_NODE)
+    {
+        ft->value[n]=ft->AddLiteral(node->expr_data_type==REAL ? node->real_num : (double)node->num);
+        ft->type[n]=node->expr_data_type;
+    }
+    else if(node->node_kind==OPER_NODE)
+    {
+        ft->oper[n]=node->oper;
+        ft->type[n]=node->expr_data_type;
+    }
+
+    if(node->node_kind==IF_NODE)
+    {
+        c[num_children++]=FlattenNode(ft, node->child[0], symbol_table);
+        const NodeFeedback* fb=ft->feedback ? &ft->feedback[node->stmt_num] : 0;
+        if(node->child[2] && fb && 2*fb->taken<fb->count)
+        {
+            c[2]=FlattenSeq(ft, node->child[2], symbol_table, node->line_num);
+            c[1]=FlattenSeq(ft, node->child[1], symbol_table, node->line_num);
+            num_children=3;
+        }
+        else
+        {
+            c[num_children++]=FlattenSeq(ft, node->child[1], symbol_table, node->line_num);
+            if(node->child[2]) c[num_children++]=FlattenSeq(ft, node->child[2], symbol_table, node->line_num);
+        }
+    }
+    else if(node->node_kind==REPEAT_NODE)
+    {
+        c[num_children++]=FlattenSeq(ft, node->child[0], symbol_table, node->line_num);
+        c[num_children++]=FlattenNode(ft, node->child[1], symbol_table);
+    }
+    else
+    {
+        for(i=0;i<MAX_CHILDREN;i++) if(node->child[i]) c[num_children++]=FlattenNode(ft, node->child[i], symbol_table);
+    }
+
+    for(i=0;i<num_children;i++)
+    {
+        if(last==FLAT_NONE) ft->first_child[n]=c[i];
+        else ft->next_sibling[last]=c[i];
+        last=c[i];
+    }
+    return n;
+}
+
+// A SEQ_NODE holding list and its siblings, declarations are left out
+unsigned int FlattenSeq(FlatTree* ft, TreeNode* list, SymbolTable* symbol_table, int line_num)
+{
+    unsigned int n=ft->NewNode(SEQ_NODE, line_num);
+    unsigned int last=FLAT_NONE;
+    for(;list;list=list->sibling)
+    {
+        if(list->node_kind==DECLARE_NODE) continue;
+        unsigned int c=FlattenNode(ft, list, symbol_table);
+        if(last==FLAT_NONE) ft->first_child[n]=c;
+        else ft->next_sibling[last]=c;
+        last=c;
+    }
+    return n;
+}
+
+void FlattenNames(FlatTree* ft, SymbolTable* symbol_table)
+{
+    int i;
+    ft->names=new const char*[symbol_table->num_vars];
+    for(i=0;i<symbol_table->num_vars;i++) ft->names[symbol_table->vars[i].memloc]=symbol_table->vars[i].name;
+}
+
+// The root is node 1, a SEQ_NODE with the top level statements
+void Flatten(FlatTree* ft, TreeNode* syntax_tree, SymbolTable* symbol_table)
+{
+    FlattenSeq(ft, syntax_tree, symbol_table, syntax_tree ? syntax_tree->line_num : 0);
+    FlattenNames(ft, symbol_table);
+}
+
+double EvaluateFlat(const FlatTree* ft, unsigned int n, Variable* variables)
+{
+    int k=ft->kind[n];
+    if(k==NUM_NODE) return ft->literals[ft->value[n]];
+    if(k==ID_NODE)
+    {
+        Variable* var=&variables[ft->value[n]];
+        if(var->type==REAL) return var->real_val;
+        if(var->type==INTEGER) return (double)var->int_val;
+        if(var->type==BOOLEAN) return var->bool_val ? 1.0 : 0.0;
+        return 0.0;
+    }
+
+    unsigned int c=ft->first_child[n];
+    double a=EvaluateFlat(ft, c, variables);
+    double b=EvaluateFlat(ft, ft->next_sibling[c], variables);
+
+    int oper=ft->oper[n];
+    if(oper==EQUAL) return (a == b) ? 1.0 : 0.0;
+    if(oper==LESS_THAN) return (a < b) ? 1.0 : 0.0;
+    if(oper==PLUS) return a + b;
+    if(oper==MINUS) return a - b;
+    if(oper==TIMES) return a * b;
+    if(oper==DIVIDE) return a / b;
+    if(oper==POWER) return pow(a, b);
+    if(oper==AND_OPER) return (a * a) - (b * b);
+    return 0.0;
+}
+
+// Same behavior as RunProgram, n is a statement or a SEQ_NODE
+void RunFlat(const FlatTree* ft, unsigned int n, Variable* variables, RunInfo* pri)
+{
+    int k=ft->kind[n];
+    unsigned int c=ft->first_child[n];
+
+    if(k==SEQ_NODE)
+    {
+        for(;c!=FLAT_NONE;c=ft->next_sibling[c]) RunFlat(ft, c, variables, pri);
+    }
+    else if(k==IF_NODE)
+    {
+        unsigned int then_part=ft->next_sibling[c];
+        if(EvaluateFlat(ft, c, variables)!=0.0) RunFlat(ft, then_part, variables, pri);
+        else if(ft->next_sibling[then_part]!=FLAT_NONE) RunFlat(ft, ft->next_sibling[then_part], variables, pri);
+    }
+    else if(k==ASSIGN_NODE)
+    {
+        Variable* var=&variables[ft->value[n]];
+        double v=EvaluateFlat(ft, c, variables);
+        if(var->type==REAL) var->real_val=v;
+        else if(var->type==INTEGER) var->int_val=(int)v;
+        else if(var->type==BOOLEAN) var->bool_val=(v != 0.0);
+    }
+    else if(k==READ_NODE)
+    {
+        ReadValue(pri, ft->names[ft->value[n]], ft->line_num[n], &variables[ft->value[n]]);
+    }
+    else if(k==WRITE_NODE)
+    {
+        WriteValue(pri, (ExprDataType)ft->type[c], EvaluateFlat(ft, c, variables), ft->line_num[n]);
+    }
+    else if(k==REPEAT_NODE)
+    {
+        unsigned int cond=ft->next_sibling[c];
+        while(true)
+        {
+            RunFlat(ft, c, variables, pri);
+            if(EvaluateFlat(ft, cond, variables)!=0.0) break;
+            BackEdge(pri, ft->line_num[n]);
+        }
+    }
+}
+
+void RunFlat(FlatTree* ft, SymbolTable* symbol_table, RunInfo* pri)
+{
+    Variable* variables=new Variable[symbol_table->num_vars];
+    InitVariables(symbol_table, variables);
+    try {
+        RunFlat(ft, 1, variables, pri);
+    }
+    catch(...) {
+        delete[] variables;
+        throw;
+    }
+    delete[] variables;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Tiered Execution ////////////////////////////////////////////////////////////////
+
+// Programs start in RunProgram, which needs no preparation. A repeat loop that runs
+// TIER_UP_ITERATIONS iterations in one go is flattened and the rest of the loop runs
+// from the flat tree, about 4 times faster, then RunProgram goes on after the loop.
+// Later runs of a switched loop go to the flat tree from the start. Loops are found
+// by node address, so the tier must be cleared when the nodes are freed.
+#define MAX_TIER_LOOPS 256
+
+struct LoopTier
+{
+    FlatTree ft;
+    TreeNode* loops[MAX_TIER_LOOPS];
+    unsigned int nodes[MAX_TIER_LOOPS]; // flat node of each loop
+    int num_loops;
+
+    LoopTier(SymbolTable* symbol_table) {num_loops=0; FlattenNames(&ft, symbol_table);}
+
+    void Clear() {ft.Clear(); num_loops=0;}
+};
+
+// True if a loop in the statements has been run in closed form
+bool HasClosedForm(const TreeNode* node)
+{
+    for(;node;node=node->sibling)
+    {
+        if(node->node_kind==REPEAT_NODE && (node->closed_form || HasClosedForm(node->child[0]))) return true;
+        if(node->node_kind==IF_NODE && (HasClosedForm(node->child[1]) || HasClosedForm(node->child[2]))) return true;
+    }
+    return false;
+}
+
+// Runs the rest of the loop from the flat tree if it was switched before, or if tier_up
+// is set and it can be switched now. Returns false if RunProgram must go on with it.
+bool RunLoopTier(TreeNode* loop, SymbolTable* symbol_table, Variable* variables, RunInfo* pri, bool tier_up)
+{
+    if(!pri->loop_tier) pri->loop_tier=new LoopTier(symbol_table);
+    LoopTier* lt=pri->loop_tier;
+    unsigned int n=FLAT_NONE;
+    int i;
+    for(i=0;i<lt->num_loops && n==FLAT_NONE;i++) if(lt->loops[i]==loop) n=lt->nodes[i];
+    // the flat tree has no closed forms, it would run every iteration of those loops
+    if(n==FLAT_NONE && tier_up && lt->num_loops<MAX_TIER_LOOPS && !HasClosedForm(loop->child[0]))
+    {
+        n=FlattenNode(&lt->ft, loop, symbol_table);
+        lt->loops[lt->num_loops]=loop;
+        lt->nodes[lt->num_loops++]=n;
+    }
+    if(n==FLAT_NONE) return false;
+    RunFlat(&lt->ft, n, variables, pri);
+    return true;
+}
+
+void ReleaseTier(RunInfo* pri)
+{
+    delete pri->loop_tier;
+    pri->loop_tier=0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Profile Feedback ////////////////////////////////////////////////////////////////
+
+// -profile-out counts how often each statement runs, which way each if goes and how
+// many iterations each repeat runs, and writes them to a file with a hash of the
+// source. -profile-in reads them back in a later compile: repeat loops that ran at
+// least PGO_HOT_ITERATIONS iterations are flattened and run from the flat tree, where
+// their variables are array slots instead of symbol table lookups, and in them an if
+// that mostly took its else branch gets that branch laid out first. Cold code stays in
+// the syntax tree and costs nothing to prepare. A profile whose hash or statements
+// don't match the source is stale, it is reported and the program runs without it.
+//
+// The file is text, a header line "profile <hash> <statements>" and then one line per
+// statement in pre-order: line, kind, ordinal among the statements of that kind on the
+// line, count, taken, iterations.
+
+const long long PGO_HOT_ITERATIONS=1000;
+
+struct ProfileFeedback
+{
+    unsigned long long source_hash;
+    int num_stmts;
+    TreeNode** stmts; // by stmt_num, from 1
+    NodeFeedback* counts; // by stmt_num
+
+    ProfileFeedback() {source_hash=0; num_stmts=0; stmts=0; counts=0;}
+    ~ProfileFeedback() {free(stmts); delete[] counts;}
+
+    void NumberList(TreeNode* node)
+    {
+        for(;node;node=node->sibling)
+        {
+            if(node->node_kind==DECLARE_NODE) continue;
+            if(num_stmts%1024==0) stmts=(TreeNode**)realloc(stmts, (num_stmts+1025)*sizeof(TreeNode*));
+            node->stmt_num=++num_stmts;
+            stmts[num_stmts]=node;
+            if(node->node_kind==IF_NODE) {NumberList(node->child[1]); NumberList(node->child[2]);}
+            else if(node->node_kind==REPEAT_NODE) NumberList(node->child[0]);
+        }
+    }
+
+    // Numbers the statements and hashes the source file, counts start at 0
+    void Start(TreeNode* syntax_tree, const char* source_str)
+    {
+        NumberList(syntax_tree);
+        counts=new NodeFeedback[num_stmts+1]();
+
+        InputSource source; // FNV-1a
+        source_hash=14695981039346656037ULL;
+        if(source.Open(source_str))
+        {
+            const char* p;
+            for(p=source.cur;p<source.end;p++) source_hash=(source_hash^(unsigned char)*p)*1099511628211ULL;
+        }
+    }
+
+    // Ordinal of statement i among the earlier statements of the same kind on its line
+    int Ordinal(int i)
+    {
+        int j, n=0;
+        for(j=i-1;j>0 && stmts[j]->line_num==stmts[i]->line_num;j--) if(stmts[j]->node_kind==stmts[i]->node_kind) n++;
+        return n;
+    }
+
+    bool Write(const char* str)
+    {
+        FILE* file=fopen(str, "w");
+        if(!file) return false;
+        fprintf(file, "profile %016llx %d\n", source_hash, num_stmts);
+        int i;
+        for(i=1;i<=num_stmts;i++)
+        {
+            const NodeFeedback* c=&counts[i];
+            fprintf(file, "%d %s %d %lld %lld %lld\n", stmts[i]->line_num, NodeKindStr[stmts[i]->node_kind], Ordinal(i), c->count, c->taken, c->iterations);
+        }
+        fclose(file);
+        return true;
+    }
+
+    // Fills counts from the file, returns false if it can't be read or is stale
+    bool Read(const char* str)
+    {
+        FILE* file=fopen(str, "r");
+        if(!file) return false;
+        unsigned long long hash;
+        int n, i;
+        bool ok=fscanf(file, "profile %llx %d", &hash, &n)==2 && hash==source_hash && n==num_stmts;
+        for(i=1;i<=num_stmts && ok;i++)
+        {
+            int line, ordinal;
+            char kind[16];
+            NodeFeedback* c=&counts[i];
+            ok=fscanf(file, "%d %15s %d %lld %lld %lld", &line, kind, &ordinal, &c->count, &c->taken, &c->iterations)==6 &&
+               line==stmts[i]->line_num && Equals(kind, NodeKindStr[stmts[i]->node_kind]) && ordinal==Ordinal(i);
+        }
+        fclose(file);
+        if(!ok) memset(counts, 0, (num_stmts+1)*sizeof(NodeFeedback));
+        return ok;
+    }
+};
+
+// Flattens the outermost hot loops into ft, tier_nodes[stmt_num] is the flat node of each
+int FlattenHotLoops(TreeNode* node, const ProfileFeedback* pf, FlatTree* ft, SymbolTable* symbol_table, unsigned int* tier_nodes)
+{
+    int num_loops=0;
+    for(;node;node=node->sibling)
+    {
+        if(node->node_kind==REPEAT_NODE && pf->counts[node->stmt_num].iterations>=PGO_HOT_ITERATIONS)
+        {
+            tier_nodes[node->stmt_num]=FlattenNode(ft, node, symbol_table);
+            num_loops++;
+        }
+        else if(node->node_kind==REPEAT_NODE) num_loops+=FlattenHotLoops(node->child[0], pf, ft, symbol_table, tier_nodes);
+        else if(node->node_kind==IF_NODE)
+        {
+            num_loops+=FlattenHotLoops(node->child[1], pf, ft, symbol_table, tier_nodes);
+            num_loops+=FlattenHotLoops(node->child[2], pf, ft, symbol_table, tier_nodes);
+        }
+    }
+    return num_loops;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Checkpoints /////////////////////////////////////////////////////////////////////
+
+// With -checkpoint the state of the run is written at the back-edge of a repeat loop
+// once every -checkpoint-every ms, and -resume goes on from it at the next iteration
+// of that loop. The state is the loop (by its statement number, as in the profile
+// feedback), the variables, the counters of the limits and the number of input values
+// read. The file is written next to the old one and renamed over it, so a run killed
+// while writing leaves the last complete checkpoint, and it is removed when the run
+// ends normally. Output written after the checkpoint is written again on resume.
+
+const char CHECKPOINT_MAGIC[8]={'T','I','N','Y','C','K','P','1'};
+
+struct CheckpointHeader
+{
+    char magic[8];
+    unsigned long long source_hash;
+    int stmt_num; // of the repeat loop
+    int num_vars; // followed by the value or the elements of each, by memloc
+    long long num_back_edges;
+    long long num_output_bytes;
+    long long num_values; // read from the input
+};
+
+struct Checkpoint
+{
+    const char* file_str;
+    const ProfileFeedback* numbering; // the statements and the source hash
+    const SymbolTable* symbol_table;
+    int interval_ms;
+    int num_written;
+    double write_time; // seconds spent writing
+    long long file_size; // of the last one
+
+    Checkpoint() {file_str=0; numbering=0; symbol_table=0; interval_ms=0; num_written=0; write_time=0; file_size=0;}
+};
+
+// Returns the number of bytes written, 0 on error
+long long WriteVariableState(FILE* file, const Variable* var)
+{
+    if(var->size) return fwrite(var->elems, ElementSize(var->type), var->size, file)==(size_t)var->size ? (long long)ElementSize(var->type)*var->size : 0;
+    const void* p = var->type == REAL ? (const void*)&var->real_val : var->type == INTEGER ? (const void*)&var->int_val : (const void*)&var->bool_val;
+    return fwrite(p, ElementSize(var->type), 1, file)==1 ? ElementSize(var->type) : 0;
+}
+
+bool ReadVariableState(FILE* file, Variable* var)
+{
+    if(var->size) return fread(var->elems, ElementSize(var->type), var->size, file)==(size_t)var->size;
+    void* p = var->type == REAL ? (void*)&var->real_val : var->type == INTEGER ? (void*)&var->int_val : (void*)&var->bool_val;
+    return fread(p, ElementSize(var->type), 1, file)==1;
+}
+
+void WriteCheckpoint(TreeNode* loop, Variable* variables, RunInfo* pri)
+{
+    Checkpoint* cp=pri->checkpoint;
+    double start=GetTime();
+    char tmp_str[1024];
+    snprintf(tmp_str, sizeof(tmp_str), "%s.tmp", cp->file_str);
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.source_hash=cp->numbering->source_hash;
+    header.stmt_num=loop->stmt_num;
+    header.num_vars=cp->symbol_table->num_vars;
+    header.num_back_edges=pri->num_back_edges;
+    header.num_output_bytes=pri->num_output_bytes;
+    header.num_values=pri->input ? pri->input->num_values : 0;
+
+    long long size=0;
+    FILE* file=fopen(tmp_str, "wb");
+    bool ok=file && fwrite(&header, sizeof(header), 1, file)==1;
+    if(ok) size=sizeof(header);
+    int i;
+    for(i=0;i<header.num_vars && ok;i++)
+    {
+        long long n=WriteVariableState(file, &variables[i]);
+        ok=n>0;
+        size+=n;
+    }
+    if(file) ok=fclose(file)==0 && ok;
+    ok=ok && rename(tmp_str, cp->file_str)==0;
+
+    // the run goes on without it, the older checkpoint is still there
+    if(!ok) {printf("WARNING: Can't write checkpoint '%s'\n", cp->file_str); fflush(NULL);}
+    else {cp->num_written++; cp->file_size=size;}
+    double now=GetTime();
+    cp->write_time+=now-start;
+    pri->checkpoint_due=false;
+    pri->checkpoint_time=now+cp->interval_ms/1000.0;
+}
+
+// Reads the variables and the counters of pri, returns the loop to go on from.
+// *num_values is set to the number of input values read before the checkpoint.
+TreeNode* LoadCheckpoint(const char* str, const ProfileFeedback* numbering, const SymbolTable* symbol_table, Variable* variables, RunInfo* pri, long long* num_values)
+{
+    FILE* file=fopen(str, "rb");
+    if(!file) {printf("ERROR: Can't open checkpoint '%s'\n", str); throw "Terminate Program!";}
+
+    CheckpointHeader header;
+    const char* error=0;
+    if(fread(&header, sizeof(header), 1, file)!=1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))!=0) error="isn't a checkpoint";
+    else if(header.source_hash!=numbering->source_hash || header.num_vars!=symbol_table->num_vars ||
+            header.stmt_num<1 || header.stmt_num>numbering->num_stmts || numbering->stmts[header.stmt_num]->node_kind!=REPEAT_NODE)
+        error="doesn't match the source";
+    int i;
+    for(i=0;i<symbol_table->num_vars && !error;i++) if(!ReadVariableState(file, &variables[i])) error="is cut short";
+    if(!error && fgetc(file)!=EOF) error="doesn't match the source";
+    fclose(file);
+    if(error) {printf("ERROR: Checkpoint '%s' %s\n", str, error); throw "Terminate Program!";}
+
+    pri->num_back_edges=header.num_back_edges;
+    pri->num_output_bytes=header.num_output_bytes;
+    *num_values=header.num_values;
+    return numbering->stmts[header.stmt_num];
+}
+
+// Fills path with the statements from the top level down to target, returns their number or 0 if not found
+int FindStmtPath(TreeNode* node, const TreeNode* target, TreeNode** path, int depth)
+{
+    for(;node;node=node->sibling)
+    {
+        path[depth]=node;
+        if(node==target) return depth+1;
+        int n=0;
+        if(node->node_kind==REPEAT_NODE) n=FindStmtPath(node->child[0], target, path, depth+1);
+        else if(node->node_kind==IF_NODE)
+        {
+            n=FindStmtPath(node->child[1], target, path, depth+1);
+            if(!n) n=FindStmtPath(node->child[2], target, path, depth+1);
+        }
+        if(n) return n;
+    }
+    return 0;
+}
+
+// Runs the rest of the program from the checkpoint. path[depth-1] is the loop it was
+// written in, each statement of path is in the body or a branch of the one before.
+void ResumeFrom(TreeNode** path, int k, int depth, SymbolTable* symbol_table, Variable* variables, RunInfo* pri)
+{
+    TreeNode* node=path[k];
+    bool again=true; // go on at the next iteration of the loop
+    if(k<depth-1)
+    {
+        ResumeFrom(path, k+1, depth, symbol_table, variables, pri);
+        again=node->node_kind==REPEAT_NODE && EvaluateReal(node->child[1], symbol_table, variables, pri)==0.0;
+        if(again)
+        {
+            BackEdge(pri, node->line_num);
+            if(pri->checkpoint_due) WriteCheckpoint(node, variables, pri);
+        }
+    }
+    if(again) RunRepeat(node, symbol_table, variables, pri);
+    RunProgram(node->sibling, symbol_table, variables, pri);
+}
+
+// Entry point of -resume, in place of RunProgram
+void ResumeProgram(TreeNode* syntax_tree, SymbolTable* symbol_table, RunInfo* pri, const char* resume_str, const ProfileFeedback* numbering)
+{
+    Variable* variables=new Variable[symbol_table->num_vars];
+    InitVariables(symbol_table, variables);
+    TreeNode** path=new TreeNode*[numbering->num_stmts];
+    try {
+        long long num_values;
+        TreeNode* loop=LoadCheckpoint(resume_str, numbering, symbol_table, variables, pri, &num_values);
+        int depth=FindStmtPath(syntax_tree, loop, path, 0);
+
+        // values typed at the prompts are gone, values from a file are read again
+        const char* s; const char* e;
+        while(pri->input && pri->input->num_values<num_values)
+        {
+            if(!pri->input->NextField(&s, &e)) {printf("ERROR: Input ends before the %lld values read at the checkpoint\n", num_values); throw "Terminate Program!";}
+        }
+
+        printf("Resumed at the repeat at line %d after %lld loop iterations\n", loop->line_num, pri->num_back_edges); fflush(NULL);
+        ResumeFrom(path, 0, depth, symbol_table, variables, pri);
+    }
+    catch(...) {
+        delete[] path;
+        FreeVariables(symbol_table, variables);
+        throw;
+    }
+    delete[] path;
+    FreeVariables(symbol_table, variables);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// SSA Form ////////////////////////////////////////////////////////////////////////
+
+// The analyzed syntax tree lowered to basic blocks of instructions in SSA form, for
+// passes that need a control flow graph and def-use chains. An instruction defines at
+// most one value, numbered by the instruction and typed from expr_data_type. Scalar
+// variables become values: the statements are lowered with the current value of each
+// variable, and the variables assigned in an if or a repeat get phis at the join or the
+// loop header, the trivial ones are removed afterwards. Arrays stay in memory. As in
+// RunProgram the values are doubles, and a value assigned to an int is cut with to_int.
+// The blocks are laid out in source order, so the blocks of a loop are the range from
+// its header to its latch, which is what the register allocator relies on.
+
+enum IrOp {IR_NONE, IR_CONST, IR_PHI, IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_POW, IR_AND, IR_EQ, IR_LT,
+           IR_TO_INT, IR_LOAD, IR_STORE, IR_READ, IR_READ_ELEM, IR_WRITE, IR_JUMP, IR_BRANCH, IR_RETURN};
+
+const char* IrOpStr[]={"none", "const", "phi", "add", "sub", "mul", "div", "pow", "and", "eq", "lt",
+                       "to_int", "load", "store", "read", "read_elem", "write", "jump", "branch", "return"};
+
+const int IR_NUM_REGS=16; // the register file the allocator targets, the rest go to spill slots
+const int IR_MAX_PREDS=2; // of a join or a loop header
+
+struct IrInstr
+{
+    unsigned char op; // IrOp
+    unsigned char type; // ExprDataType of the value, VOID if none
+    int block;
+    int next; // in the list of the block, 0 at the end
+    int a, b; // operands, of a phi by predecessor, 0 for none
+    int memloc; // variable of a load, store, read or phi, -1 for none
+    double num; // of a const
+    const TreeNode* node; // for names and line numbers
+    int loc; // register below IR_NUM_REGS or spill slot, -1 for none
+};
+
+struct IrBlock
+{
+    int first_phi; // phis, linked by next
+    int first, last; // the other instructions, the last one jumps, branches or returns
+    int preds[IR_MAX_PREDS], num_preds;
+    int succs[2], num_succs; // of a branch, taken if the condition is true and otherwise
+    int loop; // innermost loop, -1 for none
+    int start, end; // positions of the phis and of the last instruction, see AllocateRegisters
+};
+
+struct IrLoop
+{
+    int header, latch; // the first and the last block of the loop
+    int parent; // enclosing loop, -1 for none
+};
+
+// A step of the interpreter, see FinalizeIr
+struct IrStep
+{
+    unsigned char op;
+    unsigned char type;
+    int dst, a, b; // locations
+    int aux, aux2; // memloc, or the edges of a jump or a branch
+    double num;
+    const TreeNode* node;
+};
+
+struct IrEdge
+{
+    int target; // step
+    int first_copy, num_copies; // into the phis of the target block
+    bool back; // to a loop header from its latch
+    int line_num;
+};
+
+struct IrProgram
+{
+    IrInstr* instrs; // instrs[0] is not used, 0 means none
+    int num_instrs, instrs_capacity;
+    IrBlock* blocks; // blocks[0] is the entry
+    int num_blocks, blocks_capacity;
+    IrLoop* loops;
+    int num_loops, loops_capacity;
+    int num_vars;
+    int num_values; // instructions that define a value
+    int num_spill_slots; // locations from IR_NUM_REGS on
+    int num_regs_used;
+
+    IrStep* steps;
+    int num_steps;
+    IrEdge* edges;
+    int num_edges;
+    int* copies; // pairs of source and destination locations
+    int num_copies, max_edge_copies;
+
+    IrProgram()
+    {
+        instrs=0; num_instrs=1; instrs_capacity=0;
+        blocks=0; num_blocks=blocks_capacity=0;
+        loops=0; num_loops=loops_capacity=0;
+        num_vars=num_values=num_spill_slots=num_regs_used=0;
+        steps=0; num_steps=0; edges=0; num_edges=0; copies=0; num_copies=max_edge_copies=0;
+    }
+
+    ~IrProgram() {free(instrs); free(blocks); free(loops); delete[] steps; delete[] edges; delete[] copies;}
+
+    int NewBlock(int loop)
+    {
+        if(num_blocks==blocks_capacity)
+        {
+            blocks_capacity=blocks_capacity ? 2*blocks_capacity : 64;
+            blocks=(IrBlock*)realloc(blocks, blocks_capacity*sizeof(IrBlock));
+        }
+        IrBlock* b=&blocks[num_blocks];
+        memset(b, 0, sizeof(IrBlock));
+        b->loop=loop;
+        return num_blocks++;
+    }
+
+    int NewLoop(int header, int parent)
+    {
+        if(num_loops==loops_capacity)
+        {
+            loops_capacity=loops_capacity ? 2*loops_capacity : 16;
+            loops=(IrLoop*)realloc(loops, loops_capacity*sizeof(IrLoop));
+        }
+        loops[num_loops].header=header;
+        loops[num_loops].latch=header;
+        loops[num_loops].parent=parent;
+        return num_loops++;
+    }
+
+    // Appends an instruction to block, a phi goes to the phis of the block
+    int NewInstr(int block, IrOp op, ExprDataType type, int a=0, int b=0, const TreeNode* node=0)
+    {
+        if(num_instrs>=instrs_capacity)
+        {
+            instrs_capacity=instrs_capacity ? 2*instrs_capacity : 256;
+            instrs=(IrInstr*)realloc(instrs, instrs_capacity*sizeof(IrInstr));
+        }
+        int n=num_instrs++;
+        IrInstr* in=&instrs[n];
+        in->op=op; in->type=type; in->block=block; in->next=0;
+        in->a=a; in->b=b; in->memloc=-1; in->num=0; in->node=node; in->loc=-1;
+        IrBlock* bl=&blocks[block];
+        if(op==IR_PHI) {in->next=bl->first_phi; bl->first_phi=n;}
+        else
+        {
+            if(bl->last) instrs[bl->last].next=n;
+            else bl->first=n;
+            bl->last=n;
+        }
+        return n;
+    }
+
+    void AddEdge(int from, int to)
+    {
+        blocks[from].succs[blocks[from].num_succs++]=to;
+        blocks[to].preds[blocks[to].num_preds++]=from;
+    }
+
+    static bool IsTerminator(int op) {return op==IR_JUMP || op==IR_BRANCH || op==IR_RETURN;}
+    static bool HasValue(int op) {return op!=IR_NONE && op!=IR_STORE && op!=IR_READ_ELEM && op!=IR_WRITE && !IsTerminator(op);}
+    // can be removed if unused, a load may fail its bounds check
+    static bool IsPure(int op) {return HasValue(op) && op!=IR_LOAD && op!=IR_READ;}
+};
+
+struct IrBuilder
+{
+    IrProgram* ir;
+    SymbolTable* symbol_table;
+    int* cur; // current value of each scalar variable, by memloc
+    bool* seen; // by memloc, for IrAssignedVars
+    int block; // being appended to
+    int loop; // innermost loop, -1 for none
+};
+
+// Appends the memlocs of the scalar variables assigned in the statements to vars, once each
+int IrAssignedVars(IrBuilder* pb, TreeNode* node, int* vars, int num)
+{
+    for(;node;node=node->sibling)
+    {
+        bool scalar = (node->node_kind==ASSIGN_NODE && !node->child[1]) || (node->node_kind==READ_NODE && !node->child[0]);
+        if(scalar)
+        {
+            int memloc=pb->symbol_table->Find(node->id)->memloc;
+            if(!pb->seen[memloc]) {pb->seen[memloc]=true; vars[num++]=memloc;}
+        }
+        else if(node->node_kind==IF_NODE)
+        {
+            num=IrAssignedVars(pb, node->child[1], vars, num);
+            num=IrAssignedVars(pb, node->child[2], vars, num);
+        }
+        else if(node->node_kind==REPEAT_NODE) num=IrAssignedVars(pb, node->child[0], vars, num);
+    }
+    return num;
+}
+
+int IrExpr(IrBuilder* pb, TreeNode* node)
+{
+    IrProgram* ir=pb->ir;
+    if(node->node_kind==NUM_NODE)
+    {
+        int c=ir->NewInstr(pb->block, IR_CONST, node->expr_data_type, 0, 0, node);
+        ir->instrs[c].num = node->expr_data_type==REAL ? node->real_num : node->num;
+        return c;
+    }
+    if(node->node_kind==ID_NODE) return pb->cur[pb->symbol_table->Find(node->id)->memloc];
+    if(node->node_kind==INDEX_NODE)
+    {
+        int index=IrExpr(pb, node->child[0]);
+        int v=ir->NewInstr(pb->block, IR_LOAD, node->expr_data_type, index, 0, node);
+        ir->instrs[v].memloc=pb->symbol_table->Find(node->id)->memloc;
+        return v;
+    }
+
+    int a=IrExpr(pb, node->child[0]);
+    int b=IrExpr(pb, node->child[1]);
+    IrOp op = node->oper==PLUS ? IR_ADD : node->oper==MINUS ? IR_SUB : node->oper==TIMES ? IR_MUL : node->oper==DIVIDE ? IR_DIV :
+              node->oper==POWER ? IR_POW : node->oper==AND_OPER ? IR_AND : node->oper==EQUAL ? IR_EQ : IR_LT;
+    return ir->NewInstr(pb->block, op, node->expr_data_type, a, b, node);
+}
+
+void IrStmts(IrBuilder* pb, TreeNode* node);
+
+void IrIf(IrBuilder* pb, TreeNode* node)
+{
+    IrProgram* ir=pb->ir;
+    int cond=IrExpr(pb, node->child[0]);
+    int cond_block=pb->block;
+    ir->NewInstr(cond_block, IR_BRANCH, VOID, cond, 0, node);
+
+    int* vars=new int[3*ir->num_vars+1];
+    int num=IrAssignedVars(pb, node->child[1], vars, 0);
+    num=IrAssignedVars(pb, node->child[2], vars, num);
+    int* before=vars+ir->num_vars;
+    int* then_vals=before+ir->num_vars;
+    int k;
+    for(k=0;k<num;k++) {pb->seen[vars[k]]=false; before[k]=pb->cur[vars[k]];}
+
+    pb->block=ir->NewBlock(pb->loop);
+    ir->AddEdge(cond_block, pb->block);
+    IrStmts(pb, node->child[1]);
+    int then_end=pb->block;
+    for(k=0;k<num;k++) {then_vals[k]=pb->cur[vars[k]]; pb->cur[vars[k]]=before[k];}
+
+    int else_end=cond_block;
+    if(node->child[2])
+    {
+        pb->block=ir->NewBlock(pb->loop);
+        ir->AddEdge(cond_block, pb->block);
+        IrStmts(pb, node->child[2]);
+        else_end=pb->block;
+        ir->NewInstr(else_end, IR_JUMP, VOID);
+    }
+
+    int join=ir->NewBlock(pb->loop);
+    ir->NewInstr(then_end, IR_JUMP, VOID);
+    ir->AddEdge(then_end, join);
+    ir->AddEdge(else_end, join);
+    for(k=0;k<num;k++)
+    {
+        int m=vars[k];
+        if(then_vals[k]==pb->cur[m]) continue;
+        int phi=ir->NewInstr(join, IR_PHI, pb->symbol_table->vars[m].var_type, then_vals[k], pb->cur[m]);
+        ir->instrs[phi].memloc=m;
+        pb->cur[m]=phi;
+    }
+    pb->block=join;
+    delete[] vars;
+}
+
+void IrRepeat(IrBuilder* pb, TreeNode* node)
+{
+    IrProgram* ir=pb->ir;
+    int* vars=new int[2*ir->num_vars+1];
+    int num=IrAssignedVars(pb, node->child[0], vars, 0);
+    int* phis=vars+ir->num_vars;
+    int k;
+
+    int parent=pb->loop;
+    int header=ir->NewBlock(-1);
+    pb->loop=ir->blocks[header].loop=ir->NewLoop(header, parent);
+    ir->NewInstr(pb->block, IR_JUMP, VOID);
+    ir->AddEdge(pb->block, header);
+    for(k=0;k<num;k++)
+    {
+        int m=vars[k];
+        pb->seen[m]=false;
+        phis[k]=ir->NewInstr(header, IR_PHI, pb->symbol_table->vars[m].var_type, pb->cur[m]);
+        ir->instrs[phis[k]].memloc=m;
+        pb->cur[m]=phis[k];
+    }
+
+    pb->block=header;
+    IrStmts(pb, node->child[0]);
+    int cond=IrExpr(pb, node->child[1]);
+    int latch=pb->block;
+    ir->NewInstr(latch, IR_BRANCH, VOID, cond, 0, node);
+    ir->loops[pb->loop].latch=latch;
+    pb->loop=parent;
+
+    int exit=ir->NewBlock(parent);
+    ir->AddEdge(latch, exit);
+    ir->AddEdge(latch, header);
+    for(k=0;k<num;k++) ir->instrs[phis[k]].b=pb->cur[vars[k]];
+    pb->block=exit;
+    delete[] vars;
+}
+
+void IrStmts(IrBuilder* pb, TreeNode* node)
+{
+    IrProgram* ir=pb->ir;
+    for(;node;node=node->sibling)
+    {
+        if(node->node_kind==DECLARE_NODE) continue;
+        if(node->node_kind==IF_NODE) {IrIf(pb, node); continue;}
+        if(node->node_kind==REPEAT_NODE) {IrRepeat(pb, node); continue;}
+        if(node->node_kind==WRITE_NODE) {ir->NewInstr(pb->block, IR_WRITE, VOID, IrExpr(pb, node->child[0]), 0, node); continue;}
+
+        const VariableInfo* var=pb->symbol_table->Find(node->id);
+        if(node->node_kind==ASSIGN_NODE)
+        {
+            int v=IrExpr(pb, node->child[0]);
+            if(node->child[1])
+            {
+                int s=ir->NewInstr(pb->block, IR_STORE, VOID, IrExpr(pb, node->child[1]), v, node);
+                ir->instrs[s].memloc=var->memloc;
+            }
+            else
+            {
+                // consts, phis, loads and reads of an int are already whole numbers in range
+                int op=ir->instrs[v].op;
+                if(var->var_type==INTEGER && op!=IR_CONST && op!=IR_PHI && op!=IR_TO_INT && op!=IR_LOAD && op!=IR_READ)
+                    v=ir->NewInstr(pb->block, IR_TO_INT, INTEGER, v, 0, node);
+                pb->cur[var->memloc]=v;
+            }
+        }
+        else if(node->node_kind==READ_NODE)
+        {
+            int r;
+            if(node->child[0]) r=ir->NewInstr(pb->block, IR_READ_ELEM, VOID, IrExpr(pb, node->child[0]), 0, node);
+            else r=pb->cur[var->memloc]=ir->NewInstr(pb->block, IR_READ, var->var_type, 0, 0, node);
+            ir->instrs[r].memloc=var->memloc;
+        }
+    }
+}
+
+int IrFind(const int* repl, int v)
+{
+    while(repl[v]!=v) v=repl[v];
+    return v;
+}
+
+// Removes the phis whose operands are the same value or the phi itself, then the values
+// nothing uses, and relinks the instruction lists of the blocks without them
+void IrCleanUp(IrProgram* ir)
+{
+    int i, n=ir->num_instrs;
+    int* repl=new int[n];
+    for(i=0;i<n;i++) repl[i]=i;
+    bool changed=true;
+    while(changed)
+    {
+        changed=false;
+        for(i=1;i<n;i++)
+        {
+            IrInstr* in=&ir->instrs[i];
+            if(in->op!=IR_PHI) continue;
+            int a=IrFind(repl, in->a), b=IrFind(repl, in->b);
+            int same = (b==i || b==a) ? a : a==i ? b : -1;
+            if(same<0) continue;
+            repl[i]=same;
+            in->op=IR_NONE;
+            changed=true;
+        }
+    }
+    for(i=1;i<n;i++) {IrInstr* in=&ir->instrs[i]; in->a=IrFind(repl, in->a); in->b=IrFind(repl, in->b);}
+
+    int* uses=repl; // reused
+    memset(uses, 0, n*sizeof(int));
+    for(i=1;i<n;i++) if(ir->instrs[i].op!=IR_NONE) {uses[ir->instrs[i].a]++; uses[ir->instrs[i].b]++;}
+    int* work=new int[n];
+    int num_work=0;
+    for(i=1;i<n;i++) if(!uses[i] && IrProgram::IsPure(ir->instrs[i].op)) work[num_work++]=i;
+    while(num_work)
+    {
+        IrInstr* in=&ir->instrs[work[--num_work]];
+        in->op=IR_NONE;
+        int k, ops[2]={in->a, in->b};
+        for(k=0;k<2;k++)
+            if(ops[k] && --uses[ops[k]]==0 && IrProgram::IsPure(ir->instrs[ops[k]].op)) work[num_work++]=ops[k];
+    }
+    delete[] work;
+    delete[] repl;
+
+    int b;
+    for(b=0;b<ir->num_blocks;b++)
+    {
+        IrBlock* bl=&ir->blocks[b];
+        int* lists[2]={&bl->first_phi, &bl->first};
+        int l;
+        for(l=0;l<2;l++)
+        {
+            int* link=lists[l];
+            int last=0;
+            for(i=*link;i;i=ir->instrs[i].next)
+            {
+                if(ir->instrs[i].op==IR_NONE) continue;
+                *link=i; link=&ir->instrs[i].next; last=i;
+            }
+            *link=0;
+            if(l==1) bl->last=last;
+        }
+    }
+    ir->num_values=0;
+    for(i=1;i<n;i++) if(IrProgram::HasValue(ir->instrs[i].op)) ir->num_values++;
+}
+
+// Lowers the analyzed syntax tree into ir
+void LowerToIr(TreeNode* syntax_tree, SymbolTable* symbol_table, IrProgram* ir)
+{
+    IrBuilder builder;
+    builder.ir=ir;
+    builder.symbol_table=symbol_table;
+    builder.cur=new int[symbol_table->num_vars+1];
+    builder.seen=new bool[symbol_table->num_vars+1]();
+    builder.loop=-1;
+    ir->num_vars=symbol_table->num_vars;
+    builder.block=ir->NewBlock(-1);
+
+    // the variables start at 0, like InitVariables
+    int i, zero[INVALID]={0};
+    for(i=0;i<symbol_table->num_vars;i++)
+    {
+        ExprDataType type=symbol_table->vars[i].var_type;
+        if(symbol_table->vars[i].size) continue;
+        if(!zero[type]) zero[type]=ir->NewInstr(builder.block, IR_CONST, type);
+        builder.cur[symbol_table->vars[i].memloc]=zero[type];
+    }
+
+    IrStmts(&builder, syntax_tree);
+    ir->NewInstr(builder.block, IR_RETURN, VOID);
+    delete[] builder.cur;
+    delete[] builder.seen;
+    IrCleanUp(ir);
+}
+
+// Checks the blocks, the edges, that every value is defined before its uses on all paths
+// (its block dominates them) and the types. Prints the first problem found.
+bool VerifyIr(const IrProgram* ir)
+{
+    int i, b, k;
+    const char* error=0;
+    int where=0; // instruction or -block-1
+    int* order=new int[ir->num_instrs](); // within its block, phis are 0
+    int* idom=new int[ir->num_blocks];
+
+    for(b=0;b<ir->num_blocks && !error;b++)
+    {
+        const IrBlock* bl=&ir->blocks[b];
+        where=-b-1;
+        if(!bl->last || !IrProgram::IsTerminator(ir->instrs[bl->last].op)) error="doesn't end with a jump, branch or return";
+        else if(b && !bl->num_preds) error="can't be reached";
+        else if(bl->num_succs != (ir->instrs[bl->last].op==IR_JUMP ? 1 : ir->instrs[bl->last].op==IR_BRANCH ? 2 : 0)) error="has the wrong number of successors";
+        for(k=0;k<bl->num_succs && !error;k++)
+        {
+            const IrBlock* s=&ir->blocks[bl->succs[k]];
+            if(!(s->preds[0]==b || (s->num_preds>1 && s->preds[1]==b))) error="isn't a predecessor of its successor";
+        }
+        int n=0;
+        for(i=bl->first;i && !error;i=ir->instrs[i].next)
+        {
+            where=i;
+            order[i]=++n;
+            if(ir->instrs[i].block!=b) error="is in the list of another block";
+            else if(ir->instrs[i].op==IR_PHI || ir->instrs[i].op==IR_NONE) error="is out of place";
+            else if(IrProgram::IsTerminator(ir->instrs[i].op) && i!=bl->last) error="is in the middle of its block";
+        }
+        for(i=bl->first_phi;i && !error;i=ir->instrs[i].next)
+        {
+            where=i;
+            if(ir->instrs[i].block!=b || ir->instrs[i].op!=IR_PHI) error="is out of place";
+            else if(bl->num_preds!=IR_MAX_PREDS) error="is a phi in a block without two predecessors";
+        }
+    }
+
+    // Cooper, Harvey and Kennedy, the layout is a topological order of the forward edges
+    if(!error)
+    {
+        idom[0]=0;
+        for(b=1;b<ir->num_blocks;b++) idom[b]=-1;
+        bool changed=true;
+        while(changed)
+        {
+            changed=false;
+            for(b=1;b<ir->num_blocks;b++)
+            {
+                const IrBlock* bl=&ir->blocks[b];
+                int d=-1;
+                for(k=0;k<bl->num_preds;k++)
+                {
+                    int p=bl->preds[k];
+                    if(idom[p]<0) continue;
+                    if(d<0) {d=p; continue;}
+                    while(d!=p) {while(d>p) d=idom[d]; while(p>d) p=idom[p];}
+                }
+                if(d!=idom[b]) {idom[b]=d; changed=true;}
+            }
+        }
+    }
+
+    for(i=1;i<ir->num_instrs && !error;i++)
+    {
+        const IrInstr* in=&ir->instrs[i];
+        if(in->op==IR_NONE) continue;
+        where=i;
+        int num_ops = in->op==IR_CONST || in->op==IR_READ || in->op==IR_JUMP || in->op==IR_RETURN ? 0 :
+                      in->op==IR_PHI || (in->op>=IR_ADD && in->op<=IR_LT) || in->op==IR_STORE ? 2 : 1;
+        if(IrProgram::HasValue(in->op) != (in->type!=VOID)) {error="has the wrong type"; break;}
+        for(k=0;k<2 && !error;k++)
+        {
+            int v = k ? in->b : in->a;
+            if(k>=num_ops) {if(v) error="has an extra operand"; continue;}
+            if(v<=0 || v>=ir->num_instrs || !IrProgram::HasValue(ir->instrs[v].op)) {error="uses a value that isn't defined"; continue;}
+
+            // a phi uses its operand at the end of the predecessor
+            int use_block = in->op==IR_PHI ? ir->blocks[in->block].preds[k] : in->block;
+            int def_block=ir->instrs[v].block;
+            if(def_block==use_block)
+            {
+                if(in->op!=IR_PHI && order[v]>=order[i]) error="uses a value before it is defined";
+                continue;
+            }
+            int d=use_block;
+            while(d!=def_block && d!=0) d=idom[d];
+            if(d!=def_block) error="uses a value that doesn't dominate it";
+        }
+        if(error) break;
+
+        ExprDataType ta=in->a ? (ExprDataType)ir->instrs[in->a].type : VOID, tb=in->b ? (ExprDataType)ir->instrs[in->b].type : VOID;
+        if(in->op==IR_PHI && (ta!=in->type || tb!=in->type)) error="is a phi of values of another type";
+        else if((in->op==IR_EQ || in->op==IR_LT) && in->type!=BOOLEAN) error="is a comparison that isn't BOOLEAN";
+        else if(in->op>=IR_ADD && in->op<=IR_LT && (ta==BOOLEAN || tb==BOOLEAN)) error="does arithmetic on BOOLEAN";
+        else if(in->op==IR_BRANCH && ta!=BOOLEAN) error="branches on a value that isn't BOOLEAN";
+        else if((in->op==IR_LOAD || in->op==IR_STORE || in->op==IR_READ_ELEM) && ta!=INTEGER) error="has an index that isn't INTEGER";
+        else if(in->op==IR_TO_INT && in->type!=INTEGER) error="converts to a type that isn't INTEGER";
+    }
+
+    if(error)
+    {
+        if(where<0) printf("ERROR: IR block b%d %s\n", -where-1, error);
+        else printf("ERROR: IR value v%d (%s) in block b%d %s\n", where, IrOpStr[ir->instrs[where].op], ir->instrs[where].block, error);
+    }
+    delete[] order;
+    delete[] idom;
+    return !error;
+}
+
+// Numbers the positions of the blocks and gives each value the interval from its
+// definition to its last use, stretched to the end of each enclosing loop that uses it
+// but starts after it. A phi is defined at the start of its block, and its operands are
+// used at the end of the predecessors.
+void IrLiveIntervals(IrProgram* ir, int* start, int* end)
+{
+    int i, b, k;
+    int pos=0;
+    for(b=0;b<ir->num_blocks;b++)
+    {
+        IrBlock* bl=&ir->blocks[b];
+        bl->start=pos++;
+        for(i=bl->first_phi;i;i=ir->instrs[i].next) start[i]=end[i]=bl->start;
+        for(i=bl->first;i;i=ir->instrs[i].next) start[i]=end[i]=pos++;
+        bl->end=pos-1;
+    }
+
+    for(i=1;i<ir->num_instrs;i++)
+    {
+        const IrInstr* in=&ir->instrs[i];
+        if(in->op==IR_NONE) continue;
+        for(k=0;k<2;k++)
+        {
+            int v = k ? in->b : in->a;
+            if(!v) continue;
+            int use_block = in->op==IR_PHI ? ir->blocks[in->block].preds[k] : in->block;
+            int use = in->op==IR_PHI ? ir->blocks[use_block].end : start[i];
+            if(use>end[v]) end[v]=use;
+            int l;
+            for(l=ir->blocks[use_block].loop;l>=0 && ir->blocks[ir->loops[l].header].start>start[v];l=ir->loops[l].parent)
+                if(ir->blocks[ir->loops[l].latch].end>end[v]) end[v]=ir->blocks[ir->loops[l].latch].end;
+        }
+    }
+}
+
+// Linear scan (Poletto and Sarkar) over the blocks in layout order: in order of their
+// starts the values take a free register, and if there is none the one of them that
+// ends last is spilled to a slot of its own
+void AllocateRegisters(IrProgram* ir)
+{
+    int n=ir->num_instrs, i, b, k;
+    int* start=new int[n];
+    int* end=new int[n];
+    IrLiveIntervals(ir, start, end);
+
+    int active[IR_NUM_REGS]; // values in registers
+    int num_active=0;
+    ir->num_spill_slots=0;
+    ir->num_regs_used=0;
+    for(b=0;b<ir->num_blocks;b++)
+    {
+        const IrBlock* bl=&ir->blocks[b];
+        int pass;
+        for(pass=0;pass<2;pass++) for(i=pass ? bl->first : bl->first_phi;i;i=ir->instrs[i].next)
+        {
+            if(!IrProgram::HasValue(ir->instrs[i].op)) continue;
+            bool used[IR_NUM_REGS]={false};
+            int j=0;
+            for(k=0;k<num_active;k++)
+            {
+                if(end[active[k]]<start[i]) continue;
+                active[j++]=active[k];
+                used[ir->instrs[active[k]].loc]=true;
+            }
+            num_active=j;
+
+            int r=0;
+            while(r<IR_NUM_REGS && used[r]) r++;
+            if(r<IR_NUM_REGS)
+            {
+                ir->instrs[i].loc=r;
+                active[num_active++]=i;
+                if(r+1>ir->num_regs_used) ir->num_regs_used=r+1;
+                continue;
+            }
+            int last=0;
+            for(k=1;k<num_active;k++) if(end[active[k]]>end[active[last]]) last=k;
+            int slot=IR_NUM_REGS+ir->num_spill_slots++;
+            if(end[active[last]]>end[i])
+            {
+                ir->instrs[i].loc=ir->instrs[active[last]].loc;
+                ir->instrs[active[last]].loc=slot;
+                active[last]=i;
+            }
+            else ir->instrs[i].loc=slot;
+        }
+    }
+    delete[] start;
+    delete[] end;
+}
+
+// Checks that no two values that live at the same time share a register
+bool VerifyAllocation(IrProgram* ir)
+{
+    int n=ir->num_instrs, i, k, b;
+    int* start=new int[n];
+    int* end=new int[n];
+    IrLiveIntervals(ir, start, end);
+
+    int holder[IR_NUM_REGS]; // value last given each register
+    for(k=0;k<IR_NUM_REGS;k++) holder[k]=0;
+    bool ok=true;
+    for(b=0;b<ir->num_blocks && ok;b++)
+    {
+        const IrBlock* bl=&ir->blocks[b];
+        int pass;
+        for(pass=0;pass<2 && ok;pass++) for(i=pass ? bl->first : bl->first_phi;i && ok;i=ir->instrs[i].next)
+        {
+            const IrInstr* in=&ir->instrs[i];
+            if(!IrProgram::HasValue(in->op)) continue;
+            if(in->loc<0) {printf("ERROR: IR value v%d has no location\n", i); ok=false;}
+            else if(in->loc<IR_NUM_REGS)
+            {
+                int h=holder[in->loc];
+                if(h && end[h]>=start[i]) {printf("ERROR: IR values v%d and v%d live at the same time in r%d\n", h, i, in->loc); ok=false;}
+                holder[in->loc]=i;
+            }
+        }
+    }
+    delete[] start;
+    delete[] end;
+    return ok;
+}
+
+// Lays the blocks out as the steps of RunIr. The phis have no steps, their values are
+// copied on the edges into their blocks.
+void FinalizeIr(IrProgram* ir)
+{
+    int b, i, k;
+    int* block_step=new int[ir->num_blocks];
+    int num_phis=0;
+    ir->num_steps=0;
+    for(b=0;b<ir->num_blocks;b++)
+    {
+        block_step[b]=ir->num_steps;
+        for(i=ir->blocks[b].first;i;i=ir->instrs[i].next) ir->num_steps++;
+        for(i=ir->blocks[b].first_phi;i;i=ir->instrs[i].next) num_phis++;
+    }
+    ir->steps=new IrStep[ir->num_steps];
+    ir->edges=new IrEdge[2*ir->num_blocks];
+    ir->copies=new int[2*IR_MAX_PREDS*num_phis+1];
+    ir->num_edges=ir->num_copies=ir->max_edge_copies=0;
+
+    IrStep* s=ir->steps;
+    for(b=0;b<ir->num_blocks;b++)
+    {
+        const IrBlock* bl=&ir->blocks[b];
+        for(i=bl->first;i;i=ir->instrs[i].next,s++)
+        {
+            const IrInstr* in=&ir->instrs[i];
+            s->op=in->op; s->type=in->type;
+            s->dst=in->loc;
+            s->a = in->a ? ir->instrs[in->a].loc : -1;
+            s->b = in->b ? ir->instrs[in->b].loc : -1;
+            s->aux=in->memloc; s->aux2=-1;
+            s->num=in->num;
+            s->node=in->node;
+            if(in->op!=IR_JUMP && in->op!=IR_BRANCH) continue;
+
+            for(k=0;k<bl->num_succs;k++)
+            {
+                int succ=bl->succs[k];
+                IrEdge* e=&ir->edges[ir->num_edges];
+                e->target=block_step[succ];
+                e->back=succ<=b;
+                e->line_num=in->node ? in->node->line_num : 0;
+                e->first_copy=ir->num_copies;
+                int p=ir->blocks[succ].preds[0]==b ? 0 : 1, phi;
+                for(phi=ir->blocks[succ].first_phi;phi;phi=ir->instrs[phi].next)
+                {
+                    int src=ir->instrs[p ? ir->instrs[phi].b : ir->instrs[phi].a].loc, dst=ir->instrs[phi].loc;
+                    if(src==dst) continue;
+                    ir->copies[2*ir->num_copies]=src;
+                    ir->copies[2*ir->num_copies+1]=dst;
+                    ir->num_copies++;
+                }
+                e->num_copies=ir->num_copies-e->first_copy;
+                if(e->num_copies>ir->max_edge_copies) ir->max_edge_copies=e->num_copies;
+                if(k) s->aux2=ir->num_edges++;
+                else s->aux=ir->num_edges++;
+            }
+        }
+    }
+    delete[] block_step;
+}
+
+// Lowers, verifies and allocates, returns false with the problem printed if a check fails
+bool BuildIr(TreeNode* syntax_tree, SymbolTable* symbol_table, IrProgram* ir)
+{
+    LowerToIr(syntax_tree, symbol_table, ir);
+    if(!VerifyIr(ir)) return false;
+    AllocateRegisters(ir);
+    if(!VerifyAllocation(ir)) return false;
+    FinalizeIr(ir);
+    return true;
+}
+
+void PrintIrLoc(int loc)
+{
+    if(loc<0) printf("\n");
+    else if(loc<IR_NUM_REGS) printf("  ; r%d\n", loc);
+    else printf("  ; s%d\n", loc-IR_NUM_REGS);
+}
+
+void PrintIr(const IrProgram* ir, const SymbolTable* symbol_table)
+{
+    const char* type_str[]={"void", "int", "real", "bool"};
+    printf("%d blocks, %d values, %d loops, %d of %d registers used, %d spilled\n",
+           ir->num_blocks, ir->num_values, ir->num_loops, ir->num_regs_used, IR_NUM_REGS, ir->num_spill_slots);
+    int b, i, k;
+    for(b=0;b<ir->num_blocks;b++)
+    {
+        const IrBlock* bl=&ir->blocks[b];
+        printf("b%d:", b);
+        if(bl->num_preds) printf(" preds");
+        for(k=0;k<bl->num_preds;k++) printf(" b%d", bl->preds[k]);
+        if(bl->loop>=0) printf(" loop %d", bl->loop);
+        printf("\n");
+        for(i=bl->first_phi;i;i=ir->instrs[i].next)
+        {
+            const IrInstr* in=&ir->instrs[i];
+            printf("  v%d %s = phi v%d (b%d), v%d (b%d) [%s]", i, type_str[in->type], in->a, bl->preds[0], in->b, bl->preds[1], symbol_table->vars[in->memloc].name);
+            PrintIrLoc(in->loc);
+        }
+        for(i=bl->first;i;i=ir->instrs[i].next)
+        {
+            const IrInstr* in=&ir->instrs[i];
+            const char* name = in->memloc>=0 ? symbol_table->vars[in->memloc].name : "";
+            if(IrProgram::HasValue(in->op)) printf("  v%d %s = ", i, type_str[in->type]);
+            else printf("  ");
+            switch(in->op)
+            {
+            case IR_CONST: printf("const %g", in->num); break;
+            case IR_TO_INT: printf("to_int v%d", in->a); break;
+            case IR_LOAD: printf("load %s[v%d]", name, in->a); break;
+            case IR_STORE: printf("store %s[v%d], v%d", name, in->a, in->b); break;
+            case IR_READ: printf("read %s", name); break;
+            case IR_READ_ELEM: printf("read %s[v%d]", name, in->a); break;
+            case IR_WRITE: printf("write v%d", in->a); break;
+            case IR_JUMP: printf("jump b%d", bl->succs[0]); break;
+            case IR_BRANCH: printf("branch v%d, b%d, b%d", in->a, bl->succs[0], bl->succs[1]); break;
+            case IR_RETURN: printf("return"); break;
+            default: printf("%s v%d, v%d", IrOpStr[in->op], in->a, in->b); break;
+            }
+            PrintIrLoc(in->loc);
+        }
+    }
+}
+
+inline int IrTakeEdge(const IrProgram* ir, int edge, double* r, double* tmp, RunInfo* pri)
+{
+    const IrEdge* e=&ir->edges[edge];
+    if(e->back) BackEdge(pri, e->line_num);
+    const int* c=&ir->copies[2*e->first_copy];
+    int k;
+    if(e->num_copies==1) r[c[1]]=r[c[0]];
+    else if(e->num_copies)
+    {
+        // a parallel copy, a phi may be the operand of another
+        for(k=0;k<e->num_copies;k++) tmp[k]=r[c[2*k]];
+        for(k=0;k<e->num_copies;k++) r[c[2*k+1]]=tmp[k];
+    }
+    return e->target;
+}
+
+// Runs the program from the steps of ir, the output is that of RunProgram
+void RunIr(const IrProgram* ir, SymbolTable* symbol_table, RunInfo* pri)
+{
+    Variable* variables=new Variable[symbol_table->num_vars];
+    InitVariables(symbol_table, variables); // for the arrays
+    double* r=new double[IR_NUM_REGS+ir->num_spill_slots+ir->max_edge_copies]();
+    double* tmp=r+IR_NUM_REGS+ir->num_spill_slots;
+
+    try {
+        int pc=0;
+        for(;;)
+        {
+            const IrStep* s=&ir->steps[pc++];
+            switch(s->op)
+            {
+            case IR_CONST: r[s->dst]=s->num; break;
+            case IR_ADD: r[s->dst]=r[s->a]+r[s->b]; break;
+            case IR_SUB: r[s->dst]=r[s->a]-r[s->b]; break;
+            case IR_MUL: r[s->dst]=r[s->a]*r[s->b]; break;
+            case IR_DIV: r[s->dst]=r[s->a]/r[s->b]; break;
+            case IR_POW: r[s->dst]=pow(r[s->a], r[s->b]); break;
+            case IR_AND: r[s->dst]=r[s->a]*r[s->a]-r[s->b]*r[s->b]; break;
+            case IR_EQ: r[s->dst]=r[s->a]==r[s->b] ? 1.0 : 0.0; break;
+            case IR_LT: r[s->dst]=r[s->a]<r[s->b] ? 1.0 : 0.0; break;
+            case IR_TO_INT: r[s->dst]=(int)r[s->a]; break;
+            case IR_LOAD:
+            {
+                const Variable* var=&variables[s->aux];
+                r[s->dst]=ElementValue(var, ElementIndex(var, s->node, r[s->a], pri));
+                break;
+            }
+            case IR_STORE:
+            {
+                Variable* var=&variables[s->aux];
+                SetElement(var, ElementIndex(var, s->node, r[s->a], pri), r[s->b]);
+                break;
+            }
+            case IR_READ:
+            {
+                Variable var;
+                var.type=(ExprDataType)s->type;
+                ReadValue(pri, s->node->id, s->node->line_num, &var);
+                r[s->dst] = var.type==REAL ? var.real_val : var.type==INTEGER ? var.int_val : var.bool_val ? 1.0 : 0.0;
+                break;
+            }
+            case IR_READ_ELEM:
+            {
+                Variable* var=&variables[s->aux];
+                int i=ElementIndex(var, s->node, r[s->a], pri);
+                Variable element;
+                element.type=var->type;
+                ReadValue(pri, s->node->id, s->node->line_num, &element);
+                SetElement(var, i, element.type == REAL ? element.real_val : element.type == INTEGER ? element.int_val : element.bool_val);
+                break;
+            }
+            case IR_WRITE: WriteValue(pri, s->node->child[0]->expr_data_type, r[s->a], s->node->line_num); break;
+            case IR_JUMP: pc=IrTakeEdge(ir, s->aux, r, tmp, pri); break;
+            case IR_BRANCH: pc=IrTakeEdge(ir, r[s->a]!=0.0 ? s->aux : s->aux2, r, tmp, pri); break;
+            case IR_RETURN: pc=-1; break;
+            }
+            if(pc<0) break;
+        }
+    }
+    catch(...) {
+        delete[] r;
+        FreeVariables(symbol_table, variables);
+        throw;
+    }
+    delete[] r;
+    FreeVariables(symbol_table, variables);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Input Records ///////////////////////////////////////////////////////////////////
+
+// A file of independent input records, one per line. Each record holds the values
+// consumed by the read statements of one run of the program.
+struct RecordSet
+{
+    InputSource file;
+    int num_records;
+    const char** starts;
+    const char** ends;
+
+    RecordSet() {num_records=0; starts=ends=0;}
+    ~RecordSet() {if(starts) delete[] starts; if(ends) delete[] ends;}
+
+    bool Load(const char* str)
+    {
+        if(!file.Open(str)) return false;
+        const char* p;
+        int capacity=1024;
+        starts=new const char*[capacity]; ends=new const char*[capacity];
+        for(p=file.cur;p<file.end;)
+        {
+            const char* q=(const char*)memchr(p, '\n', file.end-p);
+            if(!q) q=file.end;
+            if(num_records==capacity)
+            {
+                const char** new_starts=new const char*[2*capacity];
+                const char** new_ends=new const char*[2*capacity];
+                memcpy(new_starts, starts, capacity*sizeof(char*)); memcpy(new_ends, ends, capacity*sizeof(char*));
+                delete[] starts; delete[] ends;
+                starts=new_starts; ends=new_ends; capacity*=2;
+            }
+            starts[num_records]=p; ends[num_records]=q; num_records++;
+            p=q+1;
+        }
+        return true;
+    }
+};
+
+// Runs records [first, last) one at a time with RunProgram, appending their output in order.
+// A runtime error stops only the record that caused it.
+void RunRecordsScalar(TreeNode* syntax_tree, SymbolTable* symbol_table, RecordSet* records, int first, int last,
+                      OutBuffer* out, RunLimits* limits)
+{
+    int k;
+    Variable* variables = new Variable[symbol_table->num_vars];
+    InputSource input;
+    RunInfo run_info;
+    run_info.input=&input;
+    run_info.output=out;
+    run_info.limits=limits;
+
+    for(k=first;k<last;k++)
+    {
+        InitVariables(symbol_table, variables);
+        run_info.StartRun();
+        input.SetBuffer(records->starts[k], records->ends[k]-records->starts[k]);
+        try {
+            RunProgram(syntax_tree, symbol_table, variables, &run_info);
+        }
+        catch(const char*) {
+        }
+    }
+    delete[] variables;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Batch Execution /////////////////////////////////////////////////////////////////
+
+// Runs BATCH_SIZE records in lockstep over a struct of arrays copy of the variables.
+// Lane l of the variable at memloc is vals[memloc*BATCH_SIZE+l], stored as a double like
+// EvaluateReal computes it. if and repeat are handled with per lane masks (1.0 for an
+// active lane, 0.0 otherwise). Arithmetic uses AVX when the compiler targets it
+// (-mavx2 or -march=native), SSE2 otherwise.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+typedef __m256d VecD;
+const int VEC_WIDTH=4;
+inline VecD VSet(double x) {return _mm256_set1_pd(x);}
+inline VecD VLoad(const double* p) {return _mm256_load_pd(p);}
+inline void VStore(double* p, VecD v) {_mm256_store_pd(p, v);}
+inline VecD VAdd(VecD a, VecD b) {return _mm256_add_pd(a, b);}
+inline VecD VSub(VecD a, VecD b) {return _mm256_sub_pd(a, b);}
+inline VecD VMul(VecD a, VecD b) {return _mm256_mul_pd(a, b);}
+inline VecD VDiv(VecD a, VecD b) {return _mm256_div_pd(a, b);}
+inline VecD VAnd(VecD a, VecD b) {return _mm256_and_pd(a, b);}
+inline VecD VAndNot(VecD a, VecD b) {return _mm256_andnot_pd(a, b);} // ~a & b
+inline VecD VEqual(VecD a, VecD b) {return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ), VSet(1.0));}
+inline VecD VLess(VecD a, VecD b) {return _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ), VSet(1.0));}
+inline VecD VNonZero(VecD a) {return _mm256_and_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_NEQ_UQ), VSet(1.0));}
+inline VecD VTrunc(VecD a) {return _mm256_round_pd(a, _MM_FROUND_TO_ZERO|_MM_FROUND_NO_EXC);}
+inline VecD VSelect(VecD mask, VecD a, VecD b) {return _mm256_blendv_pd(b, a, _mm256_cmp_pd(mask, _mm256_setzero_pd(), _CMP_NEQ_UQ));}
+inline bool VAny(VecD a) {return _mm256_movemask_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_NEQ_UQ))!=0;}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+typedef __m128d VecD;
+const int VEC_WIDTH=2;
+inline VecD VSet(double x) {return _mm_set1_pd(x);}
+inline VecD VLoad(const double* p) {return _mm_load_pd(p);}
+inline void VStore(double* p, VecD v) {_mm_store_pd(p, v);}
+inline VecD VAdd(VecD a, VecD b) {return _mm_add_pd(a, b);}
+inline VecD VSub(VecD a, VecD b) {return _mm_sub_pd(a, b);}
+inline VecD VMul(VecD a, VecD b) {return _mm_mul_pd(a, b);}
+inline VecD VDiv(VecD a, VecD b) {return _mm_div_pd(a, b);}
+inline VecD VAnd(VecD a, VecD b) {return _mm_and_pd(a, b);}
+inline VecD VAndNot(VecD a, VecD b) {return _mm_andnot_pd(a, b);} // ~a & b
+inline VecD VEqual(VecD a, VecD b) {return _mm_and_pd(_mm_cmpeq_pd(a, b), VSet(1.0));}
+inline VecD VLess(VecD a, VecD b) {return _mm_and_pd(_mm_cmplt_pd(a, b), VSet(1.0));}
+inline VecD VNonZero(VecD a) {return _mm_and_pd(_mm_cmpneq_pd(a, _mm_setzero_pd()), VSet(1.0));}
+#if defined(__SSE4_1__)
+inline VecD VTrunc(VecD a) {return _mm_round_pd(a, _MM_FROUND_TO_ZERO|_MM_FROUND_NO_EXC);}
+#else
+inline VecD VTrunc(VecD a) {double t[2]; _mm_storeu_pd(t, a); return _mm_set_pd(trunc(t[1]), trunc(t[0]));}
+#endif
+inline VecD VSelect(VecD mask, VecD a, VecD b) {VecD m=_mm_cmpneq_pd(mask, _mm_setzero_pd()); return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));}
+inline bool VAny(VecD a) {return _mm_movemask_pd(_mm_cmpneq_pd(a, _mm_setzero_pd()))!=0;}
+#else
+typedef double VecD;
+const int VEC_WIDTH=1;
+inline VecD VSet(double x) {return x;}
+inline VecD VLoad(const double* p) {return *p;}
+inline void VStore(double* p, VecD v) {*p=v;}
+inline VecD VAdd(VecD a, VecD b) {return a+b;}
+inline VecD VSub(VecD a, VecD b) {return a-b;}
+inline VecD VMul(VecD a, VecD b) {return a*b;}
+inline VecD VDiv(VecD a, VecD b) {return a/b;}
+inline VecD VAnd(VecD a, VecD b) {return (a!=0.0 && b!=0.0) ? 1.0 : 0.0;}
+inline VecD VAndNot(VecD a, VecD b) {return (a==0.0 && b!=0.0) ? 1.0 : 0.0;}
+inline VecD VEqual(VecD a, VecD b) {return (a==b) ? 1.0 : 0.0;}
+inline VecD VLess(VecD a, VecD b) {return (a<b) ? 1.0 : 0.0;}
+inline VecD VNonZero(VecD a) {return (a!=0.0) ? 1.0 : 0.0;}
+inline VecD VTrunc(VecD a) {return trunc(a);}
+inline VecD VSelect(VecD mask, VecD a, VecD b) {return (mask!=0.0) ? a : b;}
+inline bool VAny(VecD a) {return a!=0.0;}
+#endif
+
+const int BATCH_SIZE=64; // must be a multiple of VEC_WIDTH
+
+struct BatchInfo
+{
+    SymbolTable* symbol_table;
+    bool has_limits; // count the back-edges of every lane
+    double* vals;
+    alignas(32) double alive[BATCH_SIZE]; // 0.0 for unused lanes and lanes stopped by a runtime error
+
+    InputSource inputs[BATCH_SIZE];
+    OutBuffer outputs[BATCH_SIZE];
+    RunInfo lane_run[BATCH_SIZE];
+};
+
+bool AnyLane(const double* mask)
+{
+    int l;
+    for(l=0;l<BATCH_SIZE;l+=VEC_WIDTH) if(VAny(VLoad(mask+l))) return true;
+    return false;
+}
+
+// Returns the lanes of the value of node, either in tmp or directly in the variable storage
+const double* EvaluateBatch(TreeNode* node, BatchInfo* pbi, double* tmp)
+{
+    int l;
+    if(node->node_kind == NUM_NODE) {
+        VecD v = VSet(node->expr_data_type == REAL ? node->real_num : (double)node->num);
+        for(l=0;l<BATCH_SIZE;l+=VEC_WIDTH) VStore(tmp+l, v);
+        return tmp;
+    }
+
+    if(node->node_kind == ID_NODE) {
+        int memloc = pbi->symbol_table->Find(node->id)->memloc;
+        return pbi->vals+memloc*BATCH_SIZE;
+    }
+
+    alignas(32) double ta[BATCH_SIZE];
+    alignas(32) double tb[BATCH_SIZE];
+    const double* a = EvaluateBatch(node->child[0], pbi, ta);
+    const double* b = EvaluateBatch(node->child[1], pbi, tb);
+
+    if(node->oper == POWER) {
+        for(l=0;l<BATCH_SIZE;l++) tmp[l] = pow(a[l], b[l]);
+        return tmp;
+    }
+
+    for(l=0;l<BATCH_SIZE;l+=VEC_WIDTH)
+    {
+        VecD va = VLoad(a+l), vb = VLoad(b+l), r;
+        if(node->oper == EQUAL) r = VEqual(va, vb);
+        else if(node->oper == LESS_THAN) r = VLess(va, vb);
+        else if(node->oper == PLUS) r = VAdd(va, vb);
+        else if(node->oper == MINUS) r = VSub(va, vb);
+        else if(node->oper == TIMES) r = VMul(va, vb);
+        else if(node->oper == DIVIDE) r = VDiv(va, vb);
+        else if(node->oper == AND_OPER) r = VSub(VMul(va, va), VMul(vb, vb));
+        else r = VSet(0.0);
+        VStore(tmp+l, r);
+    }
+    return tmp;
+}
+
+void RunBatch(TreeNode* node, BatchInfo* pbi, const double* mask_in)
+{
+    int l;
+    alignas(32) double mask[BATCH_SIZE];
+    alignas(32) double tmp[BATCH_SIZE];
+
+    for(;node;node=node->sibling)
+    {
+        if(node->node_kind == DECLARE_NODE) continue;
+
+        for(l=0;l<BATCH_SIZE;l+=VEC_WIDTH) VStore(mask+l, VAnd(VLoad(mask_in+l), VLoad(pbi->alive+l)));
+        if(!AnyLane(mask)) return;
+
+        if(node->node_kind == IF_NODE)
+        {
+            alignas(32) double then_mask[BATCH_SIZE];
+            alignas(32) double else_mask[BATCH_SIZE];
+            const double* c = EvaluateBatch(node->child[0], pbi, tmp);
+            for(l=0;l<BATCH_SIZE;l+=VEC_WIDTH)
+            {
+                VecD m = VLoad(mask+l), nz = VNonZero(VLoad(c+l));
+                VStore(then_mask+l, VAnd(m, nz));
+                VStore(else_mask+l, VAndNot(nz, m));
+            }
+            if(AnyLane(then_mask)) RunBatch(node->child[1], pbi, then_mask);
+            if(node->child[2] && AnyLane(else_mask)) RunBatch(node->child[2], pbi, else_mask);
+        }
+        else if(node->node_kind == ASSIGN_NODE)
+        {
+            VariableInfo* var_info = pbi->symbol_table->Find(node->id);
+            double* row = pbi->vals+var_info->memloc*BATCH_SIZE;
+            const double* r = EvaluateBatch(node->child[0], pbi, tmp);
+            for(l=0;l<BATCH_SIZE;l+=VEC_WIDTH)
+            {
+                VecD v = VLoad(r+l);
+                if(var_info->var_type == INTEGER) v = VTrunc(v);
+                else if(var_info->var_type == BOOLEAN) v = VNonZero(v);
+                VStore(row+l, VSelect(VLoad(mask+l), v, VLoad(row+l)));
+            }
+        }
+        else if(node->node_kind == READ_NODE)
+        {
+            VariableInfo* var_info = pbi->symbol_table->Find(node->id);
+            double* row = pbi->vals+var_info->memloc*BATCH_SIZE;
+            for(l=0;l<BATCH_SIZE;l++)
+            {
+                if(mask[l]==0.0) continue;
+                Variable var;
+                var.type = var_info->var_type;
+                try {
+                    ReadValue(&pbi->lane_run[l], node->id, node->line_num, &var);
+                }
+                catch(const char*) {
+                    pbi->alive[l] = 0.0;
+                    continue;
+                }
+                if(var.type == REAL) row[l] = var.real_val;
+                else if(var.type == INTEGER) row[l] = var.int_val;
+                else row[l] = var.bool_val ? 1.0 : 0.0;
+            }
+        }
+        else if(node->node_kind == WRITE_NODE)
+        {
+            const double* r = EvaluateBatch(node->child[0], pbi, tmp);
+            for(l=0;l<BATCH_SIZE;l++)
+            {
+                if(mask[l]==0.0) continue;
+                try {
+                    WriteValue(&pbi->lane_run[l], node->child[0]->expr_data_type, r[l], node->line_num);
+                }
+                catch(const char*) {
+                    pbi->alive[l] = 0.0;
+                }
+            }
+        }
+        else if(node->node_kind == REPEAT_NODE)
+        {
+            // lanes leave the loop one by one, the loop ends when no lane is left
+            alignas(32) double loop_mask[BATCH_SIZE];
+            memcpy(loop_mask, mask, sizeof(loop_mask));
+            do {
+                RunBatch(node->child[0], pbi, loop_mask);
+                const double* c = EvaluateBatch(node->child[1], pbi, tmp);
+                for(l=0;l<BATCH_SIZE;l+=VEC_WIDTH)
+                    VStore(loop_mask+l, VAnd(VAndNot(VNonZero(VLoad(c+l)), VLoad(loop_mask+l)), VLoad(pbi->alive+l)));
+                if(pbi->has_limits)
+                {
+                    for(l=0;l<BATCH_SIZE;l++)
+                    {
+                        if(loop_mask[l]==0.0) continue;
+                        try {
+                            BackEdge(&pbi->lane_run[l], node->line_num);
+                        }
+                        catch(const char*) {
+                            pbi->alive[l] = loop_mask[l] = 0.0;
+                        }
+                    }
+                }
+            } while(AnyLane(loop_mask));
+        }
+    }
+}
+
+// Runs records [first, last) BATCH_SIZE at a time, appending their output in order
+void RunRecordsBatch(TreeNode* syntax_tree, SymbolTable* symbol_table, RecordSet* records, int first, int last,
+                     OutBuffer* out, RunLimits* limits)
+{
+    int k, l;
+    BatchInfo* pbi = new BatchInfo;
+    pbi->symbol_table = symbol_table;
+    pbi->has_limits = (limits != 0);
+    int vals_size = symbol_table->num_vars*BATCH_SIZE;
+    pbi->vals = (double*)aligned_alloc(32, (vals_size ? vals_size : 1)*sizeof(double));
+
+    for(l=0;l<BATCH_SIZE;l++)
+    {
+        pbi->lane_run[l].input = &pbi->inputs[l];
+        pbi->lane_run[l].output = &pbi->outputs[l];
+        pbi->lane_run[l].limits = limits;
+    }
+
+    for(k=first;k<last;k+=BATCH_SIZE)
+    {
+        int num_lanes = (last-k<BATCH_SIZE) ? last-k : BATCH_SIZE;
+        // all variables start as zero, which is also false for bool
+        for(l=0;l<vals_size;l++) pbi->vals[l] = 0.0;
+        for(l=0;l<BATCH_SIZE;l++)
+        {
+            pbi->alive[l] = (l<num_lanes) ? 1.0 : 0.0;
+            pbi->outputs[l].Clear();
+            pbi->lane_run[l].StartRun();
+            if(l<num_lanes) pbi->inputs[l].SetBuffer(records->starts[k+l], records->ends[k+l]-records->starts[k+l]);
+        }
+
+        RunBatch(syntax_tree, pbi, pbi->alive);
+
+        for(l=0;l<num_lanes;l++) out->Append(pbi->outputs[l].buf, pbi->outputs[l].size);
+    }
+
+    free(pbi->vals);
+    delete pbi;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Parallel Records ////////////////////////////////////////////////////////////////
+
+// The records are split in chunks of RECORD_CHUNK_SIZE. Each worker starts with a
+// contiguous range of chunks in its own deque, takes chunks from its front and when it
+// runs out steals from the back of the other workers' deques, so a worker that got the
+// records with long loops doesn't leave the others idle. Every chunk has its own output
+// buffer, merged in chunk order at the end.
+
+const int RECORD_CHUNK_SIZE=256;
+
+struct WorkDeque
+{
+    mutex lock;
+    int* items;
+    int head, tail; // items[head..tail-1] are left
+
+    WorkDeque() {items=0; head=tail=0;}
+    ~WorkDeque() {if(items) delete[] items;}
+
+    bool PopFront(int* item)
+    {
+        lock_guard<mutex> guard(lock);
+        if(head==tail) return false;
+        *item=items[head++];
+        return true;
+    }
+
+    bool StealBack(int* item)
+    {
+        lock_guard<mutex> guard(lock);
+        if(head==tail) return false;
+        *item=items[--tail];
+        return true;
+    }
+};
+
+struct ParallelRecordsInfo
+{
+    TreeNode* syntax_tree;
+    SymbolTable* symbol_table;
+    RecordSet* records;
+    int num_workers;
+    WorkDeque* deques;
+    OutBuffer* chunk_outputs;
+    RunLimits* limits;
+    atomic<int> num_steals;
+};
+
+void RecordsWorker(ParallelRecordsInfo* ppri, int id)
+{
+    int chunk;
+    while(true)
+    {
+        if(!ppri->deques[id].PopFront(&chunk))
+        {
+            int i;
+            bool found=false;
+            for(i=1;i<ppri->num_workers && !found;i++)
+                found=ppri->deques[(id+i)%ppri->num_workers].StealBack(&chunk);
+            if(!found) return; // no work is created while running, so all the deques are empty
+            ppri->num_steals++;
+        }
+
+        int first=chunk*RECORD_CHUNK_SIZE;
+        int last=first+RECORD_CHUNK_SIZE;
+        if(last>ppri->records->num_records) last=ppri->records->num_records;
+        RunRecordsScalar(ppri->syntax_tree, ppri->symbol_table, ppri->records, first, last, &ppri->chunk_outputs[chunk], ppri->limits);
+    }
+}
+
+// Returns the number of chunks stolen
+int RunRecordsParallel(TreeNode* syntax_tree, SymbolTable* symbol_table, RecordSet* records, int num_workers,
+                       OutBuffer* out, RunLimits* limits)
+{
+    int i, w;
+    int num_chunks=(records->num_records+RECORD_CHUNK_SIZE-1)/RECORD_CHUNK_SIZE;
+
+    ParallelRecordsInfo pri;
+    pri.syntax_tree=syntax_tree;
+    pri.symbol_table=symbol_table;
+    pri.records=records;
+    pri.num_workers=num_workers;
+    pri.deques=new WorkDeque[num_workers];
+    pri.chunk_outputs=new OutBuffer[num_chunks];
+    pri.limits=limits;
+    pri.num_steals=0;
+
+    for(w=0;w<num_workers;w++)
+    {
+        WorkDeque* d=&pri.deques[w];
+        int first=(long long)num_chunks*w/num_workers, last=(long long)num_chunks*(w+1)/num_workers;
+        d->items=new int[last-first+1];
+        for(i=first;i<last;i++) d->items[d->tail++]=i;
+    }
+
+    thread* workers=new thread[num_workers];
+    for(w=1;w<num_workers;w++) workers[w]=thread(RecordsWorker, &pri, w);
+    RecordsWorker(&pri, 0);
+    for(w=1;w<num_workers;w++) workers[w].join();
+
+    for(i=0;i<num_chunks;i++) out->Append(pri.chunk_outputs[i].buf, pri.chunk_outputs[i].size);
+
+    delete[] workers;
+    delete[] pri.chunk_outputs;
+    delete[] pri.deques;
+    return pri.num_steals;
+}
+
+int NumCores()
+{
+    int n=thread::hardware_concurrency();
+    return n>0 ? n : 1;
+}
+
+// Runs the records with 1, 2, 4, ... workers up to the number of cores
+void BenchRecordsParallel(TreeNode* syntax_tree, SymbolTable* symbol_table, RecordSet* records, RunLimits* limits)
+{
+    int n, max_workers=NumCores();
+    double base_time=0;
+    OutBuffer base_out;
+
+    printf("%d records, %d cores, chunks of %d records\n", records->num_records, max_workers, RECORD_CHUNK_SIZE);
+    for(n=1;;n*=2)
+    {
+        if(n>max_workers) n=max_workers;
+        OutBuffer out;
+        double t0=GetTime();
+        int num_steals=RunRecordsParallel(syntax_tree, symbol_table, records, n, &out, limits);
+        double t=GetTime()-t0;
+        if(n==1) {base_time=t; base_out.Append(out.buf, out.size);}
+        bool same=(out.size==base_out.size && memcmp(out.buf, base_out.buf, out.size)==0);
+        printf("%3d workers: %.3f s, %.0f records/s, speedup %.2f, %d steals, output %s\n",
+               n, t, records->num_records/t, base_time/t, num_steals, same ? "matches" : "DIFFERS");
+        if(n==max_workers) break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Sessions ////////////////////////////////////////////////////////////////////////
+
+// Many runs of one program interleaved on one thread. A session keeps the state that
+// RunProgram keeps on the C++ stack as an explicit stack of frames over the flat tree,
+// so it can stop at a read with no input yet and continue later where it left off.
+// A session is its variables, a frame per open statement list or repeat loop, and
+// its own input and output.
+enum SessionState {SESSION_READY, SESSION_WAITING, SESSION_DONE};
+
+// node is a SEQ_NODE, next is the next statement to run (FLAT_NONE at the end).
+// node is a REPEAT_NODE, next is 0 before the first run of the body, 1 after a run.
+struct SessionFrame
+{
+    unsigned int node;
+    unsigned int next;
+};
+
+struct Session
+{
+    SessionState state;
+    bool input_closed; // no more input will come, a read past the end is an error
+    int depth;
+    Variable* variables;
+    SessionFrame* frames; // allocated together with variables
+    InputSource input; // the input received so far
+    OutBuffer output;
+    RunInfo run_info;
+};
+
+// Deepest frame stack a run of the flat tree below n can need
+int SessionDepth(FlatTree* ft, unsigned int n)
+{
+    int max_depth=0;
+    unsigned int c;
+    for(c=ft->first_child[n];c!=FLAT_NONE;c=ft->next_sibling[c])
+    {
+        int d=SessionDepth(ft, c);
+        if(d>max_depth) max_depth=d;
+    }
+    if(ft->kind[n]==SEQ_NODE || ft->kind[n]==REPEAT_NODE) max_depth++;
+    return max_depth;
+}
+
+struct SessionScheduler
+{
+    FlatTree* ft;
+    SymbolTable* symbol_table;
+    RunLimits* limits;
+    int max_depth;
+
+    Session* sessions;
+    int num_sessions;
+    int num_done;
+
+    int* ready; // circular queue of ready sessions
+    int ready_head, num_ready;
+
+    long long num_switches;
+
+    SessionScheduler(FlatTree* _ft, SymbolTable* _symbol_table, RunLimits* _limits, int n)
+    {
+        int i;
+        ft=_ft; symbol_table=_symbol_table; limits=_limits;
+        max_depth=SessionDepth(ft, 1);
+        num_sessions=n; num_done=0;
+        sessions=new Session[n];
+        ready=new int[n]; ready_head=num_ready=0;
+        num_switches=0;
+
+        int num_vars=symbol_table->num_vars;
+        for(i=0;i<n;i++)
+        {
+            Session* ss=&sessions[i];
+            char* mem=new char[num_vars*sizeof(Variable)+max_depth*sizeof(SessionFrame)];
+            ss->variables=(Variable*)mem;
+            ss->frames=(SessionFrame*)(mem+num_vars*sizeof(Variable));
+            InitVariables(symbol_table, ss->variables);
+            ss->frames[0].node=1; ss->frames[0].next=ft->first_child[1];
+            ss->depth=1;
+            ss->input_closed=false;
+            ss->input.SetBuffer("", 0);
+            ss->run_info.input=&ss->input;
+            ss->run_info.output=&ss->output;
+            ss->run_info.limits=limits;
+            ss->run_info.StartRun();
+            ss->state=SESSION_READY;
+            Push(i);
+        }
+    }
+
+    ~SessionScheduler()
+    {
+        int i;
+        for(i=0;i<num_sessions;i++) delete[] (char*)sessions[i].variables;
+        delete[] sessions;
+        delete[] ready;
+    }
+
+    void Push(int k) {ready[(ready_head+num_ready)%num_sessions]=k; num_ready++;}
+    int Pop() {int k=ready[ready_head]; ready_head=(ready_head+1)%num_sessions; num_ready--; return k;}
+
+    // New input for session k: the input now ends at end, closed if no more will come
+    void Provide(int k, const char* end, bool closed)
+    {
+        Session* ss=&sessions[k];
+        ss->input.end=end;
+        ss->input_closed=closed;
+        if(ss->state==SESSION_WAITING) {ss->state=SESSION_READY; Push(k);}
+    }
+
+    bool HasInput(Session* ss)
+    {
+        const char* p=ss->input.cur;
+        while(p<ss->input.end && (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n')) p++;
+        return p<ss->input.end;
+    }
+
+    // Runs session k until it ends, waits for input or has run budget loop iterations
+    void Step(Session* ss, int budget)
+    {
+        FlatTree* ft=this->ft;
+        Variable* variables=ss->variables;
+        RunInfo* pri=&ss->run_info;
+
+        while(ss->depth>0)
+        {
+            SessionFrame* f=&ss->frames[ss->depth-1];
+            if(ft->kind[f->node]==REPEAT_NODE)
+            {
+                unsigned int body=ft->first_child[f->node];
+                if(f->next)
+                {
+                    if(EvaluateFlat(ft, ft->next_sibling[body], variables)!=0.0) {ss->depth--; continue;}
+                    BackEdge(pri, ft->line_num[f->node]);
+                    if(--budget<=0) return; // still ready, back at the end of the queue
+                }
+                f->next=1;
+                SessionFrame* g=&ss->frames[ss->depth++];
+                g->node=body; g->next=ft->first_child[body];
+                continue;
+            }
+
+            unsigned int n=f->next;
+            if(n==FLAT_NONE) {ss->depth--; continue;}
+
+            int k=ft->kind[n];
+            if(k==READ_NODE && !ss->input_closed && !HasInput(ss)) {ss->state=SESSION_WAITING; return;}
+            f->next=ft->next_sibling[n];
+
+            unsigned int c=ft->first_child[n];
+            if(k==ASSIGN_NODE)
+            {
+                Variable* var=&variables[ft->value[n]];
+                double v=EvaluateFlat(ft, c, variables);
+                if(var->type==REAL) var->real_val=v;
+                else if(var->type==INTEGER) var->int_val=(int)v;
+                else if(var->type==BOOLEAN) var->bool_val=(v != 0.0);
+            }
+            else if(k==READ_NODE) ReadValue(pri, ft->names[ft->value[n]], ft->line_num[n], &variables[ft->value[n]]);
+            else if(k==WRITE_NODE) WriteValue(pri, (ExprDataType)ft->type[c], EvaluateFlat(ft, c, variables), ft->line_num[n]);
+            else if(k==IF_NODE)
+            {
+                unsigned int part=ft->next_sibling[c];
+                if(EvaluateFlat(ft, c, variables)==0.0) part=ft->next_sibling[part];
+                if(part!=FLAT_NONE)
+                {
+                    SessionFrame* g=&ss->frames[ss->depth++];
+                    g->node=part; g->next=ft->first_child[part];
+                }
+            }
+            else if(k==REPEAT_NODE)
+            {
+                SessionFrame* g=&ss->frames[ss->depth++];
+                g->node=n; g->next=0;
+            }
+        }
+        ss->state=SESSION_DONE;
+    }
+
+    // Runs the ready sessions till none is left, each for at most budget loop iterations at a time
+    void RunReady(int budget)
+    {
+        while(num_ready>0)
+        {
+            int k=Pop();
+            Session* ss=&sessions[k];
+            num_switches++;
+            try {
+                Step(ss, budget);
+            }
+            catch(const char*) {
+                ss->state=SESSION_DONE; // the error is in the session output
+            }
+            if(ss->state==SESSION_DONE) num_done++;
+            else if(ss->state==SESSION_READY) Push(k);
+        }
+    }
+
+    long long SessionBytes()
+    {
+        return sizeof(Session)+symbol_table->num_vars*sizeof(Variable)+max_depth*sizeof(SessionFrame);
+    }
+};
+
+const int SESSION_BUDGET=1000;
+
+// Runs every record as a session, as if each were a client typing its values one at a
+// time: every round, each waiting session receives its next value.
+void RunRecordsSessions(SessionScheduler* sched, RecordSet* records, OutBuffer* out)
+{
+    int k;
+    const char** avail=new const char*[records->num_records];
+    for(k=0;k<records->num_records;k++)
+    {
+        avail[k]=records->starts[k];
+        sched->sessions[k].input.SetBuffer(records->starts[k], 0);
+    }
+
+    while(true)
+    {
+        sched->RunReady(SESSION_BUDGET);
+        if(sched->num_done==sched->num_sessions) break;
+
+        for(k=0;k<records->num_records;k++)
+        {
+            if(sched->sessions[k].state!=SESSION_WAITING) continue;
+            const char* p=avail[k];
+            const char* end=records->ends[k];
+            while(p<end && (*p==' ' || *p=='\t' || *p=='\r')) p++;
+            while(p<end && *p!=' ' && *p!='\t' && *p!='\r') p++;
+            avail[k]=p;
+            sched->Provide(k, p, p==end);
+        }
+    }
+
+    for(k=0;k<records->num_records;k++) out->Append(sched->sessions[k].output.buf, sched->sessions[k].output.size);
+    delete[] avail;
+}
+
+void RunSessions(TreeNode* syntax_tree, SymbolTable* symbol_table, RecordSet* records, OutBuffer* out,
+                 RunLimits* limits, bool bench)
+{
+    FlatTree ft;
+    Flatten(&ft, syntax_tree, symbol_table);
+
+    double t0=GetTime();
+    SessionScheduler sched(&ft, symbol_table, limits, records->num_records);
+    RunRecordsSessions(&sched, records, out);
+    double t1=GetTime();
+    if(!bench) return;
+
+    OutBuffer scalar_out;
+    RunRecordsScalar(syntax_tree, symbol_table, records, 0, records->num_records, &scalar_out, limits);
+    double t2=GetTime();
+
+    bool same=(out->size==scalar_out.size && memcmp(out->buf, scalar_out.buf, out->size)==0);
+    printf("%d sessions, %lld bytes each (frame stack depth %d) plus input and output\n",
+           records->num_records, sched.SessionBytes(), sched.max_depth);
+    printf("RunProgram per record:       %.3f s\n", t2-t1);
+    printf("Sessions, one value a round: %.3f s, %lld time slices, %.0f ns per slice\n",
+           t1-t0, sched.num_switches, (t1-t0)*1e9/sched.num_switches);
+    printf("Outputs %s\n", same ? "match" : "DIFFER");
+    out->Clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Records Driver //////////////////////////////////////////////////////////////////
+
+void RunRecords(TreeNode* syntax_tree, SymbolTable* symbol_table, CompilerInfo* pci, RunLimits* limits)
+{
+    RecordSet records;
+    if(!records.Load(pci->options.records_str)) {printf("ERROR: Can't open records '%s'\n", pci->options.records_str); throw "Terminate Program!";}
+
+    OutBuffer out;
+    if(pci->options.sessions || pci->options.bench_sessions)
+    {
+        RunSessions(syntax_tree, symbol_table, &records, &out, limits, pci->options.bench_sessions);
+        fwrite(out.buf, 1, out.size, stdout);
+        return;
+    }
+    if(pci->options.bench_threads) {BenchRecordsParallel(syntax_tree, symbol_table, &records, limits); return;}
+    if(pci->options.num_threads>0)
+    {
+        RunRecordsParallel(syntax_tree, symbol_table, &records, pci->options.num_threads, &out, limits);
+        fwrite(out.buf, 1, out.size, stdout);
+        return;
+    }
+    if(!pci->options.bench_records)
+    {
+        RunRecordsBatch(syntax_tree, symbol_table, &records, 0, records.num_records, &out, limits);
+        fwrite(out.buf, 1, out.size, stdout);
+        return;
+    }
+
+    OutBuffer scalar_out;
+    double t0=GetTime();
+    RunRecordsScalar(syntax_tree, symbol_table, &records, 0, records.num_records, &scalar_out, limits);
+    double t1=GetTime();
+    RunRecordsBatch(syntax_tree, symbol_table, &records, 0, records.num_records, &out, limits);
+    double t2=GetTime();
+
+    bool same=(out.size==scalar_out.size && memcmp(out.buf, scalar_out.buf, out.size)==0);
+    printf("%d records, %d lanes, vector width %d\n", records.num_records, BATCH_SIZE, VEC_WIDTH);
+    printf("RunProgram per record: %.3f s, %.0f records/s\n", t1-t0, records.num_records/(t1-t0));
+    printf("Batch:                 %.3f s, %.0f records/s (%.2fx)\n", t2-t1, records.num_records/(t2-t1), (t1-t0)/(t2-t1));
+    printf("Outputs %s\n", same ? "match" : "DIFFER");
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Library Interface ///////////////////////////////////////////////////////////////
+
+// To use the compiler from another program, build this file with -DCOMPILER_NO_MAIN.
+// A Program is compiled once from a memory buffer and isn't changed after that, so
+// one Program can be shared by any number of threads. Each run has an ExecContext
+// holding its variables and callbacks. Nothing is global, and nothing is printed.
+struct Program
+{
+    Arena arena; // the syntax tree, names
+    SymbolTable symbol_table;
+    TreeNode* syntax_tree;
+    FlatTree flat_tree; // what is run
+
+    Program() : symbol_table(false, &arena) {syntax_tree=0;}
+    ~Program() {symbol_table.Destroy();}
+};
+
+// Returns 0 if the program has errors, they are added to diag if it isn't 0, sorted by line
+Program* CompileProgram(const char* source, long long size, Diagnostics* diag)
+{
+    Diagnostics local_diag;
+    if(!diag) diag=&local_diag;
+    int num_errors=diag->num;
+
+    TokenArray token_array;
+    LexParallel(source, size, 1, &token_array);
+    CompilerInfo compiler_info(0, 0, 0);
+    compiler_info.token_array=&token_array;
+    compiler_info.token_pos=0;
+
+    Program* program=new Program;
+    program->syntax_tree=Parse(&compiler_info, diag, &program->arena);
+    if(program->syntax_tree) Analyze(program->syntax_tree, &program->symbol_table, diag);
+    TreeNode* node;
+    for(node=program->syntax_tree;node && node->node_kind==DECLARE_NODE;node=node->sibling)
+        if(node->child[0]) diag->Add("semantic", node->line_num, "Array '%s' isn't supported by the library API", node->id);
+    if(diag->num>num_errors)
+    {
+        diag->SortByLine();
+        delete program;
+        return 0;
+    }
+    Flatten(&program->flat_tree, program->syntax_tree, &program->symbol_table);
+    return program;
+}
+
+void DestroyProgram(Program* program)
+{
+    delete program;
+}
+
+// Estimates the cost of a run before running it, see EstimateCost
+void EstimateProgramCost(Program* program, CostEstimate* estimate)
+{
+    EstimateCost(program->syntax_tree, &program->symbol_table, estimate);
+}
+
+struct ExecContext
+{
+    const Program* program;
+    Variable* variables;
+    ExecIO io;
+    RunLimits limits; // time_up points at this context's watchdog
+    bool has_limits;
+};
+
+// limits can be 0 for none
+ExecContext* CreateContext(const Program* program, const ExecIO* io, const RunLimits* limits)
+{
+    ExecContext* ctx=new ExecContext;
+    ctx->program=program;
+    ctx->variables=new Variable[program->symbol_table.num_vars];
+    ctx->io=*io;
+    ctx->has_limits=(limits!=0);
+    if(limits) ctx->limits=*limits;
+    ctx->limits.time_up=0;
+    return ctx;
+}
+
+// Runs the program from the start with all variables 0. Returns false after a runtime
+// error or an exceeded limit, the message has been written through io.
+bool RunContext(ExecContext* ctx)
+{
+    InitVariables(&ctx->program->symbol_table, ctx->variables);
+
+    RunInfo run_info;
+    run_info.io=&ctx->io;
+    Watchdog watchdog;
+    if(ctx->has_limits)
+    {
+        if(ctx->limits.max_time_ms) {ctx->limits.time_up=&watchdog.time_up; watchdog.Start(ctx->limits.max_time_ms);}
+        run_info.limits=&ctx->limits;
+        run_info.StartRun();
+    }
+
+    bool ok=true;
+    try {
+        RunFlat(&ctx->program->flat_tree, 1, ctx->variables, &run_info);
+    }
+    catch(const char*) {
+        ok=false;
+    }
+    watchdog.Stop();
+    ctx->limits.time_up=0;
+    return ok;
+}
+
+void DestroyContext(ExecContext* ctx)
+{
+    delete[] ctx->variables;
+    delete ctx;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Scanner and Compiler ////////////////////////////////////////////////////////////
+
+// Prints all the errors found by the parser and the analyzer, returns false if there are any
+bool ReportDiagnostics(Diagnostics* diag, CompilerInfo* pci)
+{
+    diag->SortByLine();
+    if(pci->options.diag_json_str)
+    {
+        FILE* file=Equals(pci->options.diag_json_str, "-") ? stdout : fopen(pci->options.diag_json_str, "w");
+        if(file) {diag->PrintJson(file); if(file!=stdout) fclose(file);}
+    }
+    if(diag->num==0) return true;
+    diag->Print();
+    printf("%d error(s) found\n", diag->num); fflush(NULL);
+    return false;
+}
+
+// Opens the input of read statements and starts the watchdog, returns the limits or 0 if none
+RunLimits* SetupRun(CompilerInfo* pci, RunInfo* pri, InputSource* input, Watchdog* watchdog)
+{
+    if(pci->options.read_str)
+    {
+        if(!input->Open(pci->options.read_str)) {printf("ERROR: Can't open input '%s'\n", pci->options.read_str); throw "Terminate Program!";}
+        pri->input=input;
+    }
+
+    RunLimits* limits=0;
+    if(pci->options.limits.max_back_edges || pci->options.limits.max_output_bytes || pci->options.limits.max_time_ms)
+    {
+        limits=&pci->options.limits;
+        if(limits->max_time_ms) {limits->time_up=&watchdog->time_up; watchdog->Start(limits->max_time_ms);}
+        pri->limits=limits;
+        pri->StartRun();
+    }
+    pri->loop_threads=pci->options.loop_threads;
+    pri->fp_reassociate=pci->options.fp_reassociate;
+    pri->tier_up=pci->options.tier_up && !pci->options.perf && !pci->options.profile_out_str; // those count the nodes RunProgram runs
+    pri->closed_form=pci->options.closed_form;
+    return limits;
+}
+
+void StartStreaming(CompilerInfo*);
+
+void StartCompiler(CompilerInfo* pci)
+{
+    if(pci->options.stream) {StartStreaming(pci); return;}
+
+    PerfCounters perf;
+    bool use_perf=pci->options.perf;
+    if(use_perf && !perf.Open()) {printf("WARNING: No performance counters available\n"); use_perf=false;}
+    CounterValues marks[5]; // before parsing, after parsing, after analysis, before and after the run
+    if(use_perf) perf.Read(&marks[0]);
+
+    InputSource source;
+    TokenArray token_array;
+    if(pci->options.lex_threads || pci->options.lazy) // lazy bodies are parsed from the tokens
+    {
+        if(!source.Open(pci->options.in_str)) {printf("ERROR: Can't open source '%s'\n", pci->options.in_str); throw "Terminate Program!";}
+        LexParallel(source.cur, source.end-source.cur, pci->options.lex_threads ? pci->options.lex_threads : 1, &token_array);
+        pci->token_array=&token_array;
+        pci->token_pos=0;
+    }
+    TokenPipe token_pipe; // stopped before the source is closed
+    if(pci->options.lex_pipe)
+    {
+        if(!source.Open(pci->options.in_str)) {printf("ERROR: Can't open source '%s'\n", pci->options.in_str); throw "Terminate Program!";}
+        token_pipe.Start(source.cur, source.end-source.cur);
+        pci->token_pipe=&token_pipe;
+    }
+
+    // the tree, names and line lists are freed with the arena
+    Arena arena;
+    Diagnostics diag;
+    TreeNode* syntax_tree=Parse(pci, &diag, &arena);
+    pci->token_array=0;
+    pci->token_pipe=0;
+    if(use_perf) perf.Read(&marks[1]);
+
+    SymbolTable symbol_table(pci->options.print_xref, &arena);
+    if(syntax_tree)
+    {
+        if(pci->options.analyze_threads) AnalyzeParallel(syntax_tree, &symbol_table, &diag, pci->options.analyze_threads);
+        else Analyze(syntax_tree, &symbol_table, &diag);
+    }
+    if(use_perf) perf.Read(&marks[2]);
+
+    if(!ReportDiagnostics(&diag, pci))
+    {
+        symbol_table.Destroy();
+        throw "Terminate Program!";
+    }
+    if(!syntax_tree) {symbol_table.Destroy(); return;}
+
+    // the flat tree and the record engines have no arrays
+    bool has_arrays=symbol_table.HasArrays();
+    if(has_arrays && (pci->options.flat || pci->options.records_str || pci->options.specialize_str))
+    {
+        printf("ERROR: Programs with arrays can't be run with -flat, -records or -specialize\n");
+        symbol_table.Destroy();
+        throw "Terminate Program!";
+    }
+
+    printf("Symbol Table:\n");
+    symbol_table.Print();
+    printf("---------------------------------\n"); fflush(NULL);
+
+    printf("Syntax Tree:\n");
+    PrintTree(syntax_tree);
+    printf("---------------------------------\n"); fflush(NULL);
+
+    IrProgram ir;
+    if(pci->options.run_ir || pci->options.dump_ir)
+    {
+        if(!BuildIr(syntax_tree, &symbol_table, &ir)) {symbol_table.Destroy(); throw "Terminate Program!";}
+        if(pci->options.dump_ir)
+        {
+            printf("SSA Form:\n");
+            PrintIr(&ir, &symbol_table);
+            printf("---------------------------------\n"); fflush(NULL);
         }
     }
-    
-    // WRITE statement
-    else if(node->node_kind == WRITE_NODE)
+
+    if(pci->options.cost_str)
     {
-        if(node->child[0]->expr_data_type == REAL) {
-            double v = EvaluateReal(node->child[0], symbol_table, variables);
-            printf("Val: %g\n", v);
+        FILE* file=Equals(pci->options.cost_str, "-") ? stdout : fopen(pci->options.cost_str, "w");
+        if(!file)
+        {
+            printf("ERROR: Can't open '%s'\n", pci->options.cost_str);
+            symbol_table.Destroy();
+            throw "Terminate Program!";
         }
-        else if(node->child[0]->expr_data_type == INTEGER) {
-            int v = (int)EvaluateReal(node->child[0], symbol_table, variables);
-            printf("Val: %d\n", v);
+        CostEstimate estimate;
+        EstimateCost(syntax_tree, &symbol_table, &estimate);
+        printf("Cost Estimate:\n");
+        estimate.Print();
+        fflush(NULL);
+        estimate.PrintJson(file);
+        if(file!=stdout) {fclose(file); printf("written to %s\n", pci->options.cost_str);}
+        printf("---------------------------------\n"); fflush(NULL);
+        symbol_table.Destroy();
+        return;
+    }
+
+    if(pci->options.specialize_str)
+    {
+        FILE* file=stdout;
+        if(pci->options.residual_str && !(file=fopen(pci->options.residual_str, "w")))
+        {
+            printf("ERROR: Can't open '%s'\n", pci->options.residual_str);
+            symbol_table.Destroy();
+            throw "Terminate Program!";
         }
-        else if(node->child[0]->expr_data_type == BOOLEAN) {
-            double v = EvaluateReal(node->child[0], symbol_table, variables);
-            bool b = (v != 0.0);
-            printf("Val: %s\n", b ? "true" : "false");
+        printf("Residual Program:\n"); fflush(NULL);
+        Specialize(syntax_tree, &symbol_table, pci->options.specialize_str, file);
+        if(file!=stdout) {fclose(file); printf("written to %s\n", pci->options.residual_str);}
+        printf("---------------------------------\n"); fflush(NULL);
+        symbol_table.Destroy();
+        return;
+    }
+
+    RunInfo run_info;
+    InputSource input;
+    Watchdog watchdog;
+    RunLimits* limits=SetupRun(pci, &run_info, &input, &watchdog);
+    NodeProfile profile(&perf);
+    if(use_perf) run_info.profile=&profile;
+    run_info.has_arrays=has_arrays;
+    if(has_arrays) run_info.tier_up=false;
+
+    ProfileFeedback feedback;
+    FlatTree tier;
+    unsigned int* tier_nodes=0;
+    if(pci->options.profile_out_str || pci->options.profile_in_str || pci->options.checkpoint_str || pci->options.resume_str)
+        feedback.Start(syntax_tree, pci->options.in_str);
+    if(pci->options.profile_out_str) run_info.feedback=feedback.counts;
+    if(pci->options.profile_in_str)
+    {
+        if(!feedback.Read(pci->options.profile_in_str)) printf("WARNING: Profile '%s' is missing or doesn't match the source, running without it\n", pci->options.profile_in_str);
+        else if(has_arrays) printf("WARNING: Profile '%s' isn't used, the flat tree has no arrays\n", pci->options.profile_in_str);
+        else
+        {
+            tier_nodes=new unsigned int[feedback.num_stmts+1]();
+            tier.feedback=feedback.counts;
+            int num_loops=FlattenHotLoops(syntax_tree, &feedback, &tier, &symbol_table, tier_nodes);
+            FlattenNames(&tier, &symbol_table);
+            run_info.tier=&tier;
+            run_info.tier_nodes=tier_nodes;
+            printf("Profile: %d hot loop(s) run from the flat tree\n", num_loops);
         }
+        fflush(NULL);
     }
-    
-    // REPEAT statement
-    else if(node->node_kind == REPEAT_NODE)
+
+    // the flat tree has no place to write a checkpoint from
+    Checkpoint checkpoint;
+    if(pci->options.checkpoint_str)
     {
-        do {
-            RunProgram(node->child[0], symbol_table, variables);
-        } while(EvaluateReal(node->child[1], symbol_table, variables) == 0.0);
+        checkpoint.file_str=pci->options.checkpoint_str;
+        checkpoint.numbering=&feedback;
+        checkpoint.symbol_table=&symbol_table;
+        checkpoint.interval_ms=pci->options.checkpoint_ms;
+        run_info.checkpoint=&checkpoint;
+        run_info.checkpoint_time=GetTime()+checkpoint.interval_ms/1000.0;
+        run_info.tier_up=false;
+        run_info.StartRun();
     }
-    
-    // Process sibling statements
-    if(node->sibling) 
-        RunProgram(node->sibling, symbol_table, variables);
-}
-// NEW: Updated entry point for RunProgram
-void RunProgram(TreeNode* syntax_tree, SymbolTable* symbol_table)
-{
-    int i;
-    
-    // Allocate array of Variable structures instead of just ints
-    Variable* variables = new Variable[symbol_table->num_vars];
-    
-    // Initialize all variables based on their declared types
-    for(i = 0; i < SYMBOL_HASH_SIZE; i++)
+
+    // the flat tree has no lazy bodies
+    LazyBodies lazy_bodies;
+    int num_lazy=0;
+    if(pci->options.lazy)
     {
-        VariableInfo* curv = symbol_table->var_info[i];
-        while(curv)
+        lazy_bodies.tokens=&token_array;
+        lazy_bodies.arena=&arena;
+        lazy_bodies.symbol_table=&symbol_table;
+        run_info.lazy=&lazy_bodies;
+        run_info.tier_up=false;
+        num_lazy=CountLazy(syntax_tree);
+    }
+
+    printf("Run Program:\n");
+    if(use_perf) perf.Read(&marks[3]);
+    if(pci->options.records_str) RunRecords(syntax_tree, &symbol_table, pci, limits);
+    else if(pci->options.flat)
+    {
+        FlatTree flat_tree;
+        Flatten(&flat_tree, syntax_tree, &symbol_table);
+        RunFlat(&flat_tree, &symbol_table, &run_info);
+    }
+    else if(pci->options.resume_str) ResumeProgram(syntax_tree, &symbol_table, &run_info, pci->options.resume_str, &feedback);
+    else if(pci->options.run_ir) RunIr(&ir, &symbol_table, &run_info);
+    else RunProgram(syntax_tree, &symbol_table, &run_info);
+    if(use_perf) perf.Read(&marks[4]);
+    printf("---------------------------------\n"); fflush(NULL);
+    watchdog.Stop();
+    delete[] tier_nodes;
+
+    if(pci->options.lazy)
+    {
+        printf("Lazy Parsing:\n");
+        printf("%d bodies left unparsed when compiled, %d parsed when first run in %.3f ms\n",
+               num_lazy, lazy_bodies.num_expanded, lazy_bodies.expand_time*1000);
+        printf("---------------------------------\n"); fflush(NULL);
+    }
+
+    if(pci->options.checkpoint_str)
+    {
+        remove(pci->options.checkpoint_str);
+        printf("Checkpoints:\n");
+        printf("%d written every %d ms, %lld bytes, %.3f ms to write each\n", checkpoint.num_written, checkpoint.interval_ms,
+               checkpoint.file_size, checkpoint.num_written ? checkpoint.write_time*1000/checkpoint.num_written : 0.0);
+        printf("---------------------------------\n"); fflush(NULL);
+    }
+
+    if(pci->options.profile_out_str && !feedback.Write(pci->options.profile_out_str))
+        printf("ERROR: Can't write profile '%s'\n", pci->options.profile_out_str);
+
+    if(use_perf)
+    {
+        // scanning on other threads with -lex-threads or -analyze-threads is not counted
+        const char* phases[3]={"scan+parse", "analyze", "run"};
+        const int from[3]={0, 1, 3};
+        printf("Performance Counters:\n");
+        PrintCountersHeader("phase");
+        int i;
+        for(i=0;i<3;i++)
         {
-            variables[curv->memloc].type = curv->var_type;
-            
-            if(curv->var_type == INTEGER)
-                variables[curv->memloc].int_val = 0;
-            else if(curv->var_type == REAL)
-                variables[curv->memloc].real_val = 0.0;
-            else if(curv->var_type == BOOLEAN)
-                variables[curv->memloc].bool_val = false;
-            
-            curv = curv->next_var;
+            CounterValues cv;
+            cv.AddDiff(&marks[from[i]], &marks[from[i]+1]);
+            PrintCounters(&perf, phases[i], -1, &cv);
         }
+        if(run_info.profile && !pci->options.records_str && !pci->options.flat) profile.Print();
+        printf("---------------------------------\n"); fflush(NULL);
     }
-    
-    // Run the program
-    RunProgram(syntax_tree, symbol_table, variables);
-    
-    // Clean up
-    delete[] variables;
-}
 
+    symbol_table.Destroy();
+}
 
 ////////////////////////////////////////////////////////////////////////////////////
-// Scanner and Compiler ////////////////////////////////////////////////////////////
-
-void StartCompiler(CompilerInfo* pci)
+// Streaming Compiler //////////////////////////////////////////////////////////////
+
+// For long straight line programs. After the declarations each top level statement
+// is parsed, analyzed, run and freed before the next one is read, so memory depends
+// on the largest statement and not on the program length. No syntax tree or cross
+// reference listing is printed. The first statement with an error stops the run,
+// the rest of the program is still checked so that all the errors are reported.
+void StartStreaming(CompilerInfo* pci)
 {
-    TreeNode* syntax_tree=Parse(pci);
+    setvbuf(stdout, 0, _IOLBF, 0); // output shows up as it is written, even through a pipe
 
-    SymbolTable symbol_table;
-    Analyze(syntax_tree, &symbol_table);
+    Arena arena; // holds one statement at a time
+    Diagnostics diag;
+    ParseInfo parse_info;
+    parse_info.diag=&diag;
+    parse_info.arena=&arena;
+    GetNextToken(pci, &parse_info.next_token);
+
+    SymbolTable symbol_table(false); // line locations would grow with the program
+    if(parse_info.next_token.type==INT_TYPE || parse_info.next_token.type==REAL_TYPE || parse_info.next_token.type==BOOL_TYPE)
+    {
+        TreeNode* declarations=Declarations(pci, &parse_info);
+        if(declarations) Analyze(declarations, &symbol_table, &diag);
+        arena.Reset();
+    }
 
     printf("Symbol Table:\n");
     symbol_table.Print();
     printf("---------------------------------\n"); fflush(NULL);
 
-    printf("Syntax Tree:\n");
-    PrintTree(syntax_tree);
-    printf("---------------------------------\n"); fflush(NULL);
+    RunInfo run_info;
+    InputSource input;
+    Watchdog watchdog;
+    SetupRun(pci, &run_info, &input, &watchdog);
+    run_info.has_arrays=symbol_table.HasArrays();
+    if(run_info.has_arrays) run_info.tier_up=false;
+
+    Variable* variables=new Variable[symbol_table.num_vars];
+    InitVariables(&symbol_table, variables);
+
+    AnalyzeInfo analyze_info;
+    analyze_info.symbol_table=&symbol_table;
+    analyze_info.diag=&diag;
+    analyze_info.xref=0;
 
     printf("Run Program:\n");
-    RunProgram(syntax_tree, &symbol_table);
+    try {
+        while(parse_info.next_token.type!=ENDFILE)
+        {
+            TokenType type=parse_info.next_token.type;
+            if(type==END || type==ELSE || type==UNTIL)
+            {
+                char found[MAX_TOKEN_LEN+3];
+                DescribeToken(&parse_info.next_token, found);
+                diag.Add("syntax", pci->in_file.cur_line_num, "Unexpected %s", found);
+                GetNextToken(pci, &parse_info.next_token);
+            }
+            else
+            {
+                TreeNode* stmt=Stmt(pci, &parse_info);
+                if(stmt)
+                {
+                    AnalyzeNode(stmt, &analyze_info);
+                    if(diag.num==0) RunProgram(stmt, &symbol_table, variables, &run_info);
+                    arena.Reset();
+                    if(run_info.loop_tier) run_info.loop_tier->Clear(); // its loops were freed
+                }
+                type=parse_info.next_token.type;
+                if(type==ENDFILE || type==END || type==ELSE || type==UNTIL) continue;
+            }
+
+            // same recovery as StmtSeq
+            try {
+                Match(pci, &parse_info, SEMI_COLON);
+            }
+            catch(int) {
+                if(!IsStmtStart(parse_info.next_token.type))
+                {
+                    Synchronize(pci, &parse_info);
+                    if(parse_info.next_token.type==SEMI_COLON) Match(pci, &parse_info, SEMI_COLON);
+                }
+            }
+        }
+    }
+    catch(...) {
+        FreeVariables(&symbol_table, variables);
+        ReleaseTier(&run_info);
+        symbol_table.Destroy();
+        throw;
+    }
     printf("---------------------------------\n"); fflush(NULL);
+    watchdog.Stop();
 
+    FreeVariables(&symbol_table, variables);
+    ReleaseTier(&run_info);
     symbol_table.Destroy();
-    DestroyTree(syntax_tree);
+    if(!ReportDiagnostics(&diag, pci)) throw "Terminate Program!";
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
@@ -1317,18 +7488,710 @@ void StartScanner(CompilerInfo* pci)
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
+// Benchmarks //////////////////////////////////////////////////////////////////////
+
+// The hash used before the open addressing table: (h*17+c)%10007
+int LegacyHash(const char* name)
+{
+    int i, len=strlen(name);
+    int hash_val=11;
+    for(i=0;i<len;i++) hash_val=(hash_val*17+(int)name[i])%10007;
+    return hash_val;
+}
+
+// Identifiers built from the blocks "aR" and "bA" all collide under the legacy hash,
+// since 'a'*17+'R' == 'b'*17+'A'. Name k is the binary expansion of k using these blocks.
+void MakeCollidingName(char* str, int k, int num_blocks)
+{
+    int i;
+    for(i=0;i<num_blocks;i++)
+    {
+        const char* block=((k>>i)&1) ? "bA" : "aR";
+        str[2*i]=block[0]; str[2*i+1]=block[1];
+    }
+    str[2*num_blocks]=0;
+}
+
+void BenchSymbolTable(int n)
+{
+    int i, k, num_blocks=1;
+    while((1<<num_blocks)<n) num_blocks++;
+
+    char** names=new char*[n];
+    for(i=0;i<n;i++) {names[i]=new char[2*num_blocks+1]; MakeCollidingName(names[i], i, num_blocks);}
+
+    int legacy_bucket=LegacyHash(names[0]), legacy_collisions=0;
+    for(i=0;i<n;i++) if(LegacyHash(names[i])==legacy_bucket) legacy_collisions++;
+
+    const int NUM_USES=8;
+    int pass;
+    for(pass=0;pass<2;pass++)
+    {
+        bool track_lines=(pass==0);
+        double t0=GetTime();
+        SymbolTable symbol_table(track_lines);
+        for(i=0;i<n;i++) symbol_table.Insert(names[i], i, INTEGER);
+        double t1=GetTime();
+        for(k=0;k<NUM_USES;k++) for(i=0;i<n;i++) symbol_table.Insert(names[i], i);
+        double t2=GetTime();
+        int found=0;
+        for(k=0;k<NUM_USES;k++) for(i=0;i<n;i++) if(symbol_table.Find(names[i])) found++;
+        double t3=GetTime();
+
+        long long probes=0;
+        for(i=0;i<n;i++)
+        {
+            int s=SymbolTable::Hash(names[i])&symbol_table.slots_mask;
+            while(symbol_table.slots[s]!=i) {s=(s+1)&symbol_table.slots_mask; probes++;}
+        }
+        symbol_table.Destroy();
+        double t4=GetTime();
+
+        printf("xref=%s: declare %.1f ns, use %.1f ns, find %.1f ns, destroy %.3f ms, extra probes/var %.3f (found %d)\n",
+               track_lines ? "on " : "off",
+               (t1-t0)*1e9/n, (t2-t1)*1e9/(n*NUM_USES), (t3-t2)*1e9/(n*NUM_USES), (t4-t3)*1e3,
+               (double)probes/n, found);
+    }
+    printf("%d identifiers, %d of them in one bucket under the legacy hash\n", n, legacy_collisions);
+    fflush(NULL);
+
+    for(i=0;i<n;i++) delete[] names[i];
+    delete[] names;
+}
+
+// Reads n int values then n real values, once through the input source and once through fscanf
+void BenchInput(int n)
+{
+    int i, k;
+    size_t capacity=(size_t)n*40+64, size=0;
+    char* buf=(char*)malloc(capacity);
+    srand(12345);
+    for(i=0;i<n;i++) size+=sprintf(buf+size, "%d\n", rand()-RAND_MAX/2);
+    for(i=0;i<n;i++) size+=sprintf(buf+size, "%.6f\n", (rand()-RAND_MAX/2)/1024.0);
+
+    Variable int_var, real_var;
+    int_var.type=INTEGER; real_var.type=REAL;
+
+    for(k=0;k<2;k++)
+    {
+        double int_sum=0, real_sum=0;
+        double t0=GetTime(), t1, t2;
+        if(k==0)
+        {
+            InputSource input;
+            input.SetBuffer(buf, size);
+            RunInfo run_info;
+            run_info.input=&input;
+            for(i=0;i<n;i++) {ReadValue(&run_info, "x", 0, &int_var); int_sum+=int_var.int_val;}
+            t1=GetTime();
+            for(i=0;i<n;i++) {ReadValue(&run_info, "y", 0, &real_var); real_sum+=real_var.real_val;}
+            t2=GetTime();
+        }
+        else
+        {
+            FILE* file=fmemopen(buf, size, "r");
+            for(i=0;i<n;i++) {fscanf(file, "%d", &int_var.int_val); int_sum+=int_var.int_val;}
+            t1=GetTime();
+            for(i=0;i<n;i++) {fscanf(file, "%lf", &real_var.real_val); real_sum+=real_var.real_val;}
+            t2=GetTime();
+            fclose(file);
+        }
+        printf("%s: int %.1f ns/value, real %.1f ns/value, %.1f MB/s (checksums %.0f %.6f)\n",
+               k==0 ? "InputSource" : "fscanf     ",
+               (t1-t0)*1e9/n, (t2-t1)*1e9/n, size/(t2-t0)*1e-6, int_sum, real_sum);
+    }
+    fflush(NULL);
+    free(buf);
+}
+
+// Scans the source file with GetNextToken, then with LexParallel on 1, 2, 4, ... threads
+void BenchLex(CompilerOptions* options)
+{
+    int n;
+    InputSource source;
+    if(!source.Open(options->in_str)) {printf("ERROR: Can't open source '%s'\n", options->in_str); return;}
+    long long size=source.end-source.cur;
+
+    TokenArray serial;
+    serial.source=source.cur;
+    double t0=GetTime();
+    {
+        CompilerInfo compiler_info(options->in_str, 0, 0);
+        Token token;
+        do {
+            GetNextToken(&compiler_info, &token);
+            serial.Add(token.type, source.cur, strlen(token.str), compiler_info.in_file.cur_line_num);
+        } while(token.type!=ENDFILE);
+    }
+    double serial_time=GetTime()-t0;
+    printf("%.1f MB, %d tokens\n", size*1e-6, serial.num);
+    printf("GetNextToken:      %.3f s, %.1f MB/s\n", serial_time, size*1e-6/serial_time);
+
+    int max_threads=NumCores();
+    for(n=1;;n*=2)
+    {
+        if(n>max_threads) n=max_threads;
+        TokenArray ta;
+        t0=GetTime();
+        LexParallel(source.cur, size, n, &ta);
+        double t=GetTime()-t0;
+
+        bool same=(ta.num==serial.num);
+        int i;
+        for(i=0;i<ta.num && same;i++)
+            same=(ta.tokens[i].type==serial.tokens[i].type && ta.tokens[i].line_num==serial.tokens[i].line_num &&
+                  ta.tokens[i].len==serial.tokens[i].len);
+        printf("LexParallel %3d:   %.3f s, %.1f MB/s, speedup %.2f, tokens %s\n",
+               n, t, size*1e-6/t, serial_time/t, same ? "match" : "DIFFER");
+        if(n==max_threads) break;
+    }
+
+    {
+        TokenPipe pipe;
+        t0=GetTime();
+        pipe.Start(source.cur, size);
+        LexToken t;
+        bool same=true;
+        int i=0;
+        do {
+            pipe.Pop(&t);
+            if(i<serial.num) same=same && t.type==serial.tokens[i].type && t.line_num==serial.tokens[i].line_num &&
+                                         t.len==serial.tokens[i].len;
+            i++;
+        } while(t.type!=ENDFILE);
+        double pipe_time=GetTime()-t0;
+        same=same && i==serial.num;
+        printf("TokenPipe drain:   %.3f s, %.1f MB/s, speedup %.2f, tokens %s, %lld waits\n",
+               pipe_time, size*1e-6/pipe_time, serial_time/pipe_time, same ? "match" : "DIFFER", pipe.num_waits);
+    }
+
+    // scanning and parsing together: interleaved, pipelined and scanned ahead
+    printf("%d cores\n", max_threads);
+    double parse_time[3];
+    for(n=0;n<3;n++)
+    {
+        CompilerInfo compiler_info(options->in_str, 0, 0);
+        Diagnostics diag;
+        Arena arena;
+        TokenPipe pipe;
+        TokenArray ta;
+        t0=GetTime();
+        if(n==1) {pipe.Start(source.cur, size); compiler_info.token_pipe=&pipe;}
+        if(n==2) {LexParallel(source.cur, size, 1, &ta); compiler_info.token_array=&ta;}
+        Parse(&compiler_info, &diag, &arena);
+        parse_time[n]=GetTime()-t0;
+    }
+    printf("Parse, interleaved: %.3f s\n", parse_time[0]);
+    printf("Parse, -lex-pipe:   %.3f s, speedup %.2f\n", parse_time[1], parse_time[0]/parse_time[1]);
+    printf("Parse, lex ahead:   %.3f s, speedup %.2f\n", parse_time[2], parse_time[0]/parse_time[2]);
+    fflush(NULL);
+}
+
+bool SameAnalysis(SymbolTable* a, Diagnostics* da, SymbolTable* b, Diagnostics* db)
+{
+    int i, j;
+    if(a->num_vars!=b->num_vars || da->num!=db->num) return false;
+    for(i=0;i<a->num_vars;i++)
+    {
+        if(a->vars[i].num_lines!=b->vars[i].num_lines) return false;
+        for(j=0;j<a->vars[i].num_lines;j++) if(a->vars[i].lines[j]!=b->vars[i].lines[j]) return false;
+    }
+    for(i=0;i<da->num;i++)
+        if(da->items[i].line_num!=db->items[i].line_num || !Equals(da->items[i].message, db->items[i].message)) return false;
+    return true;
+}
+
+void BenchAnalyze(CompilerOptions* options)
+{
+    int n;
+    CompilerInfo compiler_info(options->in_str, 0, 0);
+    Diagnostics parse_diag;
+    TreeNode* syntax_tree=Parse(&compiler_info, &parse_diag);
+    if(!syntax_tree) {printf("ERROR: Empty program\n"); return;}
+
+    SymbolTable serial;
+    Diagnostics serial_diag;
+    double t0=GetTime();
+    Analyze(syntax_tree, &serial, &serial_diag);
+    double serial_time=GetTime()-t0;
+    printf("%d variables, %d semantic errors\n", serial.num_vars, serial_diag.num);
+    printf("Analyze:            %.3f s\n", serial_time);
+
+    int max_threads=NumCores();
+    for(n=1;;n*=2)
+    {
+        if(n>max_threads) n=max_threads;
+        SymbolTable symbol_table;
+        Diagnostics diag;
+        t0=GetTime();
+        AnalyzeParallel(syntax_tree, &symbol_table, &diag, n);
+        double t=GetTime()-t0;
+        printf("AnalyzeParallel %3d: %.3f s, speedup %.2f, result %s\n",
+               n, t, serial_time/t, SameAnalysis(&serial, &serial_diag, &symbol_table, &diag) ? "match" : "DIFFER");
+        symbol_table.Destroy();
+        if(n==max_threads) break;
+    }
+    serial.Destroy();
+    DestroyTree(syntax_tree);
+    fflush(NULL);
+}
+
+// Counts the nodes and adds up their kinds, so the walk can't be optimized away.
+// Also adds up the size of the names if id_bytes isn't 0.
+long long WalkTree(TreeNode* node, int* num_nodes, long long* id_bytes)
+{
+    long long sum=0;
+    int i;
+    for(;node;node=node->sibling)
+    {
+        (*num_nodes)++;
+        sum+=node->node_kind;
+        if(id_bytes && (node->node_kind==ID_NODE || node->node_kind==READ_NODE || node->node_kind==ASSIGN_NODE || node->node_kind==DECLARE_NODE || node->node_kind==INDEX_NODE))
+            *id_bytes+=strlen(node->id)+1;
+        for(i=0;i<MAX_CHILDREN;i++) if(node->child[i]) sum+=WalkTree(node->child[i], num_nodes, id_bytes);
+    }
+    return sum;
+}
+
+long long WalkFlat(FlatTree* ft, unsigned int n)
+{
+    long long sum=ft->kind[n];
+    unsigned int c;
+    for(c=ft->first_child[n];c!=FLAT_NONE;c=ft->next_sibling[c]) sum+=WalkFlat(ft, c);
+    return sum;
+}
+
+void BenchAst(CompilerOptions* options)
+{
+    int i, r;
+    const int NUM_WALKS=20;
+    CompilerInfo compiler_info(options->in_str, 0, 0);
+    Diagnostics diag;
+    TreeNode* syntax_tree=Parse(&compiler_info, &diag);
+    SymbolTable symbol_table(false);
+    if(syntax_tree) Analyze(syntax_tree, &symbol_table, &diag);
+    if(!syntax_tree || diag.num) {printf("ERROR: The program doesn't compile\n"); if(syntax_tree) DestroyTree(syntax_tree); return;}
+
+    FlatTree ft;
+    Flatten(&ft, syntax_tree, &symbol_table);
+
+    int num_nodes=0;
+    long long id_bytes=0;
+    WalkTree(syntax_tree, &num_nodes, &id_bytes);
+    long long tree_bytes=(long long)num_nodes*sizeof(TreeNode)+id_bytes;
+    long long flat_bytes=(long long)(ft.num_nodes-1)*FlatTree::NodeBytes()+ft.num_literals*sizeof(double);
+    printf("Syntax tree: %d nodes, %d bytes per node + %lld bytes of names, %.1f bytes per node (before heap overhead)\n",
+           num_nodes, (int)sizeof(TreeNode), id_bytes, (double)tree_bytes/num_nodes);
+    printf("Flat tree:   %d nodes, %d bytes per node + %d literals, %.1f bytes per node\n",
+           ft.num_nodes-1, FlatTree::NodeBytes(), ft.num_literals, (double)flat_bytes/(ft.num_nodes-1));
+
+    long long sum_tree=0, sum_flat=0, sum_scan=0;
+    double t0=GetTime();
+    for(r=0;r<NUM_WALKS;r++) {int n=0; sum_tree+=WalkTree(syntax_tree, &n, 0);}
+    double tree_time=(GetTime()-t0)/NUM_WALKS;
+    t0=GetTime();
+    for(r=0;r<NUM_WALKS;r++) sum_flat+=WalkFlat(&ft, 1);
+    double flat_time=(GetTime()-t0)/NUM_WALKS;
+    t0=GetTime();
+    for(r=0;r<NUM_WALKS;r++) for(i=1;i<ft.num_nodes;i++) sum_scan+=ft.kind[i];
+    double scan_time=(GetTime()-t0)/NUM_WALKS;
+    printf("Walk syntax tree: %.2f ns per node\n", tree_time*1e9/num_nodes);
+    printf("Walk flat tree:   %.2f ns per node (speedup %.2f)\n", flat_time*1e9/(ft.num_nodes-1), tree_time/flat_time);
+    printf("Scan flat tree:   %.2f ns per node (speedup %.2f)\n", scan_time*1e9/(ft.num_nodes-1), tree_time/scan_time);
+    volatile long long sink=sum_tree+sum_flat+sum_scan; (void)sink;
+
+    // both runs write to memory, with the read values from -read if given
+    OutBuffer out_tree, out_flat;
+    double run_time[2];
+    for(r=0;r<2;r++)
+    {
+        RunInfo run_info;
+        InputSource input;
+        if(!options->read_str) input.SetBuffer("", 0); // no prompts while timing
+        else if(!input.Open(options->read_str)) {printf("ERROR: Can't open input '%s'\n", options->read_str); return;}
+        run_info.input=&input;
+        run_info.output=r ? &out_flat : &out_tree;
+        t0=GetTime();
+        try {
+            if(r) RunFlat(&ft, &symbol_table, &run_info);
+            else RunProgram(syntax_tree, &symbol_table, &run_info);
+        }
+        catch(const char*) {}
+        run_time[r]=GetTime()-t0;
+    }
+    printf("RunProgram: %.3f s\n", run_time[0]);
+    printf("RunFlat:    %.3f s, speedup %.2f, output %s\n", run_time[1], run_time[0]/run_time[1],
+           (out_tree.size==out_flat.size && memcmp(out_tree.buf, out_flat.buf, out_tree.size)==0) ? "match" : "DIFFER");
+
+    symbol_table.Destroy();
+    DestroyTree(syntax_tree);
+    fflush(NULL);
+}
+
+void BenchIr(CompilerOptions* options)
+{
+    CompilerInfo compiler_info(options->in_str, 0, 0);
+    Diagnostics diag;
+    TreeNode* syntax_tree=Parse(&compiler_info, &diag);
+    SymbolTable symbol_table(false);
+    if(syntax_tree) Analyze(syntax_tree, &symbol_table, &diag);
+    if(!syntax_tree || diag.num) {printf("ERROR: The program doesn't compile\n"); if(syntax_tree) DestroyTree(syntax_tree); return;}
+
+    IrProgram ir;
+    double t0=GetTime();
+    bool ok=BuildIr(syntax_tree, &symbol_table, &ir);
+    double build_time=GetTime()-t0;
+    if(!ok) {symbol_table.Destroy(); DestroyTree(syntax_tree); return;}
+    printf("SSA form: %d blocks, %d values, %d loops, %d of %d registers used, %d spilled, built in %.3f ms\n",
+           ir.num_blocks, ir.num_values, ir.num_loops, ir.num_regs_used, IR_NUM_REGS, ir.num_spill_slots, build_time*1000);
+
+    // both runs write to memory, with the read values from -read if given
+    OutBuffer out_tree, out_ir;
+    double run_time[2];
+    int r;
+    for(r=0;r<2;r++)
+    {
+        RunInfo run_info;
+        InputSource input;
+        if(!options->read_str) input.SetBuffer("", 0); // no prompts while timing
+        else if(!input.Open(options->read_str)) {printf("ERROR: Can't open input '%s'\n", options->read_str); return;}
+        run_info.input=&input;
+        run_info.output=r ? &out_ir : &out_tree;
+        t0=GetTime();
+        try {
+            if(r) RunIr(&ir, &symbol_table, &run_info);
+            else RunProgram(syntax_tree, &symbol_table, &run_info);
+        }
+        catch(const char*) {}
+        run_time[r]=GetTime()-t0;
+    }
+    printf("RunProgram: %.3f s\n", run_time[0]);
+    printf("RunIr:      %.3f s, speedup %.2f, output %s\n", run_time[1], run_time[0]/run_time[1],
+           (out_tree.size==out_ir.size && memcmp(out_tree.buf, out_ir.buf, out_tree.size)==0) ? "match" : "DIFFER");
+
+    symbol_table.Destroy();
+    DestroyTree(syntax_tree);
+    fflush(NULL);
+}
+
+// Parses and analyzes the scanned input file n times, then frees everything.
+// The scanning is done once up front, so only the allocations differ.
+void BenchCompile(CompilerOptions* options)
+{
+    int r, n=options->bench_compile;
+    InputSource source;
+    if(!source.Open(options->in_str)) {printf("ERROR: Can't open source '%s'\n", options->in_str); return;}
+    long long size=source.end-source.cur;
+    TokenArray token_array;
+    LexParallel(source.cur, size, 1, &token_array);
+
+    CompilerInfo compiler_info(options->in_str, 0, 0);
+    compiler_info.token_array=&token_array;
+
+    long long num_objects=0;
+    double t0=GetTime();
+    for(r=0;r<n;r++)
+    {
+        compiler_info.token_pos=0;
+        Diagnostics diag;
+        TreeNode* syntax_tree=Parse(&compiler_info, &diag);
+        SymbolTable symbol_table;
+        if(syntax_tree) Analyze(syntax_tree, &symbol_table, &diag);
+        symbol_table.Destroy();
+        if(syntax_tree) DestroyTree(syntax_tree);
+    }
+    double heap_time=(GetTime()-t0)/n;
+
+    Arena arena;
+    int first_blocks=0;
+    t0=GetTime();
+    for(r=0;r<n;r++)
+    {
+        compiler_info.token_pos=0;
+        Diagnostics diag;
+        TreeNode* syntax_tree=Parse(&compiler_info, &diag, &arena);
+        SymbolTable symbol_table(true, &arena);
+        if(syntax_tree) Analyze(syntax_tree, &symbol_table, &diag);
+        symbol_table.Destroy();
+        num_objects=arena.num_allocs;
+        if(r==0) first_blocks=arena.num_blocks;
+        arena.Reset();
+    }
+    double arena_time=(GetTime()-t0)/n;
+    int num_arena_blocks=arena.num_blocks;
+
+    // the bodies of ifs and repeats skimmed, see ExpandLazy
+    int num_lazy=0;
+    long long lazy_objects=0;
+    compiler_info.options.lazy=true;
+    t0=GetTime();
+    for(r=0;r<n;r++)
+    {
+        compiler_info.token_pos=0;
+        Diagnostics diag;
+        TreeNode* syntax_tree=Parse(&compiler_info, &diag, &arena);
+        SymbolTable symbol_table(true, &arena);
+        if(syntax_tree) Analyze(syntax_tree, &symbol_table, &diag);
+        symbol_table.Destroy();
+        if(r==0) num_lazy=CountLazy(syntax_tree);
+        lazy_objects=arena.num_allocs;
+        arena.Reset();
+    }
+    double lazy_time=(GetTime()-t0)/n;
+
+    printf("%.1f MB, %lld tree nodes, names and line lists per compile\n", size*1e-6, num_objects);
+    printf("new/delete: %lld allocations per compile, %.3f ms per compile, %.1f MB/s\n",
+           num_objects, heap_time*1e3, size*1e-6/heap_time);
+    printf("arena:      %d block(s) for the first compile, %d more for the other %d, %.3f ms per compile, %.1f MB/s, speedup %.2f\n",
+           first_blocks, num_arena_blocks-first_blocks, n-1, arena_time*1e3, size*1e-6/arena_time, heap_time/arena_time);
+    printf("lazy:       %d bodies left unparsed, %lld objects, %.3f ms per compile, %.1f MB/s, speedup %.2f over the arena\n",
+           num_lazy, lazy_objects, lazy_time*1e3, size*1e-6/lazy_time, arena_time/lazy_time);
+    fflush(NULL);
+}
+
+// The callbacks of one run in BenchApi: input from a buffer, output to memory
+struct ApiRun
+{
+    InputSource input;
+    OutBuffer output;
+};
+
+void ApiWrite(void* user, const char* text, int len)
+{
+    ((ApiRun*)user)->output.Append(text, len);
+}
+
+bool ApiRead(void* user, const char* /*name*/, char* buf, int size)
+{
+    const char* s; const char* e;
+    if(!((ApiRun*)user)->input.NextField(&s, &e)) return false;
+    int n=(e-s<size-1) ? e-s : size-1;
+    memcpy(buf, s, n); buf[n]=0;
+    return true;
+}
+
+struct ApiBenchInfo
+{
+    const Program* program;
+    const char* read_buf;
+    int read_size;
+    const RunLimits* limits;
+    atomic<int> next_run;
+    int num_runs;
+    OutBuffer first_output; // output of run 0
+    atomic<int> num_differ;
+};
+
+void ApiWorker(ApiBenchInfo* pab)
+{
+    ApiRun run;
+    ExecIO io;
+    io.user=&run; io.write=ApiWrite; io.read=ApiRead;
+    ExecContext* ctx=CreateContext(pab->program, &io, pab->limits);
+    while(true)
+    {
+        int k=pab->next_run++;
+        if(k>=pab->num_runs) break;
+        run.input.SetBuffer(pab->read_buf, pab->read_size);
+        run.output.Clear();
+        RunContext(ctx);
+        if(k==0) pab->first_output.Append(run.output.buf, run.output.size);
+        else if(run.output.size!=pab->first_output.size || memcmp(run.output.buf, pab->first_output.buf, run.output.size)) pab->num_differ++;
+    }
+    DestroyContext(ctx);
+}
+
+void BenchApi(CompilerOptions* options)
+{
+    int i;
+    InputSource source, read_input;
+    if(!source.Open(options->in_str)) {printf("ERROR: Can't open source '%s'\n", options->in_str); return;}
+    if(options->read_str && !read_input.Open(options->read_str)) {printf("ERROR: Can't open input '%s'\n", options->read_str); return;}
+
+    // compiled from a copy with no 0 after it, like a caller's buffer, which CompileProgram must not read past
+    long long size=source.end-source.cur;
+    char* buf=(char*)malloc(size ? size : 1);
+    memcpy(buf, source.cur, size);
+    Diagnostics diag;
+    double t0=GetTime();
+    Program* program=CompileProgram(buf, size, &diag);
+    double compile_time=GetTime()-t0;
+    free(buf);
+    if(!program) {diag.Print(); printf("%d error(s) found\n", diag.num); return;}
+
+    bool has_limits=options->limits.max_back_edges || options->limits.max_output_bytes || options->limits.max_time_ms;
+    ApiBenchInfo pab;
+    pab.program=program;
+    pab.read_buf=read_input.cur; pab.read_size=read_input.end-read_input.cur;
+    pab.limits=has_limits ? &options->limits : 0;
+    pab.next_run=0; pab.num_differ=0;
+
+    // run 0 alone, the other runs are compared with it
+    pab.num_runs=1;
+    ApiWorker(&pab);
+    pab.num_runs=options->bench_api;
+
+    int num_threads=NumCores();
+    t0=GetTime();
+    thread* workers=new thread[num_threads];
+    for(i=1;i<num_threads;i++) workers[i]=thread(ApiWorker, &pab);
+    ApiWorker(&pab);
+    for(i=1;i<num_threads;i++) workers[i].join();
+    delete[] workers;
+    double run_time=GetTime()-t0;
+
+    fwrite(pab.first_output.buf, 1, pab.first_output.size, stdout);
+    printf("Compiled once in %.3f ms, %d runs on %d threads: %.3f s, %.0f runs/s, %d outputs differ from the first\n",
+           compile_time*1e3, pab.num_runs, num_threads, run_time, pab.num_runs/run_time, (int)pab.num_differ);
+    DestroyProgram(program);
+    fflush(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+
+void PrintUsage()
+{
+    printf("Usage: compiler [options] [input_file]\n");
+    printf("  -no-xref           don't collect line numbers for the symbol table listing\n");
+    printf("  -diag-json file    also write all the errors to file as JSON lines (- for stdout)\n");
+    printf("  -read file         take the values of read statements from file (- for stdin), no prompts\n");
+    printf("  -max-iterations n  stop after n repeat loop iterations (per record with -records)\n");
+    printf("  -max-time ms       stop a run that takes longer than ms milliseconds\n");
+    printf("  -max-output n      stop after writing n bytes (per record with -records)\n");
+    printf("  -stream            run each statement as soon as it is parsed, memory doesn't grow with the program\n");
+    printf("  -flat              run the program from the flat tree\n");
+    printf("  -bench-ast         compare the memory and walking speed of the syntax tree and the flat tree\n");
+    printf("  -specialize file   take the first read values from file and write a residual program instead of running\n");
+    printf("  -residual file     with -specialize, write the residual program to file instead of stdout\n");
+    printf("  -profile-out file  count the statements, branches and loop iterations of the run and write them to file\n");
+    printf("  -profile-in file   run the loops that were hot in a -profile-out run from the flat tree\n");
+    printf("  -no-tier           run every loop in the syntax tree, don't switch hot loops to the flat tree\n");
+    printf("  -loop-threads n    split counting repeat loops that only sum or multiply into variables over n threads (0 for all cores)\n");
+    printf("  -fp-reassociate    also split loops with real sums over threads and sum them in closed form, which may change the last digits\n");
+    printf("  -no-closed-form    run counting loops with polynomial sums instead of setting their results directly\n");
+    printf("  -checkpoint file   write the state of the run to file from time to time, removed when the run ends\n");
+    printf("  -checkpoint-every ms  time between checkpoints (default 10000, 0 for every 256 loop iterations)\n");
+    printf("  -resume file       go on from the checkpoint in file, with the same source and -read input\n");
+    printf("  -ir                run the program from its SSA form with registers allocated\n");
+    printf("  -dump-ir           print the SSA form of the program with the register of each value\n");
+    printf("  -bench-ir          compare the SSA form interpreter with the syntax tree interpreter on the input file\n");
+    printf("  -cost file         estimate the cost of a run and write it to file as JSON (- for stdout) instead of running\n");
+    printf("  -perf              print hardware counters per phase and per kind of node run\n");
+    printf("  -records file      run the program once per line of file, in lockstep batches\n");
+    printf("  -bench-records     with -records, compare against one RunProgram per record\n");
+    printf("  -threads n         with -records, run the records on n work stealing threads (0 for all cores)\n");
+    printf("  -bench-threads     with -records, measure the scaling from 1 thread to all cores\n");
+    printf("  -sessions          with -records, run the records as sessions on one thread that wait for each value\n");
+    printf("  -bench-sessions    with -records, compare the sessions with one RunProgram per record\n");
+    printf("  -lex-threads n     scan the source in chunks on n threads before parsing (0 for all cores)\n");
+    printf("  -lex-pipe          scan the source on another thread while parsing\n");
+    printf("  -lazy              parse the bodies of ifs and repeats the first time they run\n");
+    printf("  -bench-lex         compare the parallel scanner with the serial one on the input file\n");
+    printf("  -analyze-threads n type check the statements on n threads (0 for all cores)\n");
+    printf("  -bench-analyze     compare the parallel analyzer with the serial one on the input file\n");
+    printf("  -bench-compile n   compile the input file n times with new/delete and with a reused arena\n");
+    printf("  -bench-api n       compile the input file once and run it n times on all cores through the library interface\n");
+    printf("  -bench-symtab n    benchmark the symbol table with n colliding identifiers\n");
+    printf("  -bench-input n     benchmark parsing n int and n real input values\n");
+}
+
+bool ParseOptions(int argc, char** argv, CompilerOptions* opt)
+{
+    int i;
+    for(i=1;i<argc;i++)
+    {
+        const char* a=argv[i];
+        if(Equals(a, "-no-xref")) opt->print_xref=false;
+        else if(Equals(a, "-read") && i+1<argc) opt->read_str=argv[++i];
+        else if(Equals(a, "-diag-json") && i+1<argc) opt->diag_json_str=argv[++i];
+        else if(Equals(a, "-max-iterations") && i+1<argc) opt->limits.max_back_edges=atoll(argv[++i]);
+        else if(Equals(a, "-max-time") && i+1<argc) opt->limits.max_time_ms=atoi(argv[++i]);
+        else if(Equals(a, "-max-output") && i+1<argc) opt->limits.max_output_bytes=atoll(argv[++i]);
+        else if(Equals(a, "-records") && i+1<argc) opt->records_str=argv[++i];
+        else if(Equals(a, "-bench-records")) opt->bench_records=true;
+        else if(Equals(a, "-threads") && i+1<argc) {opt->num_threads=atoi(argv[++i]); if(opt->num_threads<=0) opt->num_threads=NumCores();}
+        else if(Equals(a, "-bench-threads")) opt->bench_threads=true;
+        else if(Equals(a, "-sessions")) opt->sessions=true;
+        else if(Equals(a, "-bench-sessions")) opt->bench_sessions=true;
+        else if(Equals(a, "-lex-threads") && i+1<argc) {opt->lex_threads=atoi(argv[++i]); if(opt->lex_threads<=0) opt->lex_threads=NumCores();}
+        else if(Equals(a, "-lex-pipe")) opt->lex_pipe=true;
+        else if(Equals(a, "-lazy")) opt->lazy=true;
+        else if(Equals(a, "-bench-lex")) opt->bench_lex=true;
+        else if(Equals(a, "-analyze-threads") && i+1<argc) {opt->analyze_threads=atoi(argv[++i]); if(opt->analyze_threads<=0) opt->analyze_threads=NumCores();}
+        else if(Equals(a, "-bench-analyze")) opt->bench_analyze=true;
+        else if(Equals(a, "-stream")) opt->stream=true;
+        else if(Equals(a, "-flat")) opt->flat=true;
+        else if(Equals(a, "-bench-ast")) opt->bench_ast=true;
+        else if(Equals(a, "-perf")) opt->perf=true;
+        else if(Equals(a, "-loop-threads") && i+1<argc) {opt->loop_threads=atoi(argv[++i]); if(opt->loop_threads<=0) opt->loop_threads=NumCores();}
+        else if(Equals(a, "-fp-reassociate")) opt->fp_reassociate=true;
+        else if(Equals(a, "-specialize") && i+1<argc) opt->specialize_str=argv[++i];
+        else if(Equals(a, "-cost") && i+1<argc) opt->cost_str=argv[++i];
+        else if(Equals(a, "-residual") && i+1<argc) opt->residual_str=argv[++i];
+        else if(Equals(a, "-profile-out") && i+1<argc) opt->profile_out_str=argv[++i];
+        else if(Equals(a, "-profile-in") && i+1<argc) opt->profile_in_str=argv[++i];
+        else if(Equals(a, "-no-tier")) opt->tier_up=false;
+        else if(Equals(a, "-no-closed-form")) opt->closed_form=false;
+        else if(Equals(a, "-checkpoint") && i+1<argc) opt->checkpoint_str=argv[++i];
+        else if(Equals(a, "-checkpoint-every") && i+1<argc) {opt->checkpoint_ms=atoi(argv[++i]); if(opt->checkpoint_ms<0) opt->checkpoint_ms=0;}
+        else if(Equals(a, "-resume") && i+1<argc) opt->resume_str=argv[++i];
+        else if(Equals(a, "-ir")) opt->run_ir=true;
+        else if(Equals(a, "-dump-ir")) opt->dump_ir=true;
+        else if(Equals(a, "-bench-ir")) opt->bench_ir=true;
+        else if(Equals(a, "-bench-compile") && i+1<argc) opt->bench_compile=atoi(argv[++i]);
+        else if(Equals(a, "-bench-api") && i+1<argc) opt->bench_api=atoi(argv[++i]);
+        else if(Equals(a, "-bench-symtab") && i+1<argc) opt->bench_symtab=atoi(argv[++i]);
+        else if(Equals(a, "-bench-input") && i+1<argc) opt->bench_input=atoi(argv[++i]);
+        else if(a[0]!='-') opt->in_str=a;
+        else return false;
+    }
+    if(opt->stream && opt->records_str) return false; // records need the whole tree
+    if(opt->lex_pipe && (opt->lex_threads || opt->stream)) return false;
+    if(opt->lazy && (opt->lex_pipe || opt->stream || opt->records_str || opt->flat || opt->run_ir || opt->dump_ir || opt->specialize_str ||
+                     opt->profile_out_str || opt->profile_in_str || opt->checkpoint_str || opt->resume_str || opt->cost_str)) return false;
+    if(opt->specialize_str && (opt->stream || opt->records_str)) return false;
+    if(opt->cost_str && (opt->stream || opt->specialize_str)) return false;
+    if((opt->profile_out_str || opt->profile_in_str) && (opt->stream || opt->records_str || opt->flat)) return false; // the profile is of the syntax tree interpreter
+    if((opt->checkpoint_str || opt->resume_str) && (opt->stream || opt->records_str || opt->flat || opt->specialize_str || opt->perf ||
+       opt->profile_out_str || opt->profile_in_str)) return false; // a checkpoint is a position in one run of the syntax tree
+    if(opt->run_ir && (opt->stream || opt->records_str || opt->flat || opt->perf || opt->profile_out_str || opt->profile_in_str ||
+       opt->checkpoint_str || opt->resume_str)) return false;
+    if(opt->dump_ir && opt->stream) return false;
+    return true;
+}
 
-int main()
+#ifndef COMPILER_NO_MAIN
+int main(int argc, char** argv)
 {
+    CompilerOptions options;
+    if(!ParseOptions(argc, argv, &options)) {PrintUsage(); return 1;}
+
+    if(options.bench_symtab>0) {BenchSymbolTable(options.bench_symtab); return 0;}
+    if(options.bench_input>0) {BenchInput(options.bench_input); return 0;}
+    if(options.bench_lex) {BenchLex(&options); return 0;}
+    if(options.bench_analyze) {BenchAnalyze(&options); return 0;}
+    if(options.bench_ast) {BenchAst(&options); return 0;}
+    if(options.bench_ir) {BenchIr(&options); return 0;}
+    if(options.bench_compile>0) {BenchCompile(&options); return 0;}
+    if(options.bench_api>0) {BenchApi(&options); return 0;}
+
     printf("Start main()\n"); fflush(NULL);
 
-    CompilerInfo compiler_info("input.txt", "output.txt", "debug.txt");
+    CompilerInfo compiler_info(options.in_str, "output.txt", "debug.txt");
+    compiler_info.options=options;
 
     // StartScanner(&compiler_info);
-    StartCompiler(&compiler_info);  
+    try {
+        StartCompiler(&compiler_info);
+    }
+    catch(const char* msg) {
+        printf("%s\n", msg); fflush(NULL);
+        return 1;
+    }
 
     printf("End main()\n"); fflush(NULL);
     return 0;
 }
+#endif // COMPILER_NO_MAIN
 
 ////////////////////////////////////////////////////////////////////////////////////